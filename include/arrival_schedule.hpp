@@ -0,0 +1,76 @@
+//
+// Created by Sanger Steel on 6/16/25.
+//
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "dataset_stream.hpp"
+#include "latency_metrics.hpp"
+#include "ring_buffers.hpp"
+
+enum class ArrivalDistribution {
+    CONSTANT,
+    POISSON,
+    // Gamma distributed gaps. Shapes below 1 are burstier than Poisson, above 1 smoother.
+    GAMMA,
+};
+
+std::optional<ArrivalDistribution> arrival_distribution_from_str(const std::string& str);
+
+struct ArrivalOptions {
+    double request_rate;
+    ArrivalDistribution distribution = ArrivalDistribution::POISSON;
+    double burstiness = 1.0;
+    uint64_t seed = 0;
+};
+
+// Offsets from the start of the benchmark at which each of `num_requests` requests
+// should be sent. The mean rate is `request_rate` for every distribution, and the
+// same seed always yields the same schedule.
+std::vector<std::chrono::nanoseconds> build_arrival_schedule(const ArrivalOptions& options, size_t num_requests);
+
+// Intended send times for a closed-loop worker. The worker means to send a request
+// every `expected_interval`. When a slow response holds it back, the requests after it
+// keep their intended times, so the corrected latencies count the time the server
+// stalled the client. The schedule never runs ahead of the worker.
+class ClosedLoopPacer {
+public:
+    explicit ClosedLoopPacer(std::optional<std::chrono::nanoseconds> expected_interval)
+        : expected_interval(expected_interval) {
+    }
+
+    time_point next_intended_start();
+
+private:
+    std::optional<std::chrono::nanoseconds> expected_interval;
+    std::optional<time_point> last_intended_start;
+};
+
+struct ScheduledRequest {
+    DatasetRow row;
+    time_point intended_start;
+
+    friend std::ostream& operator<<(std::ostream& os, const ScheduledRequest& r) {
+        return os << "ScheduledRequest(" << r.row.idx << ")";
+    }
+};
+
+// Hands scheduled requests from the dispatcher to the workers. Idle workers sleep on the
+// ring instead of spinning, since in open-loop mode most of them are waiting.
+class ScheduledRequestQueue {
+public:
+    void push(ScheduledRequest request);
+
+    // Returns nullopt once the queue is closed and drained
+    std::optional<ScheduledRequest> pop();
+
+    void close();
+
+private:
+    SPMCRingBuffer<ScheduledRequest, BlockingWait> ring;
+};
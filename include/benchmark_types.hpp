@@ -3,7 +3,6 @@
 //
 
 #pragma once
-#include <fstream>
 #include <string>
 #include "streaming_response.hpp"
 #include "completion_types.hpp"
@@ -11,17 +10,23 @@
 #include "result_types.hpp"
 #include "yaml-cpp/yaml.h"
 #include "logger.hpp"
+#include "arrival_schedule.hpp"
+#include "latency_histogram.hpp"
+#include "completion_parser.hpp"
+#include "work_stealing_executor.hpp"
+#include "task.hpp"
+#include "jsonl_writer.hpp"
+#include "columnar_writer.hpp"
+#include "dataset_cache.hpp"
+#include "dataset_stream.hpp"
 
 using RequestResultBuffer = std::shared_ptr<MPSCRingBuffer<RequestResult>>;
+using SharedHistograms = std::shared_ptr<LatencyHistogramRegistry>;
 using CompletionResultsBuffer = std::shared_ptr<std::vector<CompletionResults>>;
 using SharedClient = std::shared_ptr<CURLHandler>;
 
 using Rows = std::vector<json>;
 
-struct Data {
-    Rows rows;
-};
-
 
 struct Config {
     struct Value {
@@ -30,9 +35,13 @@ struct Config {
     };
 
     struct Dataset {
+        // Where a HF dataset is
         std::string tag;
         std::string subset;
         std::string split;
+        // Or where a local one is, and its format if its extension doesn't say
+        std::string path;
+        std::string format;
     };
 
     std::string pre_formatted_prompt;
@@ -58,51 +67,92 @@ class DatasetParsingStrategy {
 public:
     virtual ~DatasetParsingStrategy() = default;
 
-    virtual std::string get_url() = 0;
+    // Starts download() on a background thread. Rows are available from next_row() as
+    // soon as download() publishes them.
+    void start_download();
 
-    virtual Data& get_data();
-
-    virtual void download() = 0;
+    // Waits for the next row in dataset order. Returns nullopt once max_rows rows were
+    // handed out, or the dataset ended or failed to download.
+    std::optional<DatasetRow> next_row();
 
-    virtual bool add_rows(Data& data, std::string& uri) = 0;
+    // Stops a download that's still running, and rethrows whatever made it fail
+    void finish_download();
 
     virtual Config& get_config();
 
-    virtual json& get_row(int row_idx) = 0;
-
     int max_rows = 10000;
 
+    // Page requests in flight at once while downloading
+    int download_parallelism = 4;
+
+    // Most page requests sent per second, across all of them
+    double download_rate = 2;
+
+    // Where downloaded rows are saved and looked up before downloading, if set
+    std::optional<std::filesystem::path> cache_dir;
+
 protected:
-    int ms_between_curl = 500;
-    int offset = 0;
+    void initialize_config(const YAML::Node& config_yaml);
+
+    // Fetches the dataset and publishes its rows in order. Runs on the download thread.
+    virtual void download() = 0;
+
+    // An empty store for rows of this config
+    [[nodiscard]] RowStore make_row_store() const {
+        return RowStore(cfg.sentence_tags.size());
+    }
+
+    // Copies a row object's configured columns into store
+    void add_row(RowStore& store, const json& row) const {
+        store.add(row, cfg.sentence_tags, cfg.label.tag);
+    }
+
+    // Queues the rows of store for the benchmark, in order. Returns false once no more rows
+    // are wanted, because max_rows were published or the download was stopped.
+    bool publish_rows(std::shared_ptr<const RowStore> store);
+
+    // Stops and joins the download thread. Derived classes call it from their destructor,
+    // since download() can't run on a half destroyed object.
+    void stop_download();
+
     int rows_per_query = 100;
     Config cfg;
-    Data data;
+
+private:
+    DatasetRowQueue rows;
+    int published_rows = 0;
+    std::atomic<bool> stopping = false;
+    std::thread downloader;
+    std::exception_ptr download_error;
 };
 
 using Dataset = std::unique_ptr<DatasetParsingStrategy>;
 
 class HFDatasetParser final : public DatasetParsingStrategy {
 public:
-    explicit HFDatasetParser(const char* yaml_filename) : config_yaml(YAML::LoadFile(yaml_filename)) {
-        initialize_config();
+    explicit HFDatasetParser(const YAML::Node& config_yaml) {
+        initialize_config(config_yaml);
     }
 
+    ~HFDatasetParser() override {
+        stop_download();
+    }
 
-    void initialize_config();
-
-    std::string get_url() override;
+    std::string get_url(int offset);
 
+protected:
+    // Rows come from the cache if it has them, otherwise from download_rate limited pages
+    // fetched download_parallelism at a time
     void download() override;
 
-    bool add_rows(Data& data, std::string& uri) override;
-
-    static void parse_rows(Data& data, json& rows);
+private:
+    FetchedPage fetch_page(size_t page);
 
-    json& get_row(int row_idx) override;
+    // The "row" objects of entries, the first of which is dataset row first_row
+    [[nodiscard]] std::shared_ptr<const RowStore> to_row_store(std::span<const json> entries, size_t first_row) const;
 
-private:
-    YAML::Node config_yaml;
+    // The rows download() fetches: whole pages up to at least max_rows
+    [[nodiscard]] DatasetCacheKey cache_key(uint64_t rows) const;
 };
 
 
@@ -117,21 +167,39 @@ public:
 
     virtual ~DatasetToRequestStrategy() = default;
 
+    // Rows the benchmark asks for. The dataset may turn out to have fewer.
     virtual size_t dataset_size();
 
-    virtual std::string get_prompt_from_row(json& row);
+    virtual std::string get_prompt_from_row(const RowHandle& row);
 
-    virtual void fill_req_from_row(const Dataset& dataset, int row_idx, RequestParameters& req);
+    virtual void fill_req_from_row(const RowHandle& row, RequestParameters& req);
 
 private:
     Dataset dataset;
 };
 
+enum class RequestPipeline {
+    // A thread per in-flight request, blocked on its stream until the transfer finishes
+    THREADS,
+    // A coroutine per in-flight request, suspended while its stream has nothing new
+    COROUTINES,
+};
+
+std::optional<RequestPipeline> request_pipeline_from_str(const std::string& str);
+
+enum class OutputFormat {
+    // A JSON object per line
+    JSONL,
+    // Row groups of fixed-width columns and string heaps, see columnar_writer.hpp
+    COLUMNAR,
+};
+
+std::optional<OutputFormat> output_format_from_str(const std::string& str);
+
 struct RequestProcessingParameters {
     std::shared_ptr<StreamingResponse> resp;
-    CompletionResultsBuffer compl_result_buffer;
-    int max_retries = 0;
-    std::atomic<bool> finished = false;
+    ChunkParser chunk_parser = ChunkParser::ONDEMAND;
+    OutputFormat output_format = OutputFormat::JSONL;
 };
 
 class RequestTransportStrategy {
@@ -140,18 +208,30 @@ public:
 
     RequestResultBuffer request_results_buffer = std::make_shared<MPSCRingBuffer<RequestResult>>();
 
+    // Each sending thread records the latencies of the requests it completes here
+    SharedHistograms latency_histograms = std::make_shared<LatencyHistogramRegistry>();
+
+    ChunkParser chunk_parser = ChunkParser::ONDEMAND;
+
+    // Decides what the executor serializes results into, has to match the writer's
+    OutputFormat output_format = OutputFormat::JSONL;
+
+    // Parses, evaluates and serializes finished requests off the sending threads
+    std::shared_ptr<WorkStealingExecutor> executor = std::make_shared<WorkStealingExecutor>();
+
     virtual void send_and_add_to_buffer(
         const Dataset& dataset,
         RequestParameters& req,
         SharedClient& shared_client
     );
 
-    int fetch_and_add_job_id() {
-        return job_id.fetch_add(1, std::memory_order_acquire);
-    }
-
-private:
-    std::atomic<int> job_id;
+    // Same as send_and_add_to_buffer, but suspends instead of blocking while the response
+    // streams in, and finishes on the executor
+    task<void> send_and_add_to_buffer_async(
+        const Dataset& dataset,
+        RequestParameters req,
+        SharedClient shared_client
+    );
 };
 
 
@@ -163,14 +243,15 @@ public:
     ) : params(params), shared_client(shared_client) {
     };
 
-    void run();
+    // Every event of the stream in arrival order, returns once the stream is finalized
+    std::vector<StreamEvent> collect_events();
+
+    // Events taken from the stream per wakeup
+    static constexpr size_t MaxEventsPerFetch = 32;
 
 private:
-    int consecutive_retries = 0;
-    std::mutex compl_buffer_mutex;
     const RequestProcessingParameters& params;
     const std::shared_ptr<CURLHandler>& shared_client;
-    std::string json_str;
 };
 
 class RequestExecutor {
@@ -178,14 +259,20 @@ public:
     RequestExecutor(
         const Dataset& dataset,
         RequestParameters& req,
-        std::shared_ptr<CURLHandler>& shared_client
+        std::shared_ptr<CURLHandler>& shared_client,
+        ChunkParser chunk_parser = ChunkParser::ONDEMAND,
+        OutputFormat output_format = OutputFormat::JSONL
     ) : dataset(dataset), req(req), shared_client(shared_client) {
         params.resp = shared_client->post_stream(req);
-        params.max_retries = 100;
-        params.compl_result_buffer = std::make_shared<std::vector<CompletionResults>>();
+        params.chunk_parser = chunk_parser;
+        params.output_format = output_format;
     }
 
-    void send_request_and_collect_results(RequestResultBuffer& request_result_buffer);
+    void send_request_and_collect_results(
+        RequestResultBuffer& request_result_buffer,
+        LatencyHistogramRegistry& latency_histograms,
+        WorkStealingExecutor& executor
+    );
 
 private:
     const Dataset& dataset;
@@ -205,16 +292,16 @@ public:
         const Dataset& dataset
     );
 
-    void finalize() {
-        can_finish = true;
-    }
+    // Called once every request has pushed its result, lets the writer drain and return
+    void finalize(RequestResultBuffer& buf);
 
-    [[nodiscard]] bool producers_finished() const {
-        return can_finish;
-    }
+    // Longest a written line waits in the output buffer before it's flushed to the file
+    std::chrono::milliseconds flush_interval = std::chrono::milliseconds(1000);
 
-private:
-    bool can_finish = false;
+    // Also log every output line at INFO, JSONL only
+    bool echo_results = false;
+
+    OutputFormat output_format = OutputFormat::JSONL;
 };
 
 
@@ -223,22 +310,25 @@ public:
     FileWritingExecutor(
         Metrics& metrics,
         RequestResultBuffer& buf,
-        const Dataset& dataset, const char* filename
-    ) : metrics(metrics), buf(buf), dataset(dataset), stream(filename) {
-        if (!stream.is_open()) {
-            throw std::runtime_error("failed to open output file");
-        }
-    }
+        const Dataset& dataset, const char* filename,
+        std::chrono::milliseconds flush_interval,
+        bool echo_results,
+        OutputFormat output_format = OutputFormat::JSONL
+    );
 
-    void start_writing_loop(const std::function<bool()>& finalizer_callable);
+    void start_writing_loop();
+
+    // Results taken from the buffer per wakeup
+    static constexpr size_t MaxResultsPerFetch = 64;
 
 private:
     Metrics& metrics;
     RequestResultBuffer& buf;
     const Dataset& dataset;
-    std::ofstream stream;
-    const int max_consecutive_retries = 100;
-    int consecutive_retries = 0;
+    // Exactly one of these is open, depending on the output format
+    std::unique_ptr<BlockFileWriter> stream;
+    std::unique_ptr<ColumnarFileWriter> columnar;
+    bool echo_results;
 };
 
 
@@ -252,12 +342,48 @@ struct ProcessingStrategy {
         const char* filename_jsonl
     );
 
+    // In open-loop mode this only caps how many requests can be in flight at once
     const int concurrent_requests = 100;
+
+    // When set, requests are sent on this arrival schedule instead of each worker
+    // sending its next request as soon as its previous one finishes
+    std::optional<ArrivalOptions> arrival = std::nullopt;
+
+    // How often each closed-loop worker means to send a request. Without it, closed-loop
+    // requests are always on time and corrected latencies equal the raw ones.
+    std::optional<std::chrono::nanoseconds> expected_interval = std::nullopt;
+
+    RequestPipeline pipeline = RequestPipeline::THREADS;
+
+private:
+    void run_closed_loop_workers();
+
+    void run_open_loop_workers();
+
+    void run_closed_loop_coroutines();
+
+    void run_open_loop_coroutines();
 };
 
+// Tokens a streamed chunk carries, one per logprobs token, or one if it only has text
+int count_tokens(const CompletionResults& results);
+
+// Fills in the output token count, TTFT, inter-token latencies and TPOT of a request from
+// the arrival times of its chunks
+void record_token_timings(const std::vector<CompletionResults>& completion_results, LatencyMetrics& latencies);
+
 void get_request_and_send_loop(
     const Dataset& benchmark,
     RequestTransportStrategy& sender_and_parser,
     DatasetToRequestStrategy& data_processor,
-    SharedClient shared_client
+    SharedClient shared_client,
+    ClosedLoopPacer pacer
+);
+
+void get_scheduled_request_and_send_loop(
+    const Dataset& benchmark,
+    RequestTransportStrategy& sender_and_parser,
+    DatasetToRequestStrategy& data_processor,
+    SharedClient shared_client,
+    ScheduledRequestQueue& scheduled_requests
 );
@@ -0,0 +1,155 @@
+//
+// Created by Sanger Steel on 6/28/25.
+//
+
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "jsonl_writer.hpp"
+#include "mapped_file.hpp"
+#include "result_types.hpp"
+
+// Column-oriented results file, written in row groups and laid out so a reader can mmap
+// it and use every column in place. All integers are little-endian.
+//
+//   header   "SCALECOL", u32 version (1), u32 zero
+//   groups   for each row group, for each column, its buffers, each padded to 8 bytes
+//   footer   u32 column count, then per column: u32 name length, name, u8 type, u8 nullable
+//            u32 row group count, then per group: u64 rows, then for each column's
+//            buffers: u64 offset, u64 length
+//   trailer  u64 footer offset, "SCALECOL"
+//
+// A column's buffers are, in order: a u8 per row (1 when the row has a value) if it's
+// nullable, then its values, then for strings the bytes all its values point into.
+// Fixed-width values are f64, f32, i32 or u8 bools. A string column's values are
+// rows + 1 u64 offsets into its bytes, so row i is bytes[offsets[i], offsets[i + 1]).
+//
+// The columns are the JSONL keys: the fields visit_output_fields gives, in its order, then
+// one nullable f32 "<label>_logprob" column per label value of the config.
+enum class ColumnType : uint8_t {
+    F64 = 1,
+    F32 = 2,
+    I32 = 3,
+    BOOL = 4,
+    STRING = 5,
+};
+
+struct ColumnSpec {
+    std::string name;
+    ColumnType type;
+    bool nullable = false;
+
+    [[nodiscard]] size_t buffer_count() const {
+        return (nullable ? 1 : 0) + (type == ColumnType::STRING ? 2 : 1);
+    }
+};
+
+inline constexpr std::string_view ColumnarMagic = "SCALECOL";
+inline constexpr uint32_t ColumnarVersion = 1;
+
+// The columns OutputRows are written as, given the config's label responses. Throws if a
+// response is listed twice, since its column name would be too.
+std::vector<ColumnSpec> output_columns(const std::vector<std::string>& label_names);
+
+class ColumnarFileWriter {
+public:
+    static constexpr size_t DefaultRowsPerGroup = 1 << 16;
+
+    ColumnarFileWriter(
+        const char* filename,
+        const std::vector<std::string>& label_names,
+        size_t rows_per_group = DefaultRowsPerGroup
+    );
+
+    // Writes the last row group and the footer
+    ~ColumnarFileWriter();
+
+    ColumnarFileWriter(const ColumnarFileWriter&) = delete;
+
+    ColumnarFileWriter& operator=(const ColumnarFileWriter&) = delete;
+
+    void append(const OutputRow& row);
+
+    void close();
+
+private:
+    struct ColumnBuffers {
+        std::string validity;
+        std::string values;
+        std::string bytes;
+    };
+
+    struct RowGroup {
+        uint64_t rows;
+        // offset, length pairs of every column's buffers in order
+        std::vector<std::pair<uint64_t, uint64_t>> buffers;
+    };
+
+    void write_row_group();
+
+    void write_footer();
+
+    void append_padded(std::string_view buffer, RowGroup& group);
+
+    BlockFileWriter out;
+    std::vector<ColumnSpec> columns;
+    std::vector<ColumnBuffers> current;
+    size_t rows_in_current = 0;
+    size_t rows_per_group;
+    std::vector<RowGroup> groups;
+    bool closed = false;
+};
+
+// Read-only view of a columnar results file through a private mapping
+class ColumnarFile {
+public:
+    explicit ColumnarFile(const char* filename);
+
+    [[nodiscard]] const std::vector<ColumnSpec>& columns() const {
+        return specs;
+    }
+
+    // Throws if there's no such column
+    [[nodiscard]] size_t column_index(std::string_view name) const;
+
+    [[nodiscard]] size_t row_groups() const {
+        return groups.size();
+    }
+
+    [[nodiscard]] uint64_t rows(size_t group) const {
+        return groups[group].rows;
+    }
+
+    [[nodiscard]] uint64_t total_rows() const;
+
+    // The values of a fixed-width column, T has to match its type
+    template<typename T>
+    [[nodiscard]] std::span<const T> values(size_t group, size_t column) const {
+        auto buffer = value_buffer(group, column);
+        return {reinterpret_cast<const T*>(buffer.data()), buffer.size() / sizeof(T)};
+    }
+
+    [[nodiscard]] std::string_view string(size_t group, size_t column, size_t row) const;
+
+    // Always true for columns that aren't nullable
+    [[nodiscard]] bool has_value(size_t group, size_t column, size_t row) const;
+
+private:
+    struct RowGroup {
+        uint64_t rows;
+        std::vector<std::pair<uint64_t, uint64_t>> buffers;
+    };
+
+    [[nodiscard]] std::string_view buffer(size_t group, size_t idx) const;
+
+    [[nodiscard]] std::string_view value_buffer(size_t group, size_t column) const;
+
+    MappedFile file;
+    std::vector<ColumnSpec> specs;
+    // Index of each column's first buffer within a row group's buffers
+    std::vector<size_t> first_buffer;
+    std::vector<RowGroup> groups;
+};
@@ -0,0 +1,25 @@
+//
+// Created by Sanger Steel on 6/21/25.
+//
+
+#pragma once
+#include <optional>
+#include <string>
+#include <string_view>
+#include "completion_types.hpp"
+
+enum class ChunkParser {
+    // Builds a full nlohmann DOM for every chunk, kept to validate the on-demand parser
+    NLOHMANN,
+    // Reads the fields we use straight out of the payload and skips everything else
+    ONDEMAND,
+};
+
+std::optional<ChunkParser> chunk_parser_from_str(const std::string& str);
+
+// Parses one streamed completion chunk, i.e. the data of an SSE event, without building
+// a DOM. Only id, object, created, model and the choices' text, index, finish_reason and
+// logprobs are read. Throws std::runtime_error on malformed JSON.
+CompletionResults parse_completion_chunk(std::string_view payload);
+
+CompletionResults parse_completion_results(std::string_view payload, ChunkParser parser);
@@ -3,12 +3,119 @@
 //
 
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include "../external/json.hpp"
+#include "latency_metrics.hpp"
 
 
 using json = nlohmann::json;
-using TopLogprobs = std::vector<std::unordered_map<std::string, float>>;
+
+struct TopLogprob {
+    std::string_view token;
+    float logprob;
+};
+
+// The top logprobs of every token position, flattened. Token text for all positions
+// lives in one string arena, and each position is a run of (offset, len, logprob)
+// entries sorted by descending logprob. With 100 logprobs per token that's a few
+// allocations per chunk instead of a hash map and 100 strings per position.
+class TopLogprobs {
+public:
+    struct Entry {
+        uint32_t offset;
+        uint32_t len;
+        float logprob;
+    };
+
+    class Position {
+    public:
+        class Iterator {
+        public:
+            Iterator(const Entry* entry, const std::string* arena) : entry(entry), arena(arena) {
+            }
+
+            TopLogprob operator*() const {
+                return TopLogprob{std::string_view(*arena).substr(entry->offset, entry->len), entry->logprob};
+            }
+
+            Iterator& operator++() {
+                ++entry;
+                return *this;
+            }
+
+            bool operator==(const Iterator& other) const {
+                return entry == other.entry;
+            }
+
+        private:
+            const Entry* entry;
+            const std::string* arena;
+        };
+
+        Position(const Entry* first, const Entry* last, const std::string* arena)
+            : first(first), last(last), arena(arena) {
+        }
+
+        [[nodiscard]] Iterator begin() const {
+            return {first, arena};
+        }
+
+        [[nodiscard]] Iterator end() const {
+            return {last, arena};
+        }
+
+        [[nodiscard]] size_t size() const {
+            return last - first;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return first == last;
+        }
+
+        // The most likely token, positions are sorted
+        [[nodiscard]] TopLogprob front() const {
+            return *begin();
+        }
+
+    private:
+        const Entry* first;
+        const Entry* last;
+        const std::string* arena;
+    };
+
+    // Starts the next token position, which add() appends to
+    void begin_position();
+
+    void add(std::string_view token, float logprob);
+
+    // Sorts the current position by descending logprob
+    void end_position();
+
+    [[nodiscard]] size_t size() const {
+        return position_starts.size();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return position_starts.empty();
+    }
+
+    [[nodiscard]] Position operator[](size_t position) const;
+
+    // Sorts every position by descending logprob, then token
+    void sort();
+
+    bool operator==(const TopLogprobs& other) const;
+
+private:
+    void sort_position(size_t position);
+
+    std::string arena;
+    std::vector<Entry> entries;
+    // Index of each position's first entry
+    std::vector<uint32_t> position_starts;
+};
 
 TopLogprobs sort_top_logprobs(TopLogprobs& tops);
 
@@ -28,9 +135,11 @@ struct Logprobs {
 struct Choice {
     Logprobs logprobs;
     std::string finish_reason;
-    int index;
+    int index = 0;
     std::string text;
 
+    Choice() = default;
+
     Choice(json choice_json);
 };
 
@@ -50,6 +159,8 @@ struct CompletionResults {
     int created;
     std::vector<Choice> choices;
     std::string model;
+    // When the SSE event carrying this chunk arrived
+    time_point received;
 
     std::string to_string() {
         std::string str;
@@ -0,0 +1,73 @@
+//
+// Created by Sanger Steel on 6/15/25.
+//
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <curl/curl.h>
+
+constexpr size_t ConnectionPoolShards = 64;
+
+// Shares the DNS cache and TLS sessions, and optionally the connection cache,
+// between every easy handle that has it set as CURLOPT_SHARE.
+class CURLShare {
+public:
+    explicit CURLShare(bool share_connections);
+
+    ~CURLShare();
+
+    CURLShare(const CURLShare&) = delete;
+
+    CURLShare& operator=(const CURLShare&) = delete;
+
+    CURLSH* get() const {
+        return share;
+    }
+
+private:
+    static void lock_cb(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp);
+
+    static void unlock_cb(CURL* handle, curl_lock_data data, void* userp);
+
+    CURLSH* share;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> locks;
+};
+
+struct PooledHandle {
+    CURL* easy;
+    size_t shard;
+};
+
+// Keeps easy handles alive between requests so their connections (and through the
+// share, DNS entries and TLS sessions) are reused instead of re-handshaking every time.
+// Threads take shards round robin the first time they acquire, which spreads long-lived
+// workers over the shards. The threaded transport runs each request on a new thread, so
+// there consecutive requests land on different shards and a released handle is rarely
+// the next one acquired; its connections are still reused through the share's
+// connection cache. A handle always goes back to the shard it was acquired from.
+class ConnectionPool {
+public:
+    explicit ConnectionPool(CURLSH* share);
+
+    ~ConnectionPool();
+
+    PooledHandle acquire();
+
+    // Handles are reset before being handed out again, which keeps their connections
+    void release(PooledHandle handle);
+
+private:
+    struct Shard {
+        std::mutex mu;
+        std::vector<CURL*> idle;
+    };
+
+    static size_t worker_shard();
+
+    CURLSH* share;
+    std::array<Shard, ConnectionPoolShards> shards;
+};
@@ -13,6 +13,8 @@
 #include "request_parameters.hpp"
 #include "latency_metrics.hpp"
 #include "streaming_response.hpp"
+#include "event_loop.hpp"
+#include "connection_pool.hpp"
 
 using json = nlohmann::json;
 
@@ -21,9 +23,29 @@ static size_t write_cb_default(void* contents, size_t size, size_t nmemb, void*
 static size_t write_cb_to_queue(void* contents, size_t size, size_t nmemb, void* userp);
 
 
-// TODO: libcurl with libcurl_easy_perform might hit a ceiling at some point
-//       with a large number of concurrent requests, although GPU VRAM will probably
-//       bottleneck first
+enum class TransportMode {
+    // A std::thread running a blocking curl_easy_perform per request
+    THREAD_PER_REQUEST,
+    // Requests share curl_multi event loops, so in-flight requests cost a socket, not a thread
+    EVENT_LOOP,
+};
+
+struct TransportOptions {
+    TransportMode mode = TransportMode::THREAD_PER_REQUEST;
+    int event_loops = 1;
+    // Warm connections reuse pooled easy handles plus a shared DNS/TLS session/connection
+    // cache. Cold connections pay DNS, TCP and TLS handshakes on every request.
+    bool reuse_connections = true;
+    // Multiplex streams over HTTP/2 connections, only supported by the event loop transport
+    bool http2 = false;
+    // Connections to the host across every event loop, independent of request concurrency.
+    // 0 for no limit, otherwise at least event_loops.
+    long max_connections = 0;
+    long max_streams_per_connection = 100;
+};
+
+std::optional<TransportMode> transport_mode_from_str(const std::string& str);
+
 class CURLHandler {
 public:
     std::string uri;
@@ -31,9 +53,12 @@ public:
     explicit CURLHandler(
         const char* uri,
         const char* api_key = "",
-        std::optional<long> timeout = std::nullopt
+        std::optional<long> timeout = std::nullopt,
+        TransportOptions transport = {}
     );
 
+    ~CURLHandler();
+
     std::optional<long> timeout;
 
     static std::string get(const char* query);
@@ -42,17 +67,38 @@ public:
 
     LatencyMetrics await(std::shared_ptr<StreamingResponse> resp);
 
-    RingResult<std::string> fetch(const std::shared_ptr<StreamingResponse>& resp);
+    RingResult<StreamEvent> fetch(const std::shared_ptr<StreamingResponse>& resp);
 
     bool write_to_buffer_finished(const std::shared_ptr<StreamingResponse>&);
 
 private:
+    PooledHandle make_stream_handle(const std::shared_ptr<std::string>& post_data, StreamingResponse* resp);
+
+    void release_handle(PooledHandle handle);
+
+    void post_stream_threaded(const std::shared_ptr<std::string>& post_data,
+                              const std::shared_ptr<StreamingResponse>& resp);
+
+    void post_stream_event_loop(const std::shared_ptr<std::string>& post_data,
+                                const std::shared_ptr<StreamingResponse>& resp);
+
+    CURLEventLoop& next_event_loop();
+
     std::string api_key;
     curl_slist* headers = nullptr;
+    TransportOptions transport;
+    // Declared before the loops and pool so it outlives every handle attached to it
+    std::unique_ptr<CURLShare> share;
+    std::unique_ptr<ConnectionPool> pool;
+    std::vector<std::unique_ptr<CURLEventLoop>> event_loops;
+    std::atomic<size_t> next_loop_idx = 0;
+    StreamingResponsePool responses;
 };
 
 json parse_to_json(std::string json_str);
 
 bool str_contains(const std::string& str, const std::string& to_test);
 
-void push_chunks(StreamingResponse* streamed, std::string content);
+// Feeds a read from the socket to the stream's SSE parser and pushes every event it
+// completes. Events split across reads are completed by a later call.
+void push_chunks(StreamingResponse* streamed, std::string_view content, time_point received);
@@ -0,0 +1,68 @@
+//
+// Created by Sanger Steel on 6/29/25.
+//
+
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../external/json.hpp"
+
+using json = nlohmann::json;
+
+// Rows downloaded from one split of a HF dataset, saved so later runs can skip the
+// download. A file holds rows [first_row, last_row) of the split, and when the download
+// reached the end of the split, is flagged as holding the rest of it. All integers are
+// little-endian.
+//
+//   header  "SCALEROW", u32 version (1), u32 flags (DatasetCacheCompleteSplit)
+//           u64 first row, u64 row count, u32 key length, key ("tag\0subset\0split")
+//           padded to 8 bytes
+//   index   row count + 1 u64 offsets into the rows, so row i is rows[index[i], index[i + 1])
+//   rows    every row's "row" object as MessagePack
+//
+// Files are mmapped on load and only the rows asked for are decoded.
+struct DatasetCacheKey {
+    std::string tag;
+    std::string subset;
+    std::string split;
+    uint64_t first_row = 0;
+    uint64_t last_row = 0;
+    // The split ends at last_row, so the file serves any range starting from first_row
+    bool complete = false;
+
+    // e.g. "glue.cola.validation.0-1000.rows", or "glue.cola.validation.0-1043.end.rows"
+    // when complete, with anything but [A-Za-z0-9_-] in the dataset names replaced by '_'
+    [[nodiscard]] std::string filename() const;
+};
+
+inline constexpr std::string_view DatasetCacheMagic = "SCALEROW";
+inline constexpr uint32_t DatasetCacheVersion = 1;
+inline constexpr uint32_t DatasetCacheCompleteSplit = 1;
+
+class DatasetCache {
+public:
+    explicit DatasetCache(std::filesystem::path dir) : dir(std::move(dir)) {
+    }
+
+    // Rows [key.first_row, key.last_row) from any file in the cache that covers them, as
+    // {"row": ...} entries like the ones HF returns, or nullopt if no file does. A file
+    // holding the rest of the split covers any last_row, and gives the rows it has. Throws
+    // a std::runtime_error if the file found is malformed.
+    [[nodiscard]] std::optional<std::vector<json>> load(const DatasetCacheKey& key) const;
+
+    // Saves rows [key.first_row, key.last_row) given as HF's row entries, of which only
+    // "row" is kept, flagged as the rest of the split if key.complete. The file is written next to its final path and renamed into place,
+    // so a run that dies midway never leaves a partial file for the next one to load.
+    void store(const DatasetCacheKey& key, const std::vector<json>& rows) const;
+
+    [[nodiscard]] std::filesystem::path path_for(const DatasetCacheKey& key) const {
+        return dir / key.filename();
+    }
+
+private:
+    std::filesystem::path dir;
+};
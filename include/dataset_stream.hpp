@@ -0,0 +1,107 @@
+//
+// Created by Sanger Steel on 6/30/25.
+//
+
+#pragma once
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "../external/json.hpp"
+#include "latency_metrics.hpp"
+#include "ring_buffers.hpp"
+#include "row_store.hpp"
+
+using json = nlohmann::json;
+
+constexpr size_t DatasetRowQueueSize = 4096;
+
+// A row of the dataset with its position in it
+struct DatasetRow {
+    int idx = 0;
+    RowHandle row;
+};
+
+// Hands rows from the download to the benchmark in dataset order. Bounded, so a download
+// that runs ahead of the benchmark waits instead of holding the whole dataset.
+class DatasetRowQueue {
+public:
+    explicit DatasetRowQueue(size_t capacity = DatasetRowQueueSize) : ring(capacity) {
+    }
+
+    void push(DatasetRow row);
+
+    // Waits for the next row. Returns nullopt once the queue is closed and drained.
+    std::optional<DatasetRow> pop();
+
+    void close();
+
+private:
+    MPMCRingBuffer<DatasetRow, BlockingWait> ring;
+};
+
+// Spaces out page requests shared by every download thread, and backs all of them off
+// together when the server says it's rate limiting us. Consecutive rate limited responses
+// double the backoff, up to max_backoff.
+class DownloadRateLimiter {
+public:
+    explicit DownloadRateLimiter(
+        double pages_per_sec,
+        std::chrono::milliseconds initial_backoff = std::chrono::seconds(30),
+        std::chrono::milliseconds max_backoff = std::chrono::minutes(5)
+    );
+
+    // Waits for this caller's turn to send a request
+    void acquire();
+
+    // Holds every request back after a rate limited response
+    void back_off();
+
+    // Resets the backoff after a request went through
+    void succeeded();
+
+private:
+    std::mutex mutex;
+    std::chrono::nanoseconds interval;
+    std::chrono::milliseconds initial_backoff;
+    std::chrono::milliseconds max_backoff;
+    std::chrono::milliseconds backoff{0};
+    time_point next_slot;
+};
+
+enum class PageStatus {
+    OK,
+    RATE_LIMITED,
+    // Couldn't be parsed, worth retrying after a while
+    BAD_RESPONSE,
+    // Past the last page of the dataset
+    END,
+};
+
+struct FetchedPage {
+    explicit FetchedPage(PageStatus status, std::vector<json> rows = {}) : status(status), rows(std::move(rows)) {
+    }
+
+    PageStatus status;
+    std::vector<json> rows;
+};
+
+struct PageFetchOptions {
+    size_t parallelism = 4;
+    int max_failed_requests = 10;
+    std::chrono::milliseconds retry_delay = std::chrono::seconds(10);
+};
+
+// Fetches pages 0, 1, 2, ... with up to options.parallelism requests in flight and hands
+// them to deliver in page order, as soon as every page before them arrived. Stops at the
+// first END page, or once deliver returns false. Rate limited pages are retried after the
+// limiter's backoff, bad responses after retry_delay. Returns true if every page before
+// the END page was delivered, so the rows delivered are all there are. Throws once
+// max_failed_requests bad responses came back, or if fetch or deliver threw.
+bool fetch_pages_in_order(
+    const PageFetchOptions& options,
+    DownloadRateLimiter& limiter,
+    const std::function<FetchedPage(size_t page)>& fetch,
+    const std::function<bool(size_t page, std::vector<json>&& rows)>& deliver
+);
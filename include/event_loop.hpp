@@ -0,0 +1,89 @@
+//
+// Created by Sanger Steel on 6/14/25.
+//
+
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <curl/curl.h>
+
+struct EventLoopOptions {
+    // Multiplex transfers to the same host over shared HTTP/2 connections
+    bool multiplex = false;
+    // Caps connections per host, 0 for no limit. Transfers past the cap queue inside curl.
+    long max_connections = 0;
+    long max_concurrent_streams = 100;
+};
+
+// Called on the event loop thread once a transfer finishes. The easy handle has
+// already been removed from the multi handle, so the callback owns it again and
+// may clean it up or resubmit it. Transfers still unfinished when the loop is
+// destroyed get CURLE_ABORTED_BY_CALLBACK, on the destroying thread, and anything
+// resubmitted from then on is aborted straight away.
+using TransferDoneCallback = std::function<void(CURL*, CURLcode)>;
+
+// Drives many concurrent transfers from a single thread using curl_multi_socket_action.
+// On Linux sockets are watched with epoll, curl's timeout with a timerfd and submissions
+// from other threads wake the loop through an eventfd. Elsewhere it falls back to
+// curl_multi_poll, which is slower but keeps the same semantics.
+class CURLEventLoop {
+public:
+    explicit CURLEventLoop(const EventLoopOptions& options = {});
+
+    ~CURLEventLoop();
+
+    CURLEventLoop(const CURLEventLoop&) = delete;
+
+    CURLEventLoop& operator=(const CURLEventLoop&) = delete;
+
+    // Thread-safe. The handle is added to the multi handle on the loop thread.
+    void submit(CURL* easy, TransferDoneCallback on_done);
+
+    void stop();
+
+    [[nodiscard]] size_t in_flight() const {
+        return num_in_flight.load(std::memory_order_acquire);
+    }
+
+private:
+    struct PendingTransfer {
+        CURL* easy;
+        TransferDoneCallback on_done;
+    };
+
+    void run();
+
+    void wake();
+
+    void add_pending_transfers();
+
+    void check_finished_transfers();
+
+    // Fails every submitted transfer the loop hasn't picked up, and any submitted later
+    void abort_pending_transfers();
+
+    static int socket_cb(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+
+    static int timer_cb(CURLM* multi, long timeout_ms, void* userp);
+
+    CURLM* multi;
+    int epoll_fd = -1;
+    int timer_fd = -1;
+    int wake_fd = -1;
+
+    std::mutex pending_mu;
+    std::vector<PendingTransfer> pending;
+    // Set while the loop is destroyed, guarded by pending_mu
+    bool aborting = false;
+
+    // Only touched from the loop thread
+    std::unordered_map<CURL*, TransferDoneCallback> transfers;
+
+    std::atomic<size_t> num_in_flight = 0;
+    std::atomic<bool> stopping = false;
+    std::thread loop;
+};
@@ -0,0 +1,122 @@
+//
+// Created by Sanger Steel on 6/27/25.
+//
+
+#pragma once
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "latency_metrics.hpp"
+#include "result_types.hpp"
+
+// Writes one JSON object straight into a byte buffer, without building a json tree.
+// Values come out exactly as nlohmann's dump() prints them, and keys have to be given
+// in the order it would print them, i.e. sorted.
+class JsonObjectWriter {
+public:
+    // Starts the object at the end of out
+    explicit JsonObjectWriter(std::string& out);
+
+    void field(std::string_view key, std::string_view value);
+
+    // Without this a string literal would pick the bool overload
+    void field(std::string_view key, const char* value) {
+        field(key, std::string_view(value));
+    }
+
+    void field(std::string_view key, double value);
+
+    void field(std::string_view key, int value);
+
+    void field(std::string_view key, bool value);
+
+    // null when there's no value
+    void field(std::string_view key, std::optional<float> value);
+
+    // Closes the object and ends the line
+    void end_line();
+
+private:
+    void key(std::string_view name);
+
+    std::string& out;
+    bool first = true;
+};
+
+void append_json_string(std::string& out, std::string_view value);
+
+// Shortest round-trip digits, laid out like nlohmann: fixed point from 1e-4 up to 1e15
+// with a trailing ".0" for whole numbers, exponent notation outside that. nlohmann's
+// grisu2 now and then prints one more digit than needed, the value read back is the same.
+void append_json_number(std::string& out, double value);
+
+// Appends row as a JSONL line, the fields visit_output_fields gives plus a
+// "<label>_logprob" key for each label with a logprob, all in sorted order. label_names
+// are the config's label responses, a response listed twice gets one key.
+void append_output_line(std::string& out, const OutputRow& row, const std::vector<std::string>& label_names);
+
+// Appends bytes to a file through an aligned buffer. Full blocks are written with one
+// pwrite each at block-aligned offsets. A flush writes the partial block from its last
+// page boundary on and keeps it buffered, so the next write of that block starts at the
+// same aligned offset instead of shifting everything after it.
+class BlockFileWriter {
+public:
+    static constexpr size_t BlockSize = 1 << 20;
+    static constexpr size_t PageSize = 4096;
+
+    // Truncates filename. flush_interval is how long appended bytes may sit in the buffer
+    // before flush_if_due() writes them out.
+    BlockFileWriter(const char* filename, std::chrono::milliseconds flush_interval);
+
+    // Flushes and closes the file
+    ~BlockFileWriter();
+
+    BlockFileWriter(const BlockFileWriter&) = delete;
+
+    BlockFileWriter& operator=(const BlockFileWriter&) = delete;
+
+    void append(std::string_view bytes);
+
+    // Writes whatever is buffered but not on disk yet
+    void flush();
+
+    // Flushes if something has waited in the buffer for a flush interval
+    void flush_if_due();
+
+    // Bytes appended so far, i.e. the file offset the next append lands at
+    [[nodiscard]] size_t size() const {
+        return block_offset + used;
+    }
+
+    // Buffered bytes that aren't on disk yet
+    [[nodiscard]] size_t pending() const {
+        return used - flushed;
+    }
+
+    // How long until flush_if_due() would flush, zero when it's already due
+    [[nodiscard]] std::chrono::nanoseconds until_flush_due() const;
+
+    void close();
+
+private:
+    void write_at(const char* data, size_t len, size_t offset);
+
+    struct FreeDeleter {
+        void operator()(char* block) const {
+            std::free(block);
+        }
+    };
+
+    int fd = -1;
+    std::unique_ptr<char, FreeDeleter> block;
+    // File offset of block[0], always a multiple of BlockSize
+    size_t block_offset = 0;
+    size_t used = 0;
+    size_t flushed = 0;
+    std::chrono::milliseconds flush_interval;
+    time_point last_flush;
+};
@@ -0,0 +1,117 @@
+//
+// Created by Sanger Steel on 6/18/25.
+//
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "latency_metrics.hpp"
+
+// HDR-style log-linear histogram of latencies, recorded in microseconds. Each power of
+// two is split into 2^(SubBucketBits - 1) equal buckets, so any recorded value is known
+// to within 1 / 2^SubBucketBits (~0.4%) no matter its magnitude. Percentiles cost a walk
+// over the buckets instead of a sort over every result.
+//
+// record() is lock-free, so a histogram can be shared by threads when needed.
+class LatencyHistogram {
+public:
+    static constexpr int SubBucketBits = 8;
+    // Values are clamped to 2^MaxMagnitudeBits us, about 19 hours
+    static constexpr int MaxMagnitudeBits = 36;
+    static constexpr size_t SubBucketCount = size_t{1} << SubBucketBits;
+    static constexpr size_t SubBucketHalfCount = SubBucketCount / 2;
+    static constexpr size_t NumBuckets = SubBucketCount + (MaxMagnitudeBits - SubBucketBits) * SubBucketHalfCount;
+
+    LatencyHistogram() = default;
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(double seconds);
+
+    // Not safe to call while `other` is still being recorded into
+    void merge(const LatencyHistogram& other);
+
+    [[nodiscard]] uint64_t count() const;
+
+    // Percentile in [0, 100], in seconds
+    [[nodiscard]] double value_at_percentile(double percentile) const;
+
+    [[nodiscard]] double mean() const;
+
+    [[nodiscard]] double min() const;
+
+    [[nodiscard]] double max() const;
+
+    static size_t bucket_index(uint64_t micros);
+
+    // Midpoint of the values that land in the bucket, in microseconds
+    static uint64_t bucket_midpoint(size_t idx);
+
+private:
+    std::array<std::atomic<uint64_t>, NumBuckets> counts{};
+    std::atomic<uint64_t> total_count = 0;
+    std::atomic<uint64_t> sum_micros = 0;
+    std::atomic<uint64_t> min_micros = UINT64_MAX;
+    std::atomic<uint64_t> max_micros = 0;
+};
+
+struct LatencyHistograms {
+    LatencyHistogram ttft;
+    LatencyHistogram end_to_end_latency;
+    LatencyHistogram corrected_ttft;
+    LatencyHistogram corrected_end_to_end_latency;
+    LatencyHistogram inter_token_latency;
+    LatencyHistogram time_per_output_token;
+    LatencyHistogram queue_delay;
+
+    void record(const LatencyMetrics& latencies);
+
+    void merge(const LatencyHistograms& other);
+};
+
+struct LatencyPercentiles {
+    std::string name;
+    uint64_t count;
+    double min;
+    double mean;
+    double p50;
+    double p90;
+    double p95;
+    double p99;
+    double p999;
+    double max;
+};
+
+std::vector<LatencyPercentiles> summarize_histograms(const LatencyHistograms& histograms);
+
+std::string format_percentile_table(const std::vector<LatencyPercentiles>& rows);
+
+constexpr size_t HistogramShards = 64;
+
+// Gives each recording thread its own LatencyHistograms, created the first time the
+// thread records, and merges them once the benchmark is done. Threads past
+// HistogramShards share histograms, which is still safe since recording is lock-free.
+class LatencyHistogramRegistry {
+public:
+    LatencyHistogramRegistry() = default;
+
+    ~LatencyHistogramRegistry();
+
+    LatencyHistogramRegistry(const LatencyHistogramRegistry&) = delete;
+
+    LatencyHistogramRegistry& operator=(const LatencyHistogramRegistry&) = delete;
+
+    LatencyHistograms& local();
+
+    // Only call once recording threads have finished
+    void merge_into(LatencyHistograms& merged) const;
+
+private:
+    std::array<std::atomic<LatencyHistograms *>, HistogramShards> shards{};
+};
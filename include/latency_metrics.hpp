@@ -4,11 +4,37 @@
 
 #pragma once
 #include <chrono>
+#include <vector>
 
-using time_point = std::chrono::time_point<std::chrono::high_resolution_clock>;
+// Latencies and send schedules are differences between two readings, so they
+// need a clock that never jumps (high_resolution_clock is the wall clock on libstdc++)
+using monotonic_clock = std::chrono::steady_clock;
+using time_point = std::chrono::time_point<monotonic_clock>;
 
+// Raw latencies are measured from when the request was actually sent. Corrected
+// latencies are measured from when it was meant to be sent, so a stalled server
+// that holds back the client's next sends still shows up in them (coordinated omission).
 struct LatencyMetrics {
+    double time_to_first_byte;
     double ttft;
     double end_to_end_latency;
+    time_point intended_start;
+    time_point actual_start;
+    // Seconds between intended_start and actual_start
+    double queue_delay = 0;
+
+    int output_tokens = 0;
+    // Gaps between consecutive reads that carried tokens
+    std::vector<double> inter_token_latencies;
+    double time_per_output_token = 0;
+    double decode_tokens_per_sec = 0;
+
+    [[nodiscard]] double corrected_ttft() const {
+        return ttft + queue_delay;
+    }
+
+    [[nodiscard]] double corrected_end_to_end_latency() const {
+        return end_to_end_latency + queue_delay;
+    }
 };
 
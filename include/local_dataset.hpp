@@ -0,0 +1,79 @@
+//
+// Created by Sanger Steel on 7/1/25.
+//
+
+#pragma once
+#include <optional>
+#include <string>
+#include "benchmark_types.hpp"
+
+// Datasets read from a local file instead of the HF datasets server, set in the config as
+//
+//   dataset:
+//     path: /data/prompts.jsonl
+//     format: jsonl   # optional, taken from the extension otherwise
+//
+// The file is mmapped and its rows parsed one at a time as the benchmark takes them, so
+// memory stays flat however many rows it has. Each row needs the config's sentence_tags
+// and class_label tag, and the label has to be an integer.
+enum class LocalDatasetFormat {
+    // An object per line
+    JSONL,
+    // A header line naming the columns, then a record per line. Fields may be quoted,
+    // with "" for a quote inside them.
+    CSV,
+    // Needs a build with SCALE_WITH_ARROW
+    PARQUET,
+};
+
+std::optional<LocalDatasetFormat> local_dataset_format_from_str(const std::string& str);
+
+// The format key if it's set, otherwise the path's extension. Throws if neither names one.
+LocalDatasetFormat local_dataset_format(const Config::Dataset& dataset);
+
+class LocalDatasetParser : public DatasetParsingStrategy {
+public:
+    explicit LocalDatasetParser(const YAML::Node& config_yaml);
+};
+
+class JsonlDatasetParser final : public LocalDatasetParser {
+public:
+    using LocalDatasetParser::LocalDatasetParser;
+
+    ~JsonlDatasetParser() override {
+        stop_download();
+    }
+
+protected:
+    void download() override;
+};
+
+class CsvDatasetParser final : public LocalDatasetParser {
+public:
+    using LocalDatasetParser::LocalDatasetParser;
+
+    ~CsvDatasetParser() override {
+        stop_download();
+    }
+
+protected:
+    // Only the configured columns are kept
+    void download() override;
+};
+
+class ParquetDatasetParser final : public LocalDatasetParser {
+public:
+    using LocalDatasetParser::LocalDatasetParser;
+
+    ~ParquetDatasetParser() override {
+        stop_download();
+    }
+
+protected:
+    // Streams record batches of the configured columns across the row groups. Throws
+    // without SCALE_WITH_ARROW.
+    void download() override;
+};
+
+// A local parser if the config's dataset has a path, otherwise a HFDatasetParser
+Dataset make_dataset_parser(const char* yaml_filename);
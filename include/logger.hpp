@@ -3,8 +3,6 @@
 //
 
 #pragma once
-#include <mutex>
-#include <condition_variable>
 #include <thread>
 #include "latency_metrics.hpp"
 #include "ring_buffers.hpp"
@@ -29,12 +27,9 @@ public:
     static thread_local std::vector<time_point> time_starts;
 
 private:
+    // The display loop sleeps on the ring while nothing is being logged
     MPSCRingBuffer<std::string> messages;
     int fd;
-    std::condition_variable cv;
-    std::mutex mu;
-    bool done;
-    std::atomic<bool> ready_to_read;
     std::thread logger;
     std::ostream* stream;
 };
@@ -0,0 +1,33 @@
+//
+// Created by Sanger Steel on 7/1/25.
+//
+
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+
+// Read-only private mapping of a whole file, unmapped on destruction. what names the kind
+// of file in errors, e.g. "dataset file".
+class MappedFile {
+public:
+    MappedFile(const std::filesystem::path& path, std::string_view what);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Tells the kernel the file is read front to back, so it reads ahead further and
+    // drops pages behind the reader sooner
+    void advise_sequential() const;
+
+    [[nodiscard]] std::string_view bytes() const {
+        return {data, size};
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+};
@@ -0,0 +1,85 @@
+//
+// Created by Sanger Steel on 6/26/25.
+//
+
+#pragma once
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include "latency_metrics.hpp"
+
+// How often each golden label was answered with each label. The guessed label is nullopt
+// when the answer matched none of them. Sized by the label set, not the sample count.
+class ConfusionMatrix {
+public:
+    void add(int golden_label, std::optional<int> guessed_label);
+
+    [[nodiscard]] uint64_t count(int golden_label, std::optional<int> guessed_label) const;
+
+    [[nodiscard]] bool empty() const {
+        return counts.empty();
+    }
+
+    // One row per golden label, one column per guessed label
+    [[nodiscard]] std::string format() const;
+
+private:
+    std::map<std::pair<int, std::optional<int>>, uint64_t> counts;
+};
+
+// Folds every written result into running sums and tallies, so nothing about a result
+// has to be kept once it's written. Latency percentiles come from the histograms, this
+// only keeps what the averages and accuracy need. Only the writer thread adds to it.
+class MetricsAggregator {
+public:
+    void add(const LatencyMetrics& latencies, int golden_label, std::optional<int> guessed_label);
+
+    [[nodiscard]] uint64_t count() const {
+        return requests;
+    }
+
+    [[nodiscard]] double avg_ttft() const;
+
+    [[nodiscard]] double avg_e2e_latency() const;
+
+    [[nodiscard]] double avg_corrected_ttft() const;
+
+    [[nodiscard]] double avg_corrected_e2e_latency() const;
+
+    [[nodiscard]] double avg_queue_delay() const;
+
+    [[nodiscard]] double avg_ttfb() const;
+
+    // Only over requests that produced more than one token, the only ones TPOT is defined for
+    [[nodiscard]] double avg_tpot() const;
+
+    [[nodiscard]] double avg_decode_tokens_per_sec() const;
+
+    // Percent of requests answered with their golden label
+    [[nodiscard]] double accuracy() const;
+
+    [[nodiscard]] uint64_t output_tokens() const {
+        return total_output_tokens;
+    }
+
+    [[nodiscard]] const ConfusionMatrix& confusion() const {
+        return confusion_matrix;
+    }
+
+private:
+    uint64_t requests = 0;
+    uint64_t multi_token_requests = 0;
+    uint64_t guessed_correct = 0;
+    uint64_t total_output_tokens = 0;
+    double ttft_sum = 0;
+    double e2e_latency_sum = 0;
+    double corrected_ttft_sum = 0;
+    double corrected_e2e_latency_sum = 0;
+    double queue_delay_sum = 0;
+    double ttfb_sum = 0;
+    double tpot_sum = 0;
+    double decode_tokens_per_sec_sum = 0;
+    ConfusionMatrix confusion_matrix;
+};
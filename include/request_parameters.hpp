@@ -6,6 +6,8 @@
 #include <string>
 #include "../external/json.hpp"
 #include <format>
+#include <optional>
+#include "latency_metrics.hpp"
 
 using json = nlohmann::json;
 
@@ -21,6 +23,9 @@ struct RequestParameters {
     int top_k = 1;
     bool stream = true;
     int golden_label;
+    // When the request was meant to be sent, for coordinated-omission-corrected latencies.
+    // Unset means it was sent on time.
+    std::optional<time_point> intended_start;
 
     json to_json();
     std::string to_str();
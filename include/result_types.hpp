@@ -7,12 +7,65 @@
 #include "completion_types.hpp"
 #include "latency_metrics.hpp"
 #include "logger.hpp"
+#include "latency_histogram.hpp"
+#include "metrics_aggregator.hpp"
+
+// One output line's fields, the schema every output format writes
+struct OutputRow {
+    double corrected_e2e_latency;
+    double corrected_ttft;
+    double decode_tokens_per_sec;
+    double e2e_latency;
+    std::string finish_reason;
+    bool guessed_correctly;
+    std::string id;
+    std::string model;
+    std::string object;
+    int output_tokens;
+    std::string prompt;
+    double queue_delay;
+    std::string text;
+    double tpot;
+    double ttfb;
+    double ttft;
+    // Indexed like the config's label values, nullopt where the logprobs had no such label
+    std::vector<std::optional<float>> label_logprobs;
+};
+
+// Calls visit(name, value) for each of row's fields but the label logprobs, in the sorted
+// order nlohmann prints keys in. Every output format lays its fields out from this.
+template<typename Visit>
+void visit_output_fields(const OutputRow& row, Visit&& visit) {
+    visit("corrected_e2e_latency", row.corrected_e2e_latency);
+    visit("corrected_ttft", row.corrected_ttft);
+    visit("decode_tokens_per_sec", row.decode_tokens_per_sec);
+    visit("e2e_latency", row.e2e_latency);
+    visit("finish_reason", row.finish_reason);
+    visit("guessed_correctly", row.guessed_correctly);
+    visit("id", row.id);
+    visit("model", row.model);
+    visit("object", row.object);
+    visit("output_tokens", row.output_tokens);
+    visit("prompt", row.prompt);
+    visit("queue_delay", row.queue_delay);
+    visit("text", row.text);
+    visit("tpot", row.tpot);
+    visit("ttfb", row.ttfb);
+    visit("ttft", row.ttft);
+}
 
 struct RequestResult {
     RequestParameters params;
     std::vector<CompletionResults> completion_results;
     bool guessed_correctly;
+    // The label the answer matched, if any
+    std::optional<int> guessed_label;
     LatencyMetrics latencies;
+    // Newline-terminated output lines, serialized on the executor so the writer only has
+    // to copy bytes
+    std::string jsonl;
+    // The same lines as rows, filled instead of jsonl for the columnar output format
+    std::vector<OutputRow> rows;
 
     std::vector<json> to_json();
 
@@ -58,19 +111,28 @@ struct Metrics {
 
     explicit Metrics(const char* jsonl) : output_jsonl(jsonl) {
     };
-    time_point benchmark_start = std::chrono::high_resolution_clock::now();
+    time_point benchmark_start = monotonic_clock::now();
     time_point benchmark_end;
     double requests_processed = 0;
-    std::vector<RequestResult> req_results;
+    // Results are folded in as they're written and then dropped
+    MetricsAggregator aggregate;
+    std::shared_ptr<LatencyHistogramRegistry> latency_histograms;
 };
 
 struct FinalMetrics {
     double avg_ttft;
     double avg_e2e_latency;
+    double avg_corrected_ttft;
+    double avg_corrected_e2e_latency;
+    double avg_queue_delay;
+    double avg_ttfb;
+    double avg_tpot;
+    double avg_decode_tokens_per_sec;
     double requests_processed;
     double duration;
     double req_rate;
     double accuracy;
+    std::vector<LatencyPercentiles> latency_percentiles;
 
     std::string display();
 };
@@ -3,13 +3,23 @@
 //
 
 #pragma once
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
 #include <optional>
+#include <span>
 #include <string>
 #include <array>
 #include <execinfo.h>
 #include <thread>
+#include <vector>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <unistd.h>
 #include <__format/format_functions.h>
 
@@ -302,25 +312,705 @@ struct RingBuffer {
     }
 };
 
-template<typename T>
-struct SPMCRingBuffer : RingBuffer<T, RequestRingBufferMaxSize> {
-    bool producer_finished = false;
+constexpr size_t CacheLineSize = 64;
+
+// Wait strategies for MPMCRingBuffer's blocking push_wait() and fetch_wait(). A waiter
+// spins SpinsBeforeSleeping times, pausing and then yielding, before it sleeps on a futex
+// via std::atomic::wait until the other side notifies it.
+//
+// Spinning only pays off when the other side is a few hundred nanoseconds away. Most of
+// our consumers wait on the network, so the default sleeps soon after the ring drains.
+struct SpinWait {
+    // Never sleeps, so pushes and fetches never have to notify anyone
+    static constexpr size_t SpinsBeforeSleeping = std::numeric_limits<size_t>::max();
+};
+
+struct SpinThenWait {
+    static constexpr size_t SpinsBeforeSleeping = 128;
+};
+
+struct BlockingWait {
+    static constexpr size_t SpinsBeforeSleeping = 0;
+};
+
+template<typename Wait>
+constexpr bool wait_sleeps = Wait::SpinsBeforeSleeping != std::numeric_limits<size_t>::max();
+
+inline void spin_backoff(size_t spins) {
+    if (spins < 16) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        std::this_thread::yield();
+    }
+}
+
+// Lets threads sleep until a condition they polled may have changed, without taking a
+// lock on the notifying side. A waiter registers with prepare_wait(), re-checks its
+// condition, then sleeps on the epoch it got. notify_*() only touches the futex while
+// someone is registered. The fences order a waiter's re-check against the notifier's
+// update, so the notifier either sees the waiter or the waiter sees the update.
+//
+// std::atomic::wait can't time out, so wait_until() sleeps on a condition variable
+// instead. Notifiers only take its mutex when someone is registered, which is when they
+// pay for a futex wake anyway.
+class EventCount {
+public:
+    uint32_t prepare_wait() {
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_acquire);
+    }
+
+    void cancel_wait() {
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wait(uint32_t seen) {
+        epoch.wait(seen, std::memory_order_acquire);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Returns false if the deadline passed before a notify
+    template<typename Clock, typename Duration>
+    bool wait_until(uint32_t seen, std::chrono::time_point<Clock, Duration> deadline) {
+        bool notified;
+        {
+            std::unique_lock lock(timed_mutex);
+            notified = timed_cv.wait_until(lock, deadline, [&] {
+                return epoch.load(std::memory_order_acquire) != seen;
+            });
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return notified;
+    }
+
+    void notify_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            epoch.fetch_add(1, std::memory_order_release);
+            epoch.notify_one();
+            notify_timed();
+        }
+    }
+
+    void notify_all() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            epoch.fetch_add(1, std::memory_order_release);
+            epoch.notify_all();
+            notify_timed();
+        }
+    }
+
+private:
+    // A timed waiter checks epoch under the mutex, so taking it after bumping epoch means
+    // the waiter either saw the bump or is already waiting on the condition variable
+    void notify_timed() {
+        {
+            std::lock_guard lock(timed_mutex);
+        }
+        timed_cv.notify_all();
+    }
+
+    std::atomic<uint32_t> epoch = 0;
+    std::atomic<uint32_t> waiters = 0;
+    std::mutex timed_mutex;
+    std::condition_variable timed_cv;
+};
+
+// The blocking half of a ring buffer. A ring calls notify_pushed() and notify_fetched()
+// once its values are published, and builds its *_wait() methods on wait_to_push() and
+// wait_to_fetch(), which sleep per Wait between attempts.
+template<typename Wait>
+class RingWaiters {
+public:
+    // Retries try_push until it reports everything pushed
+    template<typename TryPush>
+    void wait_to_push(TryPush&& try_push) {
+        size_t spins = 0;
+        while (!try_push()) {
+            if (spins < Wait::SpinsBeforeSleeping) {
+                spin_backoff(spins++);
+                continue;
+            }
+            auto epoch = not_full.prepare_wait();
+            if (try_push()) {
+                not_full.cancel_wait();
+                return;
+            }
+            not_full.wait(epoch);
+        }
+    }
+
+    // Retries try_fetch until it gets something. Returns false once the ring is closed and
+    // is_empty() says it's drained.
+    template<typename TryFetch, typename IsEmpty>
+    bool wait_to_fetch(TryFetch&& try_fetch, IsEmpty&& is_empty) {
+        return wait_to_fetch_until(try_fetch, is_empty, std::optional<std::chrono::steady_clock::time_point>());
+    }
+
+    // Like wait_to_fetch(), but also returns false once deadline passes
+    template<typename TryFetch, typename IsEmpty>
+    bool wait_to_fetch_until(
+        TryFetch&& try_fetch,
+        IsEmpty&& is_empty,
+        std::optional<std::chrono::steady_clock::time_point> deadline
+    ) {
+        size_t spins = 0;
+        while (true) {
+            if (try_fetch()) {
+                return true;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // Anything pushed before close() is visible now
+                if (try_fetch()) {
+                    return true;
+                }
+                if (is_empty()) {
+                    return false;
+                }
+                // A push claimed a cell but hasn't finished writing it
+                spin_backoff(spins++);
+                continue;
+            }
+            if (spins < Wait::SpinsBeforeSleeping) {
+                if (deadline.has_value() && std::chrono::steady_clock::now() >= deadline.value()) {
+                    return false;
+                }
+                spin_backoff(spins++);
+                continue;
+            }
+            auto epoch = not_empty.prepare_wait();
+            if (!is_empty() || closed.load(std::memory_order_acquire)) {
+                not_empty.cancel_wait();
+                continue;
+            }
+            if (!deadline.has_value()) {
+                not_empty.wait(epoch);
+            } else if (!not_empty.wait_until(epoch, deadline.value())) {
+                return try_fetch();
+            }
+        }
+    }
+
+    void notify_pushed(size_t count) {
+        if constexpr (wait_sleeps<Wait>) {
+            if (count > 1) {
+                not_empty.notify_all();
+            } else {
+                not_empty.notify_one();
+            }
+        }
+    }
+
+    void notify_fetched(size_t count) {
+        if constexpr (wait_sleeps<Wait>) {
+            if (count > 1) {
+                not_full.notify_all();
+            } else {
+                not_full.notify_one();
+            }
+        }
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        if constexpr (wait_sleeps<Wait>) {
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+    }
+
+    void reopen() {
+        closed.store(false, std::memory_order_release);
+    }
+
+    [[nodiscard]] bool is_closed() const {
+        return closed.load(std::memory_order_acquire);
+    }
+
+private:
+    EventCount not_empty;
+    EventCount not_full;
+    std::atomic<bool> closed = false;
+};
+
+// Bounded MPMC queue after Dmitry Vyukov's design. Every cell carries a sequence number
+// that says whose turn it is: a producer may fill cell `pos & mask` once its sequence is
+// `pos`, and a consumer may empty it once its sequence is `pos + 1`. So producers and
+// consumers only contend on their own counter, never on a shared per-slot state, and
+// head and tail sit on separate cache lines. Capacity is rounded up to a power of two so
+// wrapping is a mask instead of a modulo.
+//
+// Cells are allocated a chunk at a time the first time a producer reaches them, so a
+// queue sized for the worst case only costs memory for what it actually holds.
+//
+// push() and fetch() never block. push_wait() and fetch_wait() wait according to the
+// Wait strategy, and close() releases every consumer once the ring is drained. The bulk
+// variants move a run of values for a single CAS on head or tail.
+template<typename T, typename Wait = SpinThenWait>
+class MPMCRingBuffer {
+public:
+    static constexpr size_t MaxCellsPerChunk = 256;
+
+    explicit MPMCRingBuffer(size_t min_capacity)
+        : cell_count(std::bit_ceil(std::max<size_t>(min_capacity, 2))),
+          mask(cell_count - 1),
+          cells_per_chunk(std::min(cell_count, MaxCellsPerChunk)),
+          chunk_shift(std::countr_zero(cells_per_chunk)),
+          chunks(std::make_unique<std::atomic<Cell *>[]>(cell_count / cells_per_chunk)) {
+    }
+
+    ~MPMCRingBuffer() {
+        for (size_t i = 0; i < cell_count / cells_per_chunk; ++i) {
+            delete[] chunks[i].load(std::memory_order_acquire);
+        }
+    }
+
+    MPMCRingBuffer(const MPMCRingBuffer&) = delete;
+
+    MPMCRingBuffer& operator=(const MPMCRingBuffer&) = delete;
+
+    // Only moves from content on success, so a FULL push can be retried with it
+    RingState push(T&& content) {
+        return push_with([&](T& value) { value = std::move(content); });
+    }
+
+    RingState push(const T& content) {
+        return push_with([&](T& value) { value = content; });
+    }
+
+    // Waits while the ring is full
+    template<typename U>
+    void push_wait(U&& content) {
+        // push() leaves content alone unless it succeeds, so retrying with it is safe
+        waiters.wait_to_push([&] {
+            return push(std::forward<U>(content)) == RingState::SUCCESS;
+        });
+    }
+
+    // Waits for the next value, or returns nullopt once the ring is closed and drained
+    std::optional<T> fetch_wait() {
+        std::optional<T> fetched;
+        waiters.wait_to_fetch([&] {
+            auto result = fetch();
+            if (result.state == RingState::SUCCESS) {
+                fetched = std::move(result.content);
+                return true;
+            }
+            return false;
+        }, [this] { return is_empty(); });
+        return fetched;
+    }
+
+    // Pushes as many of items as fit, in order, claiming their cells with a single CAS on
+    // head. Moves from the items it takes. Returns how many, 0 if the ring is full.
+    size_t push_bulk(std::span<T> items) {
+        if (items.empty()) {
+            return 0;
+        }
+        size_t pos = head.load(std::memory_order_relaxed);
+        size_t count;
+        while (true) {
+            auto diff = readiness(pos, true);
+            if (diff < 0) {
+                return 0;
+            }
+            if (diff > 0) {
+                pos = head.load(std::memory_order_relaxed);
+                continue;
+            }
+            // A ready cell stays ready until someone claims it, so the run can't shrink
+            // before the CAS, and a failed CAS means another producer moved head
+            count = 1;
+            while (count < items.size() && readiness(pos + count, true) == 0) {
+                count++;
+            }
+            if (head.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            auto* cell = find_cell(pos + i, true);
+            cell->value = std::move(items[i]);
+            cell->sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        waiters.notify_pushed(count);
+        return count;
+    }
+
+    // Appends up to max_items values to out, claiming them with a single CAS on tail.
+    // Returns how many, 0 if the ring is empty.
+    size_t fetch_bulk(std::vector<T>& out, size_t max_items) {
+        if (max_items == 0) {
+            return 0;
+        }
+        size_t pos = tail.load(std::memory_order_relaxed);
+        size_t count;
+        while (true) {
+            auto diff = readiness(pos, false);
+            if (diff < 0) {
+                return 0;
+            }
+            if (diff > 0) {
+                pos = tail.load(std::memory_order_relaxed);
+                continue;
+            }
+            count = 1;
+            while (count < max_items && readiness(pos + count, false) == 0) {
+                count++;
+            }
+            if (tail.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        out.reserve(out.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            auto* cell = find_cell(pos + i, false);
+            out.emplace_back(std::move(cell->value));
+            cell->sequence.store(pos + i + cell_count, std::memory_order_release);
+        }
+        waiters.notify_fetched(count);
+        return count;
+    }
+
+    // Waits until every item is pushed
+    void push_bulk_wait(std::span<T> items) {
+        size_t pushed = 0;
+        waiters.wait_to_push([&] {
+            pushed += push_bulk(items.subspan(pushed));
+            return pushed == items.size();
+        });
+    }
 
-    ~SPMCRingBuffer() = default;
+    // Waits until at least one value is appended to out, returns 0 once the ring is closed
+    // and drained
+    size_t fetch_bulk_wait(std::vector<T>& out, size_t max_items) {
+        size_t fetched = 0;
+        waiters.wait_to_fetch([&] {
+            fetched = fetch_bulk(out, max_items);
+            return fetched > 0;
+        }, [this] { return is_empty(); });
+        return fetched;
+    }
+
+    // Like fetch_bulk_wait(), but also returns 0 once deadline passes with nothing fetched
+    size_t fetch_bulk_wait_until(std::vector<T>& out, size_t max_items, std::chrono::steady_clock::time_point deadline) {
+        size_t fetched = 0;
+        waiters.wait_to_fetch_until([&] {
+            fetched = fetch_bulk(out, max_items);
+            return fetched > 0;
+        }, [this] { return is_empty(); }, deadline);
+        return fetched;
+    }
+
+    // No more pushes are coming. Consumers in fetch_wait() drain what's left, then return.
+    void close() {
+        waiters.close();
+    }
+
+    // Only for a drained ring that nobody is waiting on, e.g. one being recycled
+    void reopen() {
+        waiters.reopen();
+    }
+
+    [[nodiscard]] bool is_closed() const {
+        return waiters.is_closed();
+    }
+
+    RingResult<T> fetch() {
+        Cell* cell;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            cell = find_cell(pos, false);
+            if (!cell) {
+                // No producer has reached this chunk yet
+                return RingResult<T>(RingState::EMPTY, std::nullopt, 0);
+            }
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Nothing written here yet this lap
+                return RingResult<T>(RingState::EMPTY, std::nullopt, 0);
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        RingResult<T> result(RingState::SUCCESS, std::make_optional(std::move(cell->value)), pos & mask);
+        cell->sequence.store(pos + cell_count, std::memory_order_release);
+        waiters.notify_fetched(1);
+        return result;
+    }
+
+    // A push that has claimed a cell but not finished writing it counts as not empty
+    bool is_empty() const {
+        return tail.load(std::memory_order_acquire) >= head.load(std::memory_order_acquire);
+    }
 
-    std::atomic<bool> fetchable;
+    [[nodiscard]] size_t capacity() const {
+        return cell_count;
+    }
 
-    SPMCRingBuffer() = default;
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // 0 if the cell at pos is ready for the next producer, or consumer, to claim it. Negative
+    // if it's still a lap behind, i.e. the ring is full, or empty. Positive if another
+    // thread already claimed pos.
+    intptr_t readiness(size_t pos, bool producer) {
+        Cell* cell = find_cell(pos, producer);
+        if (!cell) {
+            return -1;
+        }
+        size_t expected = producer ? pos : pos + 1;
+        return static_cast<intptr_t>(cell->sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(expected);
+    }
+
+    template<typename Write>
+    RingState push_with(Write&& write) {
+        Cell* cell;
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            cell = find_cell(pos, true);
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The cell still holds the value from one lap ago
+                return RingState::FULL;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        write(cell->value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        waiters.notify_pushed(1);
+        return RingState::SUCCESS;
+    }
+
+    Cell* find_cell(size_t pos, bool allocate) {
+        size_t idx = pos & mask;
+        auto& chunk_slot = chunks[idx >> chunk_shift];
+        Cell* chunk = chunk_slot.load(std::memory_order_acquire);
+        if (!chunk) {
+            if (!allocate) {
+                return nullptr;
+            }
+            chunk = allocate_chunk(chunk_slot, idx & ~(cells_per_chunk - 1));
+        }
+        return &chunk[idx & (cells_per_chunk - 1)];
+    }
+
+    // Racing producers may both build the chunk, the loser frees its copy
+    Cell* allocate_chunk(std::atomic<Cell *>& chunk_slot, size_t first_idx) {
+        auto* fresh = new Cell[cells_per_chunk];
+        for (size_t i = 0; i < cells_per_chunk; ++i) {
+            fresh[i].sequence.store(first_idx + i, std::memory_order_relaxed);
+        }
+        Cell* expected = nullptr;
+        if (chunk_slot.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+            return fresh;
+        }
+        delete[] fresh;
+        return expected;
+    }
+
+    const size_t cell_count;
+    const size_t mask;
+    const size_t cells_per_chunk;
+    const int chunk_shift;
+    std::unique_ptr<std::atomic<Cell *>[]> chunks;
+
+    alignas(CacheLineSize) std::atomic<size_t> head = 0;
+    alignas(CacheLineSize) std::atomic<size_t> tail = 0;
+    alignas(CacheLineSize) RingWaiters<Wait> waiters;
+};
+
+// Ring for exactly one producer thread and one consumer thread, the shape of a single
+// HTTP stream. Each side owns its index and only stores to it, so nothing needs a CAS,
+// and each keeps a cached copy of the other side's index, so it only reads the other
+// side's cache line when the cached copy says the ring is full or empty. The interface
+// matches MPMCRingBuffer, so it can be swapped in wherever the one-to-one shape holds.
+template<typename T, typename Wait = SpinThenWait>
+class SPSCRingBuffer {
+public:
+    explicit SPSCRingBuffer(size_t min_capacity)
+        : cell_count(std::bit_ceil(std::max<size_t>(min_capacity, 2))),
+          mask(cell_count - 1),
+          cells(std::make_unique<T[]>(cell_count)) {
+    }
+
+    SPSCRingBuffer(const SPSCRingBuffer&) = delete;
+
+    SPSCRingBuffer& operator=(const SPSCRingBuffer&) = delete;
+
+    // Only moves from content on success, so a FULL push can be retried with it
+    RingState push(T&& content) {
+        return push_with([&](T& value) { value = std::move(content); });
+    }
+
+    RingState push(const T& content) {
+        return push_with([&](T& value) { value = content; });
+    }
+
+    template<typename U>
+    void push_wait(U&& content) {
+        waiters.wait_to_push([&] {
+            return push(std::forward<U>(content)) == RingState::SUCCESS;
+        });
+    }
+
+    // Pushes as many of items as fit, in order, moving from the items it takes
+    size_t push_bulk(std::span<T> items) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        size_t count = std::min(items.size(), free_cells(pos, items.size()));
+        for (size_t i = 0; i < count; ++i) {
+            cells[(pos + i) & mask] = std::move(items[i]);
+        }
+        if (count > 0) {
+            head.store(pos + count, std::memory_order_release);
+            waiters.notify_pushed(count);
+        }
+        return count;
+    }
 
+    void push_bulk_wait(std::span<T> items) {
+        size_t pushed = 0;
+        waiters.wait_to_push([&] {
+            pushed += push_bulk(items.subspan(pushed));
+            return pushed == items.size();
+        });
+    }
+
+    RingResult<T> fetch() {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        if (filled_cells(pos, 1) == 0) {
+            return RingResult<T>(RingState::EMPTY, std::nullopt, 0);
+        }
+        RingResult<T> result(RingState::SUCCESS, std::make_optional(std::move(cells[pos & mask])), pos & mask);
+        tail.store(pos + 1, std::memory_order_release);
+        waiters.notify_fetched(1);
+        return result;
+    }
+
+    std::optional<T> fetch_wait() {
+        std::optional<T> fetched;
+        waiters.wait_to_fetch([&] {
+            auto result = fetch();
+            if (result.state == RingState::SUCCESS) {
+                fetched = std::move(result.content);
+                return true;
+            }
+            return false;
+        }, [this] { return is_empty(); });
+        return fetched;
+    }
+
+    size_t fetch_bulk(std::vector<T>& out, size_t max_items) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        size_t count = std::min(max_items, filled_cells(pos, max_items));
+        out.reserve(out.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            out.emplace_back(std::move(cells[(pos + i) & mask]));
+        }
+        if (count > 0) {
+            tail.store(pos + count, std::memory_order_release);
+            waiters.notify_fetched(count);
+        }
+        return count;
+    }
+
+    size_t fetch_bulk_wait(std::vector<T>& out, size_t max_items) {
+        size_t fetched = 0;
+        waiters.wait_to_fetch([&] {
+            fetched = fetch_bulk(out, max_items);
+            return fetched > 0;
+        }, [this] { return is_empty(); });
+        return fetched;
+    }
+
+    void close() {
+        waiters.close();
+    }
+
+    // Only for a drained ring that nobody is waiting on, e.g. one being recycled
+    void reopen() {
+        waiters.reopen();
+    }
+
+    [[nodiscard]] bool is_closed() const {
+        return waiters.is_closed();
+    }
+
+    bool is_empty() const {
+        return tail.load(std::memory_order_acquire) >= head.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] size_t capacity() const {
+        return cell_count;
+    }
+
+private:
+    template<typename Write>
+    RingState push_with(Write&& write) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        if (free_cells(pos, 1) == 0) {
+            return RingState::FULL;
+        }
+        write(cells[pos & mask]);
+        head.store(pos + 1, std::memory_order_release);
+        waiters.notify_pushed(1);
+        return RingState::SUCCESS;
+    }
+
+    // Producer side. Only rereads tail when the cached copy can't cover wanted cells.
+    size_t free_cells(size_t pos, size_t wanted) {
+        if (cell_count - (pos - cached_tail) < wanted) {
+            cached_tail = tail.load(std::memory_order_acquire);
+        }
+        return cell_count - (pos - cached_tail);
+    }
+
+    // Consumer side. Only rereads head when the cached copy can't cover wanted cells.
+    size_t filled_cells(size_t pos, size_t wanted) {
+        if (cached_head - pos < wanted) {
+            cached_head = head.load(std::memory_order_acquire);
+        }
+        return cached_head - pos;
+    }
+
+    const size_t cell_count;
+    const size_t mask;
+    std::unique_ptr<T[]> cells;
+
+    alignas(CacheLineSize) std::atomic<size_t> head = 0;
+    size_t cached_tail = 0;
+    alignas(CacheLineSize) std::atomic<size_t> tail = 0;
+    size_t cached_head = 0;
+    alignas(CacheLineSize) RingWaiters<Wait> waiters;
+};
+
+// The original slot-state ring, kept so MPMCRingBuffer can be benchmarked against it
+template<typename T, std::size_t N>
+struct LegacyRingBuffer : RingBuffer<T, N> {
     RingState push(T content) {
         auto maybe_head = this->try_claim_head();
         if (!maybe_head.has_value()) {
             return RingState::FULL;
         }
-        this->send_to_slot(
-            std::move(maybe_head.value()),
-            std::move(content)
-        );
+        this->send_to_slot(maybe_head.value(), std::move(content));
         return RingState::SUCCESS;
     }
 
@@ -329,44 +1019,20 @@ struct SPMCRingBuffer : RingBuffer<T, RequestRingBufferMaxSize> {
         if (!maybe_tail.has_value()) {
             return RingResult<T>(RingState::EMPTY, std::nullopt, 0);
         }
-        auto claimed_tail = std::move(maybe_tail.value());
+        auto claimed_tail = maybe_tail.value();
         return RingResult<T>(RingState::SUCCESS, std::make_optional(this->receive_from_slot(claimed_tail)),
                              claimed_tail.idx_in_buffer);
     }
 };
 
-template<typename T>
-struct MPSCRingBuffer : RingBuffer<T, ResultsRingBufferMaxSize> {
-    ~MPSCRingBuffer() = default;
-
-    MPSCRingBuffer() = default;
-
-
-    RingState push(T content);
-
-    RingResult<T> fetch();
+template<typename T, typename Wait = SpinThenWait>
+struct SPMCRingBuffer : MPMCRingBuffer<T, Wait> {
+    explicit SPMCRingBuffer(size_t capacity = RequestRingBufferMaxSize) : MPMCRingBuffer<T, Wait>(capacity) {
+    }
 };
 
-// Are these even different from the SPMC buffer methods?
-template<typename T>
-RingState MPSCRingBuffer<T>::push(T content) {
-    auto maybe_head = this->try_claim_head();
-    if (!maybe_head.has_value()) {
-        return RingState::FULL;
-    }
-    auto claimed_head = std::move(maybe_head.value());
-    this->send_to_slot(claimed_head, std::move(content));
-    this->slots_written.store(this->slots_written + 1, std::memory_order_release);
-    return RingState::SUCCESS;
-}
-
-template<typename T>
-RingResult<T> MPSCRingBuffer<T>::fetch() {
-    auto maybe_tail = this->try_claim_tail();
-    if (!maybe_tail.has_value()) {
-        return RingResult<T>(RingState::EMPTY, std::nullopt, 0);
-    }
-    auto claimed_tail = std::move(maybe_tail.value());
-    return RingResult<T>(RingState::SUCCESS, std::make_optional(this->receive_from_slot(claimed_tail)),
-                         claimed_tail.idx_in_buffer);
-}
+template<typename T, typename Wait = SpinThenWait>
+struct MPSCRingBuffer : MPMCRingBuffer<T, Wait> {
+    explicit MPSCRingBuffer(size_t capacity = ResultsRingBufferMaxSize) : MPMCRingBuffer<T, Wait>(capacity) {
+    }
+};
@@ -0,0 +1,87 @@
+//
+// Created by Sanger Steel on 7/2/25.
+//
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../external/json.hpp"
+
+using json = nlohmann::json;
+
+// Rows handed out at once by the parsers that build RowStores a batch at a time
+constexpr size_t RowStoreBatchRows = 1024;
+
+// Dataset rows cut down to what a request is built from: each row's sentence_tags values,
+// back to back in one string arena, and its integer label. A sentence is a pair of
+// offsets into the arena and a label is an int, so looking either up is two loads with
+// no hashing or allocation, and a row costs its text plus a few words instead of a JSON
+// object with a heap node per field.
+class RowStore {
+public:
+    explicit RowStore(size_t sentences_per_row, size_t expected_rows = RowStoreBatchRows);
+
+    // Copies the sentence_tags values and label_tag out of a row object. Throws if one is
+    // missing or isn't a string, or an integer that fits an int for the label.
+    void add(const json& row, std::span<const std::string> sentence_tags, const std::string& label_tag);
+
+    // sentences in sentence_tags order
+    void add(std::span<const std::string_view> sentences, int label);
+
+    [[nodiscard]] size_t size() const {
+        return labels.size();
+    }
+
+    [[nodiscard]] size_t sentences_per_row() const {
+        return per_row;
+    }
+
+    [[nodiscard]] std::string_view sentence(size_t row, size_t column) const {
+        auto at = row * per_row + column;
+        return {arena.data() + offsets[at], offsets[at + 1] - offsets[at]};
+    }
+
+    [[nodiscard]] int label(size_t row) const {
+        return labels[row];
+    }
+
+    // Bytes allocated for the rows
+    [[nodiscard]] size_t memory_usage() const;
+
+private:
+    size_t per_row;
+    std::string arena;
+    // Where each sentence starts in the arena, plus the end of the last one
+    std::vector<uint64_t> offsets;
+    std::vector<int> labels;
+};
+
+// A row of a RowStore. Handles share ownership of their store, so a batch is freed once
+// the benchmark is done with its last row.
+class RowHandle {
+public:
+    RowHandle() = default;
+
+    RowHandle(std::shared_ptr<const RowStore> store, size_t row) : store(std::move(store)), row(row) {
+    }
+
+    [[nodiscard]] std::string_view sentence(size_t column) const {
+        return store->sentence(row, column);
+    }
+
+    [[nodiscard]] size_t sentence_count() const {
+        return store->sentences_per_row();
+    }
+
+    [[nodiscard]] int label() const {
+        return store->label(row);
+    }
+
+private:
+    std::shared_ptr<const RowStore> store;
+    size_t row = 0;
+};
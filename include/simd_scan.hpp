@@ -0,0 +1,29 @@
+//
+// Created by Sanger Steel on 6/20/25.
+//
+
+#pragma once
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+// Byte scanning used by the SSE parser, which sees every byte of every stream. Each
+// kernel implements the same functions, and the widest one the CPU supports is picked
+// once at startup. The scalar kernel is the reference the others are tested against.
+struct ScanKernel {
+    const char* name;
+
+    // Offset just past the first blank line ("\n\n" or "\n\r\n") in data, or npos
+    size_t (*find_event_end)(const char* data, size_t len);
+
+    // Offset of the first occurrence of needle in data, or npos
+    size_t (*find_substring)(const char* data, size_t len, std::string_view needle);
+};
+
+const ScanKernel& scalar_scan_kernel();
+
+// Every kernel this CPU can run, scalar first
+std::vector<const ScanKernel *> supported_scan_kernels();
+
+// The fastest supported kernel
+const ScanKernel& scan_kernel();
@@ -0,0 +1,56 @@
+//
+// Created by Sanger Steel on 6/19/25.
+//
+
+#pragma once
+#include <optional>
+#include <string>
+#include <string_view>
+#include "simd_scan.hpp"
+
+// Incremental parser for a text/event-stream body. Bytes are fed in as libcurl hands
+// them over, and an event split across reads is kept until the rest of it arrives.
+// Events are handed out as views into the parser's buffer, so nothing is copied until
+// the caller decides to keep an event.
+//
+// Not thread-safe. Each stream gets its own parser, fed from its write callback.
+class SSEParser {
+public:
+    explicit SSEParser(const ScanKernel& kernel = scan_kernel()) : kernel(&kernel) {
+    }
+
+    // Views returned by next_event() are invalidated by the next call to feed()
+    void feed(std::string_view bytes);
+
+    // The `data` of the next complete event, or nullopt until more bytes are fed.
+    // Events without data (comments, keep-alives) are skipped, and `[DONE]` marks
+    // the stream as done instead of being returned.
+    std::optional<std::string_view> next_event();
+
+    [[nodiscard]] bool done() const {
+        return saw_done;
+    }
+
+    // Bytes of an event that hasn't been terminated yet
+    [[nodiscard]] std::string_view pending() const {
+        return std::string_view(buffer).substr(consumed);
+    }
+
+    void reset();
+
+private:
+    // Offset just past the blank line that ends the next event, or npos
+    size_t find_event_end();
+
+    std::optional<std::string_view> extract_data(std::string_view event);
+
+    const ScanKernel* kernel;
+    std::string buffer;
+    // Start of the first event not handed out yet
+    size_t consumed = 0;
+    // No event delimiter starts before this
+    size_t scanned = 0;
+    // Multi-line data has to be joined, which is the only case that copies
+    std::string joined;
+    bool saw_done = false;
+};
@@ -5,32 +5,151 @@
 #pragma once
 #include "ring_buffers.hpp"
 #include "latency_metrics.hpp"
+#include "sse_parser.hpp"
+#include <coroutine>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
+
+// One SSE `data:` payload, stamped with when its bytes arrived from the socket
+struct StreamEvent {
+    std::string payload;
+    time_point received;
+    // Which try of the transfer it came from. A retry starts the stream over, so the
+    // consumer keeps only the events of the last attempt.
+    uint32_t attempt = 0;
+
+    friend std::ostream& operator<<(std::ostream& os, const StreamEvent& event) {
+        return os << event.payload;
+    }
+};
+
+// Enough room for every event of a max_tokens completion plus the final and [DONE]
+// events, clamped so a huge max_tokens can't size a ring the stream will never fill.
+// Producers block on a full ring, so the clamp only costs throughput, never data.
+size_t stream_ring_capacity(int max_tokens);
 
 class StreamingResponse {
 public:
-    bool got_ttft;
+    explicit StreamingResponse(size_t ring_capacity);
+
+    bool got_ttft = false;
     time_point start;
+    time_point intended_start;
     LatencyMetrics latencies;
     std::thread t;
-    std::condition_variable cv;
-    bool done;
+    // Set by finalize(), event loop transfers are awaited with done.wait(false)
+    std::atomic<bool> done = false;
 
     bool check_producer_finished();
 
-    bool ready_to_fetch() const;
-
     void finalize();
 
-    std::mutex mu;
+    // Only touched by the transfer's write callback
+    SSEParser parser;
+
+    // Only touched by the transfer, bumped by retry()
+    uint32_t attempt = 0;
+
+    // Called before a failed transfer is sent again. Drops whatever the failed attempt left
+    // half parsed, and stamps the events of the new one so its earlier events can be told
+    // apart, since the consumer may have taken them already.
+    void retry();
+
+    void push(StreamEvent event);
 
-    void push(std::string str);
+    // Pushes every event, in order, moving from them
+    void push_bulk(std::span<StreamEvent> events);
 
-    RingResult<std::string> fetch();
+    RingResult<StreamEvent> fetch();
+
+    // Sleeps until the next event arrives, or returns nullopt once the stream is finalized
+    // and every event has been fetched
+    std::optional<StreamEvent> fetch_wait();
+
+    // Appends up to max_events to out, sleeping until there's at least one. Returns 0 once
+    // the stream is finalized and drained.
+    size_t fetch_bulk_wait(std::vector<StreamEvent>& out, size_t max_events);
+
+    [[nodiscard]] size_t ring_capacity() const {
+        return ring.capacity();
+    }
+
+    // Clears everything a finished request left behind so the response can be reused. Joins
+    // the transfer thread, so it mustn't be called from it.
+    void reset();
+
+    // Registers a coroutine to resume on the next push or on finalize(). Returns false,
+    // with nothing registered, when an event or the close already arrived, in which case
+    // the caller carries on instead of suspending.
+    bool park(std::coroutine_handle<> consumer);
 
 private:
-    std::atomic<bool> fetchable;
-    SPMCRingBuffer<std::string> ring;
+    // Resumes the parked coroutine, if any, on the producer's thread
+    void resume_waiter();
+
+    // Address of the coroutine consuming the stream while it's suspended on an empty ring
+    std::atomic<void*> waiter = nullptr;
+
+    // The transfer's write callback is the only producer and the request's worker thread
+    // the only consumer, which also keeps events in the order they arrived. Both sides
+    // wait on the network far longer than spinning could pay off, so they sleep right away.
+    SPSCRingBuffer<StreamEvent, BlockingWait> ring;
+};
+
+// co_await next_event(resp) gives the stream's next event, or nullopt once it's finalized
+// and drained. Only suspends on an empty ring, and the producer resumes the coroutine on
+// its own thread, e.g. an event loop's, so whatever follows should be kept short or moved
+// to an executor.
+class StreamEventAwaiter {
+public:
+    explicit StreamEventAwaiter(std::shared_ptr<StreamingResponse> resp) : resp(std::move(resp)) {
+    }
+
+    bool await_ready();
+
+    bool await_suspend(std::coroutine_handle<> consumer);
+
+    std::optional<StreamEvent> await_resume();
+
+private:
+    // True once there's an event or the stream is finished
+    bool try_take();
+
+    std::shared_ptr<StreamingResponse> resp;
+    std::optional<StreamEvent> event;
+    bool taken = false;
+};
+
+inline StreamEventAwaiter next_event(const std::shared_ptr<StreamingResponse>& resp) {
+    return StreamEventAwaiter(resp);
+}
+
+constexpr size_t MaxIdleStreamingResponses = 256;
+
+// Recycles StreamingResponses so a request doesn't construct a ring and parser buffer
+// from scratch. Responses go back to the pool when the last shared_ptr to them drops,
+// unless max_idle are already waiting there, or the last reference was dropped by the
+// response's own transfer thread, which is still running and can't join itself.
+class StreamingResponsePool {
+public:
+    explicit StreamingResponsePool(size_t max_idle = MaxIdleStreamingResponses);
+
+    // A reset response whose ring holds at least ring_capacity events
+    std::shared_ptr<StreamingResponse> acquire(size_t ring_capacity);
+
+    [[nodiscard]] size_t idle() const;
+
+private:
+    // Shared with every deleter, so responses released after the pool is gone just free
+    struct State {
+        mutable std::mutex mu;
+        std::vector<std::unique_ptr<StreamingResponse>> free;
+        size_t max_idle;
+    };
+
+    std::shared_ptr<State> state;
 };
 
 
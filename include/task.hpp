@@ -0,0 +1,230 @@
+//
+// Created by Sanger Steel on 6/25/25.
+//
+
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// Lazily started coroutine returning a T. Nothing runs until the task is co_awaited, and
+// the awaiting coroutine is resumed straight from the task's final suspend, so chains of
+// tasks don't grow the stack. A task has a single owner and can be awaited once.
+template<typename T = void>
+class task;
+
+namespace task_detail {
+struct FinalAwaiter {
+    bool await_ready() noexcept {
+        return false;
+    }
+
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+        auto continuation = finished.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {
+    }
+};
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        exception = std::current_exception();
+    }
+};
+
+template<typename Promise>
+class TaskBase {
+public:
+    TaskBase(TaskBase&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {
+    }
+
+    TaskBase& operator=(TaskBase&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~TaskBase() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    struct Awaiter {
+        std::coroutine_handle<Promise> handle;
+
+        bool await_ready() noexcept {
+            return !handle || handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+
+        decltype(auto) await_resume() {
+            auto& promise = handle.promise();
+            if (promise.exception) {
+                std::rethrow_exception(promise.exception);
+            }
+            return promise.result();
+        }
+    };
+
+    Awaiter operator co_await() noexcept {
+        return Awaiter{handle};
+    }
+
+protected:
+    explicit TaskBase(std::coroutine_handle<Promise> handle) : handle(handle) {
+    }
+
+    std::coroutine_handle<Promise> handle;
+};
+
+
+template<typename T>
+struct TaskPromise : PromiseBase {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+
+    template<typename U>
+    void return_value(U&& result) {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T result() {
+        return std::move(value.value());
+    }
+};
+
+template<>
+struct TaskPromise<void> : PromiseBase {
+    task<void> get_return_object();
+
+    void return_void() {
+    }
+
+    void result() {
+    }
+};
+}
+
+template<typename T>
+class task : public task_detail::TaskBase<task_detail::TaskPromise<T>> {
+public:
+    using promise_type = task_detail::TaskPromise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> handle) : task_detail::TaskBase<promise_type>(handle) {
+    }
+};
+
+template<typename T>
+task<T> task_detail::TaskPromise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+inline task<void> task_detail::TaskPromise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+// Coroutine nobody awaits, it frees itself when it finishes
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        // spawn() catches everything, so nothing can get here
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+// Starts work on the calling thread and returns at its first suspension. on_done runs
+// wherever work finishes, with the exception it threw, if any.
+inline DetachedTask spawn(task<void> work, std::function<void(std::exception_ptr)> on_done) {
+    std::exception_ptr error;
+    try {
+        co_await work;
+    } catch (...) {
+        error = std::current_exception();
+    }
+    on_done(error);
+}
+
+namespace task_detail {
+// Heap-allocated so the finishing thread can still notify after the waiter has returned
+struct SyncWaitState {
+    std::atomic<bool> finished = false;
+    std::exception_ptr error;
+
+    void wait() {
+        finished.wait(false, std::memory_order_acquire);
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+inline std::function<void(std::exception_ptr)> notify_sync_wait(const std::shared_ptr<SyncWaitState>& state) {
+    return [state](std::exception_ptr error) {
+        state->error = error;
+        state->finished.store(true, std::memory_order_release);
+        state->finished.notify_all();
+    };
+}
+}
+
+// Blocks the calling thread until work finishes, for tests and non-coroutine callers
+template<typename T>
+T sync_wait(task<T> work) {
+    std::optional<T> result;
+    auto state = std::make_shared<task_detail::SyncWaitState>();
+    spawn([](task<T> inner, std::optional<T>& out) -> task<void> {
+        out.emplace(co_await inner);
+    }(std::move(work), result), task_detail::notify_sync_wait(state));
+    state->wait();
+    return std::move(result.value());
+}
+
+inline void sync_wait(task<void> work) {
+    auto state = std::make_shared<task_detail::SyncWaitState>();
+    spawn(std::move(work), task_detail::notify_sync_wait(state));
+    state->wait();
+}
@@ -0,0 +1,92 @@
+//
+// Created by Sanger Steel on 6/24/25.
+//
+
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "ring_buffers.hpp"
+
+// Fixed pool of threads for the CPU-bound work around a request: parsing its events,
+// evaluating the answer and serializing the result. Each worker owns a deque. A task
+// submitted from a worker goes on that worker's deque and is popped LIFO, so a request's
+// data stays in one core's cache. Idle workers steal FIFO from the others, and tasks
+// submitted from outside the pool are spread round-robin.
+class WorkStealingExecutor {
+public:
+    using Task = std::function<void()>;
+
+    // 0 for one worker per core
+    explicit WorkStealingExecutor(size_t num_workers = 0);
+
+    // Runs every task still queued, then joins the workers
+    ~WorkStealingExecutor();
+
+    WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+
+    WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+    void submit(Task task);
+
+    struct ScheduleAwaiter {
+        WorkStealingExecutor& executor;
+
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> coroutine) {
+            executor.submit([coroutine] { coroutine.resume(); });
+        }
+
+        void await_resume() noexcept {
+        }
+    };
+
+    // co_await executor.schedule() moves the rest of the coroutine onto a worker
+    ScheduleAwaiter schedule() {
+        return ScheduleAwaiter{*this};
+    }
+
+    // Blocks until every submitted task has finished, including tasks they submitted
+    void wait_idle();
+
+    [[nodiscard]] size_t size() const {
+        return workers.size();
+    }
+
+    // Tasks that ran on a worker other than the one they were queued on
+    [[nodiscard]] size_t steals() const {
+        return stolen.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Worker {
+        std::mutex mu;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    void run(size_t idx);
+
+    std::optional<Task> pop_local(size_t idx);
+
+    std::optional<Task> steal(size_t thief);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    // Submitted but not taken by a worker yet, idle workers sleep while this is 0
+    std::atomic<size_t> queued = 0;
+    // Submitted but not finished yet, what wait_idle() waits on
+    std::atomic<size_t> unfinished = 0;
+    std::atomic<size_t> next_worker = 0;
+    std::atomic<size_t> stolen = 0;
+    std::atomic<bool> stopping = false;
+    EventCount work_available;
+};
@@ -0,0 +1,70 @@
+//
+// Created by Sanger Steel on 6/16/25.
+//
+
+#include "arrival_schedule.hpp"
+#include <random>
+#include <stdexcept>
+
+std::optional<ArrivalDistribution> arrival_distribution_from_str(const std::string& str) {
+    if (str == "constant") {
+        return ArrivalDistribution::CONSTANT;
+    }
+    if (str == "poisson") {
+        return ArrivalDistribution::POISSON;
+    }
+    if (str == "gamma") {
+        return ArrivalDistribution::GAMMA;
+    }
+    return std::nullopt;
+}
+
+std::vector<std::chrono::nanoseconds> build_arrival_schedule(const ArrivalOptions& options, size_t num_requests) {
+    if (options.request_rate <= 0) {
+        throw std::runtime_error("Request rate must be positive.");
+    }
+    if (options.distribution == ArrivalDistribution::GAMMA && options.burstiness <= 0) {
+        throw std::runtime_error("Burstiness must be positive.");
+    }
+    std::mt19937_64 rng(options.seed);
+    const double mean_gap = 1.0 / options.request_rate;
+
+    // Poisson arrivals are exponential gaps, i.e. gamma gaps with shape 1. Scaling by
+    // mean_gap / shape keeps the mean rate the same for any shape.
+    const double shape = options.distribution == ArrivalDistribution::POISSON ? 1.0 : options.burstiness;
+    std::gamma_distribution<double> gap_distribution(shape, mean_gap / shape);
+
+    std::vector<std::chrono::nanoseconds> schedule;
+    schedule.reserve(num_requests);
+    double elapsed = 0;
+    for (size_t i = 0; i < num_requests; ++i) {
+        schedule.emplace_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double>(elapsed)));
+        elapsed += options.distribution == ArrivalDistribution::CONSTANT ? mean_gap : gap_distribution(rng);
+    }
+    return schedule;
+}
+
+time_point ClosedLoopPacer::next_intended_start() {
+    auto now = monotonic_clock::now();
+    if (!expected_interval.has_value()) {
+        return now;
+    }
+    auto intended = last_intended_start.has_value()
+                        ? std::min(now, last_intended_start.value() + expected_interval.value())
+                        : now;
+    last_intended_start = intended;
+    return intended;
+}
+
+void ScheduledRequestQueue::push(ScheduledRequest request) {
+    ring.push_wait(std::move(request));
+}
+
+std::optional<ScheduledRequest> ScheduledRequestQueue::pop() {
+    return ring.fetch_wait();
+}
+
+void ScheduledRequestQueue::close() {
+    ring.close();
+}
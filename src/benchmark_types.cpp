@@ -5,7 +5,8 @@
 #include "benchmark_types.hpp"
 
 #include <constants.hpp>
-#include <fstream>
+#include <algorithm>
+#include <numeric>
 
 #include "utils.hpp"
 #include <stdexcept>
@@ -19,24 +20,27 @@ std::string debug_json(json& j) {
 #define TODO() throw std::logic_error("TODO hit at " __FILE__ ":" + std::to_string(__LINE__))
 
 
-Data& DatasetParsingStrategy::get_data() {
-    return data;
-}
-
 Config& DatasetParsingStrategy::get_config() {
     return this->cfg;
 }
 
-void HFDatasetParser::initialize_config() {
+void DatasetParsingStrategy::initialize_config(const YAML::Node& config_yaml) {
     Config config;
     Config::Dataset dataset;
     Config::ClassLabel label;
     config.pre_formatted_prompt = config_yaml["pre_formatted_prompt"].as<std::string>();
     config.sentence_tags = config_yaml["sentence_tags"].as<std::vector<std::string>>();
 
-    dataset.tag = config_yaml["dataset"]["tag"].as<std::string>();
-    dataset.subset = config_yaml["dataset"]["subset"].as<std::string>();
-    dataset.split = config_yaml["dataset"]["split"].as<std::string>();
+    if (config_yaml["dataset"]["path"]) {
+        dataset.path = config_yaml["dataset"]["path"].as<std::string>();
+        if (config_yaml["dataset"]["format"]) {
+            dataset.format = config_yaml["dataset"]["format"].as<std::string>();
+        }
+    } else {
+        dataset.tag = config_yaml["dataset"]["tag"].as<std::string>();
+        dataset.subset = config_yaml["dataset"]["subset"].as<std::string>();
+        dataset.split = config_yaml["dataset"]["split"].as<std::string>();
+    }
     config.dataset = dataset;
 
     label.tag = config_yaml["class_label"]["tag"].as<std::string>();
@@ -56,6 +60,9 @@ void HFDatasetParser::initialize_config() {
     req.num_logprobs = config_yaml["request_params"]["num_logprobs"].as<int>();
     req.top_k = config_yaml["request_params"]["top_k"].as<int>();
     req.stream = config_yaml["request_params"]["stream"].as<bool>();
+    if (config_yaml["request_params"]["max_tokens"]) {
+        req.max_tokens = config_yaml["request_params"]["max_tokens"].as<int>();
+    }
     Logger.debug(req.to_str());
     config.defaults = std::move(req);
 
@@ -63,97 +70,201 @@ void HFDatasetParser::initialize_config() {
     cfg = std::move(config);
 }
 
-std::string HFDatasetParser::get_url() {
+std::string HFDatasetParser::get_url(int offset) {
     return std::format(BenchmarkingConstants::format_string,
-                       cfg.dataset.tag, cfg.dataset.subset, cfg.dataset.split, this->offset);
+                       cfg.dataset.tag, cfg.dataset.subset, cfg.dataset.split, offset);
 }
 
-void HFDatasetParser::download() {
-    int failed_requests = 0;
-    int max_failed_requests = 10;
-
-    while (true) {
-        auto url = get_url();
-        offset += rows_per_query;
-        if (!add_rows(data, url)) {
-            failed_requests++;
-            if (failed_requests >= max_failed_requests) {
-                throw std::runtime_error("Failed parsing dataset");
-            }
-            Logger.info("Got bad response when downloading dataset. Will try again in a few moments..");
-            std::this_thread::sleep_for(std::chrono::milliseconds(10'000));
-        };
-        if (data.rows.size() >= max_rows) {
-            break;
+void DatasetParsingStrategy::start_download() {
+    downloader = std::thread([this] {
+        try {
+            download();
+        } catch (...) {
+            download_error = std::current_exception();
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(ms_between_curl));
-    }
-    Logger.info(std::format("Got {} rows.", data.rows.size()));
+        rows.close();
+    });
 }
 
-void get_request_and_send_loop(
-    const Dataset& dataset,
-    RequestTransportStrategy& sender_and_parser,
-    DatasetToRequestStrategy& data_processor,
-    std::shared_ptr<CURLHandler> shared_client
-) {
-    RequestParameters req = dataset->get_config().get_defaults();
-    while (true) {
-        auto idx = sender_and_parser.fetch_and_add_job_id();
+std::optional<DatasetRow> DatasetParsingStrategy::next_row() {
+    return rows.pop();
+}
 
-        if (idx >= data_processor.dataset_size()) {
-            break;
+bool DatasetParsingStrategy::publish_rows(std::shared_ptr<const RowStore> store) {
+    for (size_t i = 0; i < store->size(); ++i) {
+        if (stopping.load(std::memory_order_acquire) || published_rows >= max_rows) {
+            return false;
         }
+        rows.push(DatasetRow{published_rows++, RowHandle(store, i)});
+    }
+    return published_rows < max_rows;
+}
 
-        data_processor.fill_req_from_row(dataset, idx, req);
-        sender_and_parser.send_and_add_to_buffer(dataset, req, shared_client);
-        Logger.num_requests_sent.fetch_add(1, std::memory_order_acq_rel);
+void DatasetParsingStrategy::stop_download() {
+    if (!downloader.joinable()) {
+        return;
     }
-};
+    // Draining the queue unblocks a download waiting to publish, which then sees it's
+    // stopping and returns
+    stopping.store(true, std::memory_order_release);
+    while (rows.pop().has_value()) {
+    }
+    downloader.join();
+}
+
+void DatasetParsingStrategy::finish_download() {
+    stop_download();
+    if (download_error) {
+        std::rethrow_exception(download_error);
+    }
+}
 
-bool HFDatasetParser::add_rows(Data& data, std::string& uri) {
-    auto resp = CURLHandler::get(uri.c_str());
+DatasetCacheKey HFDatasetParser::cache_key(uint64_t rows) const {
+    return {cfg.dataset.tag, cfg.dataset.subset, cfg.dataset.split, 0, rows};
+}
+
+FetchedPage HFDatasetParser::fetch_page(size_t page) {
+    auto url = get_url(static_cast<int>(page) * rows_per_query);
+    auto resp = CURLHandler::get(url.c_str());
     if (str_contains(resp, BenchmarkingConstants::rate_limit_text.data())) {
-        Logger.info("Hit rate limit. Slowing down...");
-        std::this_thread::sleep_for(std::chrono::milliseconds(30'000));
-        return true;
+        return FetchedPage(PageStatus::RATE_LIMITED);
     }
     json as_json;
     try {
         as_json = parse_to_json(resp);
     } catch (const json::parse_error&) {
         Logger.debug("Got parser error from resp: {}", resp);
-        return false;
+        return FetchedPage(PageStatus::BAD_RESPONSE);
     }
-    parse_rows(data, as_json["rows"]);
-    return true;
-}
-
-void HFDatasetParser::parse_rows(Data& data, json& rows) {
+    auto& rows = as_json["rows"];
     if (!rows.is_array()) {
         throw std::runtime_error(std::format("Expected 'rows' to be an array, got: {}", rows.dump(2)));
     }
     if (rows.empty()) {
-        throw std::runtime_error(std::format("Rows is empty: {}", rows.dump(2)));
+        return FetchedPage(PageStatus::END);
     }
-    data.rows.insert(data.rows.end(), rows.begin(), rows.end());
+    return FetchedPage(PageStatus::OK, Rows(std::make_move_iterator(rows.begin()), std::make_move_iterator(rows.end())));
 }
 
-json& HFDatasetParser::get_row(int row_idx) {
-    return data.rows[row_idx]["row"];
+std::shared_ptr<const RowStore> HFDatasetParser::to_row_store(std::span<const json> entries, size_t first_row) const {
+    auto store = std::make_shared<RowStore>(cfg.sentence_tags.size(), entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        try {
+            add_row(*store, entries[i].at("row"));
+        } catch (const std::exception& e) {
+            throw std::runtime_error(std::format("Dataset row {}: {}", first_row + i, e.what()));
+        }
+    }
+    return store;
+}
+
+void HFDatasetParser::download() {
+    auto pages = (std::max(max_rows, 1) + rows_per_query - 1) / rows_per_query;
+    auto wanted = cache_key(static_cast<uint64_t>(pages) * rows_per_query);
+    if (cache_dir.has_value()) {
+        // Only a cache file that can't be read falls back to the network. Once rows from it
+        // went out, a row that doesn't convert fails the download like a downloaded one would.
+        std::optional<std::vector<json>> cached;
+        try {
+            cached = DatasetCache(cache_dir.value()).load(wanted);
+        } catch (const std::exception& e) {
+            Logger.info(std::format("Ignoring dataset cache: {}", e.what()));
+        }
+        if (cached.has_value()) {
+            Logger.info(std::format("Got {} rows from the dataset cache in {}.", cached->size(), cache_dir->string()));
+            std::span<const json> entries(cached.value());
+            for (size_t first = 0; first < entries.size(); first += RowStoreBatchRows) {
+                auto batch = entries.subspan(first, std::min(RowStoreBatchRows, entries.size() - first));
+                if (!publish_rows(to_row_store(batch, first))) {
+                    break;
+                }
+            }
+            return;
+        }
+    }
+
+    // Only kept when there's a cache to save them to
+    Rows downloaded;
+    size_t total_rows = 0;
+    DownloadRateLimiter limiter(download_rate);
+    PageFetchOptions options;
+    options.parallelism = static_cast<size_t>(std::max(download_parallelism, 1));
+    auto complete = fetch_pages_in_order(
+        options,
+        limiter,
+        [this](size_t page) { return fetch_page(page); },
+        [&](size_t, Rows&& page) {
+            auto store = to_row_store(page, total_rows);
+            total_rows += page.size();
+            if (cache_dir.has_value()) {
+                std::move(page.begin(), page.end(), std::back_inserter(downloaded));
+            }
+            return publish_rows(std::move(store));
+        }
+    );
+    if (total_rows == 0) {
+        throw std::runtime_error(std::format("Got no rows from {}", get_url(0)));
+    }
+    Logger.info(std::format("Got {} rows.", total_rows));
+
+    if (cache_dir.has_value()) {
+        DatasetCache cache(cache_dir.value());
+        // A split shorter than asked for is saved as all of it, so asking for as many
+        // rows again finds it
+        auto key = cache_key(downloaded.size());
+        key.complete = complete;
+        try {
+            cache.store(key, downloaded);
+            Logger.info(std::format("Saved rows to {}", cache.path_for(key).string()));
+        } catch (const std::exception& e) {
+            Logger.info(std::format("Couldn't save rows to the dataset cache: {}", e.what()));
+        }
+    }
+}
+
+void get_request_and_send_loop(
+    const Dataset& dataset,
+    RequestTransportStrategy& sender_and_parser,
+    DatasetToRequestStrategy& data_processor,
+    std::shared_ptr<CURLHandler> shared_client,
+    ClosedLoopPacer pacer
+) {
+    RequestParameters req = dataset->get_config().get_defaults();
+    while (auto row = dataset->next_row()) {
+        data_processor.fill_req_from_row(row->row, req);
+        req.intended_start = pacer.next_intended_start();
+        sender_and_parser.send_and_add_to_buffer(dataset, req, shared_client);
+        Logger.num_requests_sent.fetch_add(1, std::memory_order_acq_rel);
+    }
+};
+
+void get_scheduled_request_and_send_loop(
+    const Dataset& dataset,
+    RequestTransportStrategy& sender_and_parser,
+    DatasetToRequestStrategy& data_processor,
+    std::shared_ptr<CURLHandler> shared_client,
+    ScheduledRequestQueue& scheduled_requests
+) {
+    RequestParameters req = dataset->get_config().get_defaults();
+    while (auto scheduled = scheduled_requests.pop()) {
+        data_processor.fill_req_from_row(scheduled->row.row, req);
+        req.intended_start = scheduled->intended_start;
+        sender_and_parser.send_and_add_to_buffer(dataset, req, shared_client);
+        Logger.num_requests_sent.fetch_add(1, std::memory_order_acq_rel);
+    }
 }
 
 size_t DatasetToRequestStrategy::dataset_size() {
-    return this->dataset->get_data().rows.size();
+    return static_cast<size_t>(std::max(this->dataset->max_rows, 0));
 }
 
-std::string DatasetToRequestStrategy::get_prompt_from_row(json& row) {
+std::string DatasetToRequestStrategy::get_prompt_from_row(const RowHandle& row) {
     const auto& cfg = dataset->get_config();
-    std::vector<const std::string> sentences;
-    std::vector<const std::string> possible_answers;
-    sentences.reserve(cfg.sentence_tags.size());
-    for (const auto& sentence_tag: cfg.sentence_tags) {
-        sentences.emplace_back(row[sentence_tag]);
+    std::vector<std::string_view> sentences;
+    std::vector<std::string_view> possible_answers;
+    sentences.reserve(row.sentence_count());
+    for (size_t i = 0; i < row.sentence_count(); ++i) {
+        sentences.emplace_back(row.sentence(i));
     }
     possible_answers.reserve(cfg.label.values.size());
     for (const auto& value: cfg.label.values) {
@@ -166,37 +277,88 @@ std::string DatasetToRequestStrategy::get_prompt_from_row(json& row) {
     return prompt;
 }
 
-void DatasetToRequestStrategy::fill_req_from_row(
-    const Dataset& dataset, int row_idx,
-    RequestParameters& req
-) {
-    const auto& cfg = dataset->get_config();
-
-    auto row = dataset->get_row(row_idx);
-
-    req.golden_label = row[cfg.label.tag];
+void DatasetToRequestStrategy::fill_req_from_row(const RowHandle& row, RequestParameters& req) {
+    req.golden_label = row.label();
     req.prompt = this->get_prompt_from_row(row);
 }
 
 CompletionResults get_completion_results_from_fetched_result(
-    std::string& json_str,
-    std::string& fetched_str
+    const StreamEvent& fetched_event,
+    ChunkParser chunk_parser
 ) {
     Logger.fetched_requests.fetch_add(1, std::memory_order_acq_rel);
 
-    json_str = fetched_str;
-    if (json_str.empty()) {
+    if (fetched_event.payload.empty()) {
         throw std::runtime_error("Fetched json string is empty");
     }
-    CompletionResults results(std::move(json_str));
+    CompletionResults results = parse_completion_results(fetched_event.payload, chunk_parser);
+    results.received = fetched_event.received;
     return results;
 }
 
+// Chunks without logprobs still carry a token when they carry text. The final chunk
+// usually only carries a finish_reason and no token at all.
+int count_tokens(const CompletionResults& results) {
+    int tokens = 0;
+    for (const auto& choice: results.choices) {
+        if (!choice.logprobs.tokens.empty()) {
+            tokens += choice.logprobs.tokens.size();
+        } else if (!choice.text.empty()) {
+            tokens++;
+        }
+    }
+    return tokens;
+}
+
+// Note: latencies is mutated
+void record_token_timings(const std::vector<CompletionResults>& completion_results, LatencyMetrics& latencies) {
+    // Fetchers can hand chunks over out of order, visit them in arrival order. Sorting an
+    // index leaves the chunks in the order the rest of the result reads them in.
+    std::vector<size_t> arrival_order(completion_results.size());
+    std::iota(arrival_order.begin(), arrival_order.end(), 0);
+    std::stable_sort(arrival_order.begin(), arrival_order.end(), [&](size_t a, size_t b) {
+        return completion_results[a].received < completion_results[b].received;
+    });
+    auto seconds_between = [](time_point from, time_point to) {
+        return std::chrono::duration<double>(to - from).count();
+    };
+
+    latencies.output_tokens = 0;
+    latencies.inter_token_latencies.clear();
+    std::optional<time_point> first_token;
+    std::optional<time_point> last_token;
+    for (auto i: arrival_order) {
+        const auto& results = completion_results[i];
+        auto tokens = count_tokens(results);
+        if (tokens == 0) {
+            continue;
+        }
+        if (!last_token.has_value()) {
+            first_token = results.received;
+        } else if (results.received != last_token.value()) {
+            // Events parsed out of the same read share its timestamp, so only the gap
+            // between reads was actually measured
+            latencies.inter_token_latencies.emplace_back(seconds_between(last_token.value(), results.received));
+        }
+        last_token = results.received;
+        latencies.output_tokens += tokens;
+    }
+    // Without any tokens the first byte is the best guess left
+    if (!first_token.has_value()) {
+        return;
+    }
+    latencies.ttft = seconds_between(latencies.actual_start, first_token.value());
+    if (latencies.output_tokens > 1) {
+        auto decode_time = seconds_between(first_token.value(), last_token.value());
+        latencies.time_per_output_token = decode_time / (latencies.output_tokens - 1);
+        latencies.decode_tokens_per_sec = decode_time > 0 ? (latencies.output_tokens - 1) / decode_time : 0;
+    }
+}
+
 // Note: completion_results_buffer's pointee is mutated
 void maybe_add_results_to_compl_results_buffer(
     CompletionResults& results,
-    const CompletionResultsBuffer& completion_results_buffer,
-    std::mutex& compl_buffer_mutex
+    const CompletionResultsBuffer& completion_results_buffer
 ) {
     // For finish_reason = length, an empty response
     // is thrown back at the end indicating it reached
@@ -214,9 +376,7 @@ void maybe_add_results_to_compl_results_buffer(
         }
     }
 
-    // TODO: Make this atomic
     if (fine_to_add) {
-        std::lock_guard<std::mutex> lock(compl_buffer_mutex);
         if (results.to_string().empty()) {
             throw std::runtime_error("Result data was invalidated.");
         }
@@ -227,12 +387,12 @@ void maybe_add_results_to_compl_results_buffer(
     }
 }
 
-void fetch_response_and_add_to_results_buffer(
+std::vector<StreamEvent> fetch_response_events(
     const RequestProcessingParameters& params,
     const std::shared_ptr<CURLHandler>& shared_client
 ) {
     ResponseFetcher response_fetcher(params, shared_client);
-    response_fetcher.run();
+    return response_fetcher.collect_events();
 }
 
 // Note: request_result_buffer's pointee is mutated
@@ -241,10 +401,14 @@ void maybe_push_completion_to_results_buffer(
     LatencyMetrics& latencies,
     RequestParameters& req,
     const Dataset& dataset,
-    const RequestResultBuffer& request_result_buffer
+    const RequestResultBuffer& request_result_buffer,
+    LatencyHistogramRegistry& latency_histograms,
+    OutputFormat output_format
 ) {
     // Process the buffer `res`
     if (!completion_results_buffer->empty()) {
+        record_token_timings(*completion_results_buffer, latencies);
+        latency_histograms.local().record(latencies);
         RequestResult result;
 
 
@@ -255,8 +419,14 @@ void maybe_push_completion_to_results_buffer(
         result.completion_results = std::move(*completion_results_buffer);
         result.latencies = latencies;
         result.params = req;
-        result.guessed_correctly = guessed_correctly(dataset, result);
-        request_result_buffer->push(std::move(result));
+        result.guessed_label = guess_label(dataset, result);
+        result.guessed_correctly = result.guessed_label == req.golden_label;
+        if (output_format == OutputFormat::COLUMNAR) {
+            result.rows = get_output_rows(result, dataset);
+        } else {
+            append_output_jsonl(result.jsonl, result, dataset);
+        }
+        request_result_buffer->push_wait(std::move(result));
         Logger.num_processed.fetch_add(1, std::memory_order_acq_rel);
     } else {
         // If the worker found no work to be processed from the stream buffer, just make a note of
@@ -271,89 +441,134 @@ void RequestTransportStrategy::send_and_add_to_buffer(
     RequestParameters& req,
     std::shared_ptr<CURLHandler>& shared_client
 ) {
-    RequestExecutor request_executor(dataset, req, shared_client);
-    request_executor.send_request_and_collect_results(request_results_buffer);
+    RequestExecutor request_executor(dataset, req, shared_client, chunk_parser, output_format);
+    request_executor.send_request_and_collect_results(request_results_buffer, *latency_histograms, *executor);
 }
 
-void ResponseFetcher::run() {
-    while (true) {
-        {
-            std::unique_lock<std::mutex> lock(params.resp->mu);
-            params.resp->cv.wait(lock, [this] {
-                return this->params.resp->ready_to_fetch();
-            });
-        }
-        auto fetched_result = shared_client->fetch(params.resp);
+std::vector<StreamEvent> ResponseFetcher::collect_events() {
+    std::vector<StreamEvent> events;
+    while (params.resp->fetch_bulk_wait(events, MaxEventsPerFetch) > 0) {
         Logger.fetch_attempts.fetch_add(1, std::memory_order_acq_rel);
-        if (fetched_result.state == RingState::SUCCESS) {
-            consecutive_retries = 0;
-            CompletionResults results = get_completion_results_from_fetched_result(
-                json_str,
-                fetched_result.content.value()
-            );
+    }
+    return events;
+}
 
-            maybe_add_results_to_compl_results_buffer(results, params.compl_result_buffer, compl_buffer_mutex);
-        } else if (fetched_result.state == RingState::EMPTY && params.finished) {
-            if (consecutive_retries >= params.max_retries) {
-                break;
-            }
-            consecutive_retries++;
+void process_completed_request(
+    const std::vector<StreamEvent>& events,
+    LatencyMetrics& latencies,
+    RequestParameters& req,
+    ChunkParser chunk_parser,
+    OutputFormat output_format,
+    const Dataset& dataset,
+    const RequestResultBuffer& request_result_buffer,
+    LatencyHistogramRegistry& latency_histograms
+) {
+    auto completion_results = std::make_shared<std::vector<CompletionResults>>();
+    // A timed out transfer is sent again from the start, only its last attempt counts
+    auto attempt = events.empty() ? 0 : events.back().attempt;
+    for (const auto& event: events) {
+        if (event.attempt != attempt) {
+            continue;
         }
+        CompletionResults results = get_completion_results_from_fetched_result(event, chunk_parser);
+        maybe_add_results_to_compl_results_buffer(results, completion_results);
     }
+    maybe_push_completion_to_results_buffer(
+        completion_results,
+        latencies,
+        req,
+        dataset,
+        request_result_buffer,
+        latency_histograms,
+        output_format
+    );
 }
 
-void write_to_request_from_fetched_and_add_to_metrics(
-    RequestResult& result,
-    const RingResult<RequestResult>& fetched,
+void add_result_to_metrics(
+    const RequestResult& result,
     Metrics& metrics
 ) {
-    result = fetched.content.value();
-    metrics.req_results.emplace_back(result);
+    metrics.aggregate.add(result.latencies, result.params.golden_label, result.guessed_label);
     metrics.requests_processed++;
 }
 
 void write_jsonl_to_outfile_from_req_result(
-    RequestResult& result,
-    const Dataset& dataset,
+    const RequestResult& result,
     Metrics& metrics,
-    std::ofstream& outfile
+    BlockFileWriter& outfile,
+    bool echo_results
 ) {
-    auto jsons = get_output_json(result, dataset);
-
-    for (auto& jsonl: jsons) {
-        auto jsonl_str = jsonl.dump();
-        Logger.info(std::format("Req {}: {}", metrics.requests_processed, jsonl.dump()));
-        outfile << jsonl_str << '\n';
+    outfile.append(result.jsonl);
+    if (!echo_results) {
+        return;
+    }
+    std::string_view lines = result.jsonl;
+    while (!lines.empty()) {
+        auto line_end = lines.find('\n');
+        Logger.info(std::format("Req {}: {}", metrics.requests_processed, lines.substr(0, line_end)));
+        lines.remove_prefix(line_end == std::string_view::npos ? lines.size() : line_end + 1);
     }
 }
 
-void RequestExecutor::send_request_and_collect_results(RequestResultBuffer& request_result_buffer) {
+void RequestExecutor::send_request_and_collect_results(
+    RequestResultBuffer& request_result_buffer,
+    LatencyHistogramRegistry& latency_histograms,
+    WorkStealingExecutor& executor
+) {
     Logger.send_add_to_buffer_calls.fetch_add(1, std::memory_order_acq_rel);
-    // Deploy workers to grab responses from buffer, process them to CompletionResults types,
-    // and add them to res.
-    std::vector<std::thread> workers;
-    for (int i = 0; i < WorkerConstants::NumWorkersPerRequest; ++i) {
-        std::thread t([this]() {
-            fetch_response_and_add_to_results_buffer(params, shared_client);
-        });
-        workers.emplace_back(std::move(t));
-    }
+    // This thread is the stream's only consumer. It just moves raw events out in arrival
+    // order, so it's free for its next request as soon as the transfer finishes.
+    auto events = fetch_response_events(params, shared_client);
 
-    // Await the request's completion
+    // The transfer has finalized by now, this just collects its timings
     auto latencies = shared_client->await(params.resp);
-    params.finished.store(true, std::memory_order_release);
 
-    // Wait for the workers deployed to finish
-    for (int i = 0; i < WorkerConstants::NumWorkersPerRequest; ++i) {
-        workers[i].join();
-    }
+    // Parsing, evaluation and serialization are CPU-bound and run on the executor
+    executor.submit(
+        [events = std::move(events), latencies, req = req, chunk_parser = params.chunk_parser,
+            output_format = params.output_format, &dataset = dataset, request_result_buffer,
+            &latency_histograms]() mutable {
+            process_completed_request(
+                events,
+                latencies,
+                req,
+                chunk_parser,
+                output_format,
+                dataset,
+                request_result_buffer,
+                latency_histograms
+            );
+        }
+    );
+}
 
-    maybe_push_completion_to_results_buffer(
-        params.compl_result_buffer,
+task<void> RequestTransportStrategy::send_and_add_to_buffer_async(
+    const Dataset& dataset,
+    RequestParameters req,
+    SharedClient shared_client
+) {
+    Logger.send_add_to_buffer_calls.fetch_add(1, std::memory_order_acq_rel);
+    auto resp = shared_client->post_stream(req);
+    // Resumed by the transfer as events arrive, this only moves them out of the ring
+    std::vector<StreamEvent> events;
+    while (auto event = co_await next_event(resp)) {
+        events.emplace_back(std::move(event.value()));
+    }
+    Logger.fetch_attempts.fetch_add(1, std::memory_order_acq_rel);
+
+    // Off the transfer's thread before any parsing, the timings were recorded before the
+    // stream was finalized
+    co_await executor->schedule();
+    auto latencies = resp->latencies;
+    process_completed_request(
+        events,
         latencies,
         req,
+        chunk_parser,
+        output_format,
         dataset,
-        request_result_buffer
+        request_results_buffer,
+        *latency_histograms
     );
 }
 
@@ -362,73 +577,317 @@ void FileWritingStrategy::write_to_jsonl_from_results_buffer(
     RequestResultBuffer& buf,
     const Dataset& dataset
 ) {
-    FileWritingExecutor writing_executor(metrics, buf, dataset, metrics.output_jsonl);
-    writing_executor.start_writing_loop([this] {
-            return this->producers_finished();
-        }
+    FileWritingExecutor writing_executor(
+        metrics, buf, dataset, metrics.output_jsonl, flush_interval, echo_results, output_format
     );
+    writing_executor.start_writing_loop();
 }
 
-void FileWritingExecutor::start_writing_loop(const std::function<bool()>& finalizer_callable) {
-    RequestResult result;
-    while (true) {
-        auto fetch_attempt = buf->fetch();
-        if (fetch_attempt.state == RingState::SUCCESS) {
-            consecutive_retries = 0;
+void FileWritingStrategy::finalize(RequestResultBuffer& buf) {
+    buf->close();
+}
 
-            write_to_request_from_fetched_and_add_to_metrics(result, fetch_attempt, metrics);
-            write_jsonl_to_outfile_from_req_result(result, dataset, metrics, stream);
-        } else {
-            if (fetch_attempt.state == RingState::EMPTY && finalizer_callable()) {
-                if (consecutive_retries >= max_consecutive_retries) {
-                    break;
+FileWritingExecutor::FileWritingExecutor(
+    Metrics& metrics,
+    RequestResultBuffer& buf,
+    const Dataset& dataset, const char* filename,
+    std::chrono::milliseconds flush_interval,
+    bool echo_results,
+    OutputFormat output_format
+) : metrics(metrics), buf(buf), dataset(dataset), echo_results(echo_results) {
+    if (output_format == OutputFormat::COLUMNAR) {
+        std::vector<std::string> label_names;
+        for (const auto& value: dataset->get_config().label.values) {
+            label_names.emplace_back(value.response);
+        }
+        columnar = std::make_unique<ColumnarFileWriter>(filename, label_names);
+    } else {
+        stream = std::make_unique<BlockFileWriter>(filename, flush_interval);
+    }
+}
+
+void FileWritingExecutor::start_writing_loop() {
+    // Sleeps while every request is still in flight, and returns once the producers have
+    // closed the buffer and it's drained. While lines are waiting to be flushed it wakes
+    // at the flush deadline too, so they reach the file within the flush interval even if
+    // nothing follows. Columnar output is only written a row group at a time, so it only
+    // wakes for results.
+    std::vector<RequestResult> results;
+    while (true) {
+        if (stream && stream->pending() > 0 && !buf->is_closed()) {
+            auto deadline = monotonic_clock::now() + stream->until_flush_due();
+            if (buf->fetch_bulk_wait_until(results, MaxResultsPerFetch, deadline) == 0) {
+                stream->flush_if_due();
+                continue;
+            }
+        } else if (buf->fetch_bulk_wait(results, MaxResultsPerFetch) == 0) {
+            break;
+        }
+        for (auto& result: results) {
+            add_result_to_metrics(result, metrics);
+            if (columnar) {
+                for (const auto& row: result.rows) {
+                    columnar->append(row);
                 }
-                Logger.debug("Writer retrying read. Consecutive retries: {}\n", std::to_string(consecutive_retries));
-                consecutive_retries++;
+            } else {
+                write_jsonl_to_outfile_from_req_result(result, metrics, *stream, echo_results);
             }
-            std::this_thread::yield();
         }
+        results.clear();
+        if (stream) {
+            stream->flush_if_due();
+        }
+    }
+    metrics.benchmark_end = monotonic_clock::now();
+    if (columnar) {
+        columnar->close();
+    } else {
+        stream->close();
     }
-    metrics.benchmark_end = std::chrono::high_resolution_clock::now();
-    stream.close();
 }
 
 
-FinalMetrics ProcessingStrategy::process_benchmark(const char* filename_jsonl) {
-    Metrics metrics = Metrics(filename_jsonl);
+void run_worker_guarded(const std::function<void()>& worker) {
+    try {
+        worker();
+    } catch (const std::exception& e) {
+        std::cerr << "Worker thread crashed: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Worker thread crashed with unknown exception" << std::endl;
+    }
+}
 
-    std::thread writer_thread([this, &metrics]() {
-        this->writer.write_to_jsonl_from_results_buffer(
-            metrics,
-            this->sender_and_parser.request_results_buffer,
-            this->dataset_processor.get_dataset()
-        );
-    });
+std::optional<OutputFormat> output_format_from_str(const std::string& str) {
+    if (str == "jsonl") {
+        return OutputFormat::JSONL;
+    }
+    if (str == "columnar") {
+        return OutputFormat::COLUMNAR;
+    }
+    return std::nullopt;
+}
+
+std::optional<RequestPipeline> request_pipeline_from_str(const std::string& str) {
+    if (str == "threads") {
+        return RequestPipeline::THREADS;
+    }
+    if (str == "coroutines") {
+        return RequestPipeline::COROUTINES;
+    }
+    return std::nullopt;
+}
+
+void report_coroutine_crash(const std::exception_ptr& error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::exception& e) {
+        std::cerr << "Request coroutine crashed: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Request coroutine crashed with unknown exception" << std::endl;
+    }
+}
 
+// Counts spawned coroutines that haven't finished. Shared with their completion
+// callbacks, which can still be notifying after the waiter has seen the count drop.
+struct InFlightCoroutines {
+    std::atomic<size_t> count = 0;
+
+    void wait_below(size_t limit) {
+        auto current = count.load(std::memory_order_acquire);
+        while (current >= limit) {
+            count.wait(current, std::memory_order_acquire);
+            current = count.load(std::memory_order_acquire);
+        }
+    }
+
+    void spawn(task<void> work, const std::shared_ptr<InFlightCoroutines>& self) {
+        count.fetch_add(1, std::memory_order_acq_rel);
+        ::spawn(std::move(work), [self](std::exception_ptr error) {
+            if (error) {
+                report_coroutine_crash(error);
+            }
+            self->count.fetch_sub(1, std::memory_order_acq_rel);
+            self->count.notify_all();
+        });
+    }
+};
+
+task<void> get_request_and_send_task(
+    const Dataset& dataset,
+    RequestTransportStrategy& sender_and_parser,
+    DatasetToRequestStrategy& data_processor,
+    SharedClient shared_client,
+    ClosedLoopPacer pacer
+) {
+    RequestParameters req = dataset->get_config().get_defaults();
+    while (auto row = dataset->next_row()) {
+        data_processor.fill_req_from_row(row->row, req);
+        req.intended_start = pacer.next_intended_start();
+        co_await sender_and_parser.send_and_add_to_buffer_async(dataset, req, shared_client);
+        Logger.num_requests_sent.fetch_add(1, std::memory_order_acq_rel);
+    }
+}
+
+task<void> send_scheduled_request_task(
+    const Dataset& dataset,
+    RequestTransportStrategy& sender_and_parser,
+    DatasetToRequestStrategy& data_processor,
+    SharedClient shared_client,
+    ScheduledRequest scheduled
+) {
+    RequestParameters req = dataset->get_config().get_defaults();
+    data_processor.fill_req_from_row(scheduled.row.row, req);
+    req.intended_start = scheduled.intended_start;
+    co_await sender_and_parser.send_and_add_to_buffer_async(dataset, std::move(req), shared_client);
+    Logger.num_requests_sent.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void ProcessingStrategy::run_closed_loop_workers() {
     std::vector<std::thread> workers;
     for (int i = 0; i < this->concurrent_requests; ++i) {
         std::thread t([this]() {
-            try {
+            run_worker_guarded([this] {
                 get_request_and_send_loop(
                     this->dataset_processor.get_dataset(),
                     this->sender_and_parser,
                     this->dataset_processor,
-                    this->shared_client
+                    this->shared_client,
+                    ClosedLoopPacer(this->expected_interval)
                 );
-            } catch (const std::exception& e) {
-                std::cerr << "Worker thread crashed: " << e.what() << std::endl;
-            } catch (...) {
-                std::cerr << "Worker thread crashed with unknown exception" << std::endl;
-            }
+            });
         });
         workers.emplace_back(std::move(t));
     }
     for (int i = 0; i < this->concurrent_requests; ++i) {
         workers[i].join();
     }
+}
+
+void ProcessingStrategy::run_open_loop_workers() {
+    auto num_requests = this->dataset_processor.dataset_size();
+    auto schedule = build_arrival_schedule(arrival.value(), num_requests);
+    auto scheduled_requests = std::make_unique<ScheduledRequestQueue>();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < this->concurrent_requests; ++i) {
+        std::thread t([this, &scheduled_requests]() {
+            run_worker_guarded([this, &scheduled_requests] {
+                get_scheduled_request_and_send_loop(
+                    this->dataset_processor.get_dataset(),
+                    this->sender_and_parser,
+                    this->dataset_processor,
+                    this->shared_client,
+                    *scheduled_requests
+                );
+            });
+        });
+        workers.emplace_back(std::move(t));
+    }
+
+    // The dispatcher never waits on responses. If every worker is busy, requests queue
+    // up with their intended start intact, so the wait shows up in their latencies.
+    // The schedule starts once the first row arrives. A later row that's still downloading
+    // at its intended start delays its request, and the wait counts in its latencies.
+    std::thread dispatcher([&schedule, &scheduled_requests, this]() {
+        const auto& dataset = this->dataset_processor.get_dataset();
+        std::optional<time_point> start;
+        for (size_t i = 0; i < schedule.size(); ++i) {
+            auto row = dataset->next_row();
+            if (!row.has_value()) {
+                break;
+            }
+            if (!start.has_value()) {
+                start = monotonic_clock::now();
+            }
+            auto intended_start = start.value() + schedule[i];
+            std::this_thread::sleep_until(intended_start);
+            scheduled_requests->push(ScheduledRequest{std::move(row.value()), intended_start});
+        }
+        scheduled_requests->close();
+    });
+
+    dispatcher.join();
+    for (int i = 0; i < this->concurrent_requests; ++i) {
+        workers[i].join();
+    }
+}
+
+void ProcessingStrategy::run_closed_loop_coroutines() {
+    // Each coroutine is a closed-loop worker that holds no thread while its request streams
+    auto in_flight = std::make_shared<InFlightCoroutines>();
+    for (int i = 0; i < this->concurrent_requests; ++i) {
+        in_flight->spawn(get_request_and_send_task(
+            this->dataset_processor.get_dataset(),
+            this->sender_and_parser,
+            this->dataset_processor,
+            this->shared_client,
+            ClosedLoopPacer(this->expected_interval)
+        ), in_flight);
+    }
+    in_flight->wait_below(1);
+}
+
+void ProcessingStrategy::run_open_loop_coroutines() {
+    auto num_requests = this->dataset_processor.dataset_size();
+    auto schedule = build_arrival_schedule(arrival.value(), num_requests);
+    auto in_flight = std::make_shared<InFlightCoroutines>();
+
+    // A coroutine per request, started by the dispatcher itself. At the in-flight cap the
+    // dispatcher falls behind schedule, and the intended start keeps that wait in the
+    // request's latencies.
+    const auto& dataset = this->dataset_processor.get_dataset();
+    std::optional<time_point> start;
+    for (size_t i = 0; i < schedule.size(); ++i) {
+        auto row = dataset->next_row();
+        if (!row.has_value()) {
+            break;
+        }
+        if (!start.has_value()) {
+            start = monotonic_clock::now();
+        }
+        auto intended_start = start.value() + schedule[i];
+        std::this_thread::sleep_until(intended_start);
+        in_flight->wait_below(this->concurrent_requests);
+        in_flight->spawn(send_scheduled_request_task(
+            dataset,
+            this->sender_and_parser,
+            this->dataset_processor,
+            this->shared_client,
+            ScheduledRequest{std::move(row.value()), intended_start}
+        ), in_flight);
+    }
+    in_flight->wait_below(1);
+}
+
+FinalMetrics ProcessingStrategy::process_benchmark(const char* filename_jsonl) {
+    Metrics metrics = Metrics(filename_jsonl);
+    metrics.latency_histograms = this->sender_and_parser.latency_histograms;
+
+    std::thread writer_thread([this, &metrics]() {
+        this->writer.write_to_jsonl_from_results_buffer(
+            metrics,
+            this->sender_and_parser.request_results_buffer,
+            this->dataset_processor.get_dataset()
+        );
+    });
+
+    if (pipeline == RequestPipeline::COROUTINES) {
+        if (arrival.has_value()) {
+            run_open_loop_coroutines();
+        } else {
+            run_closed_loop_coroutines();
+        }
+    } else if (arrival.has_value()) {
+        run_open_loop_workers();
+    } else {
+        run_closed_loop_workers();
+    }
+    // Results still being processed have to reach the buffer before it's closed
+    this->sender_and_parser.executor->wait_idle();
 
-    this->writer.finalize();
+    this->writer.finalize(this->sender_and_parser.request_results_buffer);
     writer_thread.join();
+    this->dataset_processor.get_dataset()->finish_download();
 
     auto final_metrics = get_results(metrics);
     return final_metrics;
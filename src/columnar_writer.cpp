@@ -0,0 +1,273 @@
+//
+// Created by Sanger Steel on 6/28/25.
+//
+
+#include "columnar_writer.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <type_traits>
+
+static_assert(std::endian::native == std::endian::little, "the columnar format is written in host byte order");
+
+namespace {
+constexpr size_t ColumnarAlignment = 8;
+
+template<typename T>
+void append_value(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+T read_value(std::string_view& in) {
+    if (in.size() < sizeof(T)) {
+        throw std::runtime_error("columnar file footer is truncated");
+    }
+    T value;
+    std::memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return value;
+}
+
+template<typename T>
+constexpr ColumnType column_type() {
+    if constexpr (std::is_same_v<T, double>) {
+        return ColumnType::F64;
+    } else if constexpr (std::is_same_v<T, int>) {
+        return ColumnType::I32;
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return ColumnType::BOOL;
+    } else {
+        static_assert(std::is_same_v<T, std::string>, "no column type for this output field");
+        return ColumnType::STRING;
+    }
+}
+
+std::string columnar_header() {
+    std::string header(ColumnarMagic);
+    append_value<uint32_t>(header, ColumnarVersion);
+    append_value<uint32_t>(header, 0);
+    return header;
+}
+}
+
+std::vector<ColumnSpec> output_columns(const std::vector<std::string>& label_names) {
+    std::vector<ColumnSpec> columns;
+    visit_output_fields(OutputRow{}, [&](std::string_view name, const auto& value) {
+        columns.emplace_back(ColumnSpec{std::string(name), column_type<std::decay_t<decltype(value)>>()});
+    });
+    for (size_t i = 0; i < label_names.size(); ++i) {
+        if (std::find(label_names.begin(), label_names.begin() + i, label_names[i]) != label_names.begin() + i) {
+            throw std::runtime_error(std::format("Label response \"{}\" is listed twice", label_names[i]));
+        }
+        columns.emplace_back(ColumnSpec{label_names[i] + "_logprob", ColumnType::F32, true});
+    }
+    return columns;
+}
+
+ColumnarFileWriter::ColumnarFileWriter(
+    const char* filename,
+    const std::vector<std::string>& label_names,
+    size_t rows_per_group
+) : out(filename, std::chrono::milliseconds::zero()),
+    columns(output_columns(label_names)),
+    current(columns.size()),
+    rows_per_group(std::max<size_t>(rows_per_group, 1)) {
+    // Bytes only reach the file as whole blocks, on close, never on a flush timer
+    out.append(columnar_header());
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if (columns[i].type == ColumnType::STRING) {
+            append_value<uint64_t>(current[i].values, 0);
+        }
+    }
+}
+
+ColumnarFileWriter::~ColumnarFileWriter() {
+    try {
+        close();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Failed to finish writing the columnar output file: %s\n", e.what());
+    }
+}
+
+void ColumnarFileWriter::append(const OutputRow& row) {
+    size_t column = 0;
+    visit_output_fields(row, [&](std::string_view, const auto& value) {
+        using T = std::decay_t<decltype(value)>;
+        auto& buffers = current[column++];
+        if constexpr (std::is_same_v<T, std::string>) {
+            buffers.bytes.append(value);
+            append_value<uint64_t>(buffers.values, buffers.bytes.size());
+        } else if constexpr (std::is_same_v<T, bool>) {
+            append_value<uint8_t>(buffers.values, value ? 1 : 0);
+        } else if constexpr (std::is_same_v<T, int>) {
+            append_value<int32_t>(buffers.values, value);
+        } else {
+            append_value<double>(buffers.values, value);
+        }
+    });
+    for (size_t label = 0; column < columns.size(); ++column, ++label) {
+        auto logprob = label < row.label_logprobs.size() ? row.label_logprobs[label] : std::nullopt;
+        append_value<uint8_t>(current[column].validity, logprob.has_value() ? 1 : 0);
+        append_value<float>(current[column].values, logprob.value_or(0));
+    }
+
+    if (++rows_in_current == rows_per_group) {
+        write_row_group();
+    }
+}
+
+void ColumnarFileWriter::append_padded(std::string_view buffer, RowGroup& group) {
+    group.buffers.emplace_back(out.size(), buffer.size());
+    out.append(buffer);
+    static constexpr char padding[ColumnarAlignment] = {};
+    out.append(std::string_view(padding, (ColumnarAlignment - buffer.size() % ColumnarAlignment) % ColumnarAlignment));
+}
+
+void ColumnarFileWriter::write_row_group() {
+    if (rows_in_current == 0) {
+        return;
+    }
+    RowGroup group{rows_in_current, {}};
+    for (size_t i = 0; i < columns.size(); ++i) {
+        auto& buffers = current[i];
+        if (columns[i].nullable) {
+            append_padded(buffers.validity, group);
+        }
+        append_padded(buffers.values, group);
+        if (columns[i].type == ColumnType::STRING) {
+            append_padded(buffers.bytes, group);
+        }
+        buffers.validity.clear();
+        buffers.values.clear();
+        buffers.bytes.clear();
+        if (columns[i].type == ColumnType::STRING) {
+            append_value<uint64_t>(buffers.values, 0);
+        }
+    }
+    groups.emplace_back(std::move(group));
+    rows_in_current = 0;
+}
+
+void ColumnarFileWriter::write_footer() {
+    std::string footer;
+    append_value<uint32_t>(footer, columns.size());
+    for (const auto& column: columns) {
+        append_value<uint32_t>(footer, column.name.size());
+        footer += column.name;
+        append_value<uint8_t>(footer, static_cast<uint8_t>(column.type));
+        append_value<uint8_t>(footer, column.nullable ? 1 : 0);
+    }
+    append_value<uint32_t>(footer, groups.size());
+    for (const auto& group: groups) {
+        append_value<uint64_t>(footer, group.rows);
+        for (auto [offset, length]: group.buffers) {
+            append_value<uint64_t>(footer, offset);
+            append_value<uint64_t>(footer, length);
+        }
+    }
+    uint64_t footer_offset = out.size();
+    out.append(footer);
+    std::string trailer;
+    append_value<uint64_t>(trailer, footer_offset);
+    trailer += ColumnarMagic;
+    out.append(trailer);
+}
+
+void ColumnarFileWriter::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+    write_row_group();
+    write_footer();
+    out.close();
+}
+
+ColumnarFile::ColumnarFile(const char* filename) : file(filename, "columnar file") {
+    auto bytes = file.bytes();
+    auto size = bytes.size();
+    auto header_size = columnar_header().size();
+    if (size < header_size + sizeof(uint64_t) + ColumnarMagic.size()) {
+        throw std::runtime_error(std::format("{} is too small to be a columnar file", filename));
+    }
+    auto trailer = bytes.substr(size - sizeof(uint64_t) - ColumnarMagic.size());
+    if (bytes.substr(0, header_size) != columnar_header() || trailer.substr(sizeof(uint64_t)) != ColumnarMagic) {
+        throw std::runtime_error(std::format("{} is not a version {} columnar file", filename, ColumnarVersion));
+    }
+    auto footer_offset = read_value<uint64_t>(trailer);
+    if (footer_offset < header_size || footer_offset > size - sizeof(uint64_t) - ColumnarMagic.size()) {
+        throw std::runtime_error(std::format("{} has its footer out of bounds", filename));
+    }
+    auto footer = bytes.substr(footer_offset, size - footer_offset);
+
+    auto column_count = read_value<uint32_t>(footer);
+    size_t buffers_per_group = 0;
+    for (uint32_t i = 0; i < column_count; ++i) {
+        auto name_len = read_value<uint32_t>(footer);
+        if (footer.size() < name_len) {
+            throw std::runtime_error("columnar file footer is truncated");
+        }
+        ColumnSpec spec{std::string(footer.substr(0, name_len)), ColumnType::F64};
+        footer.remove_prefix(name_len);
+        spec.type = static_cast<ColumnType>(read_value<uint8_t>(footer));
+        spec.nullable = read_value<uint8_t>(footer) != 0;
+        first_buffer.emplace_back(buffers_per_group);
+        buffers_per_group += spec.buffer_count();
+        specs.emplace_back(std::move(spec));
+    }
+    auto group_count = read_value<uint32_t>(footer);
+    for (uint32_t i = 0; i < group_count; ++i) {
+        RowGroup group{read_value<uint64_t>(footer), {}};
+        for (size_t b = 0; b < buffers_per_group; ++b) {
+            auto offset = read_value<uint64_t>(footer);
+            auto length = read_value<uint64_t>(footer);
+            if (offset > footer_offset || length > footer_offset - offset) {
+                throw std::runtime_error(std::format("{} has a column buffer past its footer", filename));
+            }
+            group.buffers.emplace_back(offset, length);
+        }
+        groups.emplace_back(std::move(group));
+    }
+}
+
+size_t ColumnarFile::column_index(std::string_view name) const {
+    for (size_t i = 0; i < specs.size(); ++i) {
+        if (specs[i].name == name) {
+            return i;
+        }
+    }
+    throw std::runtime_error(std::format("no column named {}", name));
+}
+
+uint64_t ColumnarFile::total_rows() const {
+    uint64_t total = 0;
+    for (const auto& group: groups) {
+        total += group.rows;
+    }
+    return total;
+}
+
+std::string_view ColumnarFile::buffer(size_t group, size_t idx) const {
+    auto [offset, length] = groups[group].buffers[idx];
+    return file.bytes().substr(offset, length);
+}
+
+std::string_view ColumnarFile::value_buffer(size_t group, size_t column) const {
+    return buffer(group, first_buffer[column] + (specs[column].nullable ? 1 : 0));
+}
+
+std::string_view ColumnarFile::string(size_t group, size_t column, size_t row) const {
+    auto offsets = values<uint64_t>(group, column);
+    auto bytes = buffer(group, first_buffer[column] + (specs[column].nullable ? 2 : 1));
+    return bytes.substr(offsets[row], offsets[row + 1] - offsets[row]);
+}
+
+bool ColumnarFile::has_value(size_t group, size_t column, size_t row) const {
+    if (!specs[column].nullable) {
+        return true;
+    }
+    return buffer(group, first_buffer[column])[row] != 0;
+}
@@ -0,0 +1,452 @@
+//
+// Created by Sanger Steel on 6/21/25.
+//
+
+#include "completion_parser.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+// Every power of ten a double holds exactly
+constexpr double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+void append_utf8(std::string& out, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        out += static_cast<char>(codepoint);
+    } else if (codepoint < 0x800) {
+        out += static_cast<char>(0xC0 | (codepoint >> 6));
+        out += static_cast<char>(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        out += static_cast<char>(0xE0 | (codepoint >> 12));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codepoint & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (codepoint >> 18));
+        out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codepoint & 0x3F));
+    }
+}
+
+// Forward-only cursor over a single JSON document
+class ChunkReader {
+public:
+    explicit ChunkReader(std::string_view payload)
+        : begin(payload.data()), pos(payload.data()), end(payload.data() + payload.size()) {
+    }
+
+    [[noreturn]] void fail(const char* what) const {
+        throw std::runtime_error(std::format("Malformed completion chunk at byte {}: {}", pos - begin, what));
+    }
+
+    char peek() {
+        while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t')) {
+            ++pos;
+        }
+        if (pos == end) {
+            fail("unexpected end of input");
+        }
+        return *pos;
+    }
+
+    void expect(char c) {
+        if (peek() != c) {
+            fail("unexpected character");
+        }
+        ++pos;
+    }
+
+    bool consume(char c) {
+        if (peek() == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool consume_null() {
+        if (peek() != 'n') {
+            return false;
+        }
+        expect_literal("null");
+        return true;
+    }
+
+    // The keys we look for have no escapes, so keys are compared as raw bytes
+    template<typename OnField>
+    void object(OnField&& on_field) {
+        expect('{');
+        if (consume('}')) {
+            return;
+        }
+        do {
+            expect('"');
+            auto key_start = pos;
+            skip_string_body();
+            auto key = std::string_view(key_start, pos - key_start - 1);
+            expect(':');
+            on_field(key);
+        } while (consume(','));
+        expect('}');
+    }
+
+    template<typename OnElement>
+    void array(OnElement&& on_element) {
+        expect('[');
+        if (consume(']')) {
+            return;
+        }
+        do {
+            on_element();
+        } while (consume(','));
+        expect(']');
+    }
+
+    void string(std::string& out) {
+        expect('"');
+        out.clear();
+        auto run_start = pos;
+        while (pos < end) {
+            char c = *pos;
+            if (c == '"') {
+                out.append(run_start, pos);
+                ++pos;
+                return;
+            }
+            if (c == '\\') {
+                out.append(run_start, pos);
+                ++pos;
+                decode_escape(out);
+                run_start = pos;
+                continue;
+            }
+            ++pos;
+        }
+        fail("unterminated string");
+    }
+
+    double number() {
+        peek();
+        auto start = pos;
+        bool negative = *pos == '-';
+        if (negative) {
+            ++pos;
+        }
+        if (pos == end || !is_digit(*pos)) {
+            fail("expected a number");
+        }
+        uint64_t mantissa = 0;
+        int significant_digits = 0;
+        int exponent = 0;
+        bool truncated = false;
+        auto take_digit = [&](int digit, bool fractional) {
+            if (significant_digits < 19) {
+                mantissa = mantissa * 10 + digit;
+                if (mantissa != 0) {
+                    significant_digits++;
+                }
+                if (fractional) {
+                    exponent--;
+                }
+            } else {
+                truncated = true;
+                if (!fractional) {
+                    exponent++;
+                }
+            }
+        };
+        while (pos < end && is_digit(*pos)) {
+            take_digit(*pos++ - '0', false);
+        }
+        if (pos < end && *pos == '.') {
+            ++pos;
+            if (pos == end || !is_digit(*pos)) {
+                fail("expected a digit after the decimal point");
+            }
+            while (pos < end && is_digit(*pos)) {
+                take_digit(*pos++ - '0', true);
+            }
+        }
+        if (pos < end && (*pos == 'e' || *pos == 'E')) {
+            ++pos;
+            bool negative_exponent = pos < end && *pos == '-';
+            if (pos < end && (*pos == '-' || *pos == '+')) {
+                ++pos;
+            }
+            if (pos == end || !is_digit(*pos)) {
+                fail("expected a digit in the exponent");
+            }
+            int explicit_exponent = 0;
+            while (pos < end && is_digit(*pos)) {
+                explicit_exponent = std::min(explicit_exponent * 10 + (*pos++ - '0'), 100000);
+            }
+            exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+        }
+        // A mantissa under 2^53 scaled by an exact power of ten rounds correctly, which
+        // covers logprobs. Anything else goes through strtod like nlohmann does.
+        if (!truncated && significant_digits <= 15 && exponent >= -22 && exponent <= 22) {
+            double value = static_cast<double>(mantissa);
+            value = exponent < 0 ? value / exact_powers_of_ten[-exponent] : value * exact_powers_of_ten[exponent];
+            return negative ? -value : value;
+        }
+        std::string digits(start, pos);
+        return std::strtod(digits.c_str(), nullptr);
+    }
+
+    int integer() {
+        return static_cast<int>(number());
+    }
+
+    void skip_value() {
+        switch (peek()) {
+            case '"':
+                ++pos;
+                skip_string_body();
+                break;
+            case '{':
+                object([this](std::string_view) { skip_value(); });
+                break;
+            case '[':
+                array([this] { skip_value(); });
+                break;
+            case 't':
+                expect_literal("true");
+                break;
+            case 'f':
+                expect_literal("false");
+                break;
+            case 'n':
+                expect_literal("null");
+                break;
+            default:
+                number();
+        }
+    }
+
+    void finish() {
+        while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t')) {
+            ++pos;
+        }
+        if (pos != end) {
+            fail("trailing characters");
+        }
+    }
+
+private:
+    void expect_literal(std::string_view literal) {
+        if (static_cast<size_t>(end - pos) < literal.size() || std::memcmp(pos, literal.data(), literal.size()) != 0) {
+            fail("unexpected literal");
+        }
+        pos += literal.size();
+    }
+
+    // Leaves pos just past the closing quote
+    void skip_string_body() {
+        while (pos < end) {
+            auto* stop = static_cast<const char *>(std::memchr(pos, '"', end - pos));
+            if (!stop) {
+                break;
+            }
+            // The quote is escaped if an odd number of backslashes precede it
+            size_t backslashes = 0;
+            while (stop - backslashes > pos && *(stop - backslashes - 1) == '\\') {
+                backslashes++;
+            }
+            pos = stop + 1;
+            if (backslashes % 2 == 0) {
+                return;
+            }
+        }
+        fail("unterminated string");
+    }
+
+    uint32_t hex4() {
+        if (end - pos < 4) {
+            fail("truncated unicode escape");
+        }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = *pos++;
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                fail("invalid unicode escape");
+            }
+        }
+        return value;
+    }
+
+    void decode_escape(std::string& out) {
+        if (pos == end) {
+            fail("unterminated escape");
+        }
+        switch (*pos++) {
+            case '"': out += '"';
+                break;
+            case '\\': out += '\\';
+                break;
+            case '/': out += '/';
+                break;
+            case 'b': out += '\b';
+                break;
+            case 'f': out += '\f';
+                break;
+            case 'n': out += '\n';
+                break;
+            case 'r': out += '\r';
+                break;
+            case 't': out += '\t';
+                break;
+            case 'u': {
+                auto codepoint = hex4();
+                if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                    if (end - pos < 2 || pos[0] != '\\' || pos[1] != 'u') {
+                        fail("unpaired surrogate");
+                    }
+                    pos += 2;
+                    auto low = hex4();
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        fail("invalid low surrogate");
+                    }
+                    codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                } else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+                    fail("unpaired surrogate");
+                }
+                append_utf8(out, codepoint);
+                break;
+            }
+            default:
+                fail("invalid escape");
+        }
+    }
+
+    const char* begin;
+    const char* pos;
+    const char* end;
+};
+
+void read_logprobs(ChunkReader& reader, Logprobs& logprobs) {
+    reader.object([&](std::string_view key) {
+        if (key == "tokens") {
+            reader.array([&] {
+                reader.string(logprobs.tokens.emplace_back());
+            });
+        } else if (key == "token_logprobs") {
+            reader.array([&] {
+                // The prompt's first token has no logprob when echoing
+                logprobs.token_logprobs.emplace_back(
+                    reader.consume_null() ? std::numeric_limits<float>::quiet_NaN() : static_cast<float>(reader.number()));
+            });
+        } else if (key == "top_logprobs") {
+            auto& tops = logprobs.top_logprobs;
+            std::string token;
+            reader.array([&] {
+                tops.begin_position();
+                if (reader.consume_null()) {
+                    return;
+                }
+                // Tokens are often escapes like "\n", so unlike field names they're decoded
+                reader.expect('{');
+                if (!reader.consume('}')) {
+                    do {
+                        reader.string(token);
+                        reader.expect(':');
+                        tops.add(token, static_cast<float>(reader.number()));
+                    } while (reader.consume(','));
+                    reader.expect('}');
+                }
+                tops.end_position();
+            });
+        } else {
+            reader.skip_value();
+        }
+    });
+}
+
+Choice read_choice(ChunkReader& reader) {
+    Choice choice;
+    choice.finish_reason = "null";
+    reader.object([&](std::string_view key) {
+        if (key == "text") {
+            reader.string(choice.text);
+        } else if (key == "index") {
+            choice.index = reader.integer();
+        } else if (key == "finish_reason") {
+            if (!reader.consume_null()) {
+                reader.string(choice.finish_reason);
+            }
+        } else if (key == "logprobs") {
+            if (!reader.consume_null()) {
+                read_logprobs(reader, choice.logprobs);
+            }
+        } else {
+            reader.skip_value();
+        }
+    });
+    return choice;
+}
+}
+
+std::optional<ChunkParser> chunk_parser_from_str(const std::string& str) {
+    if (str == "nlohmann") {
+        return ChunkParser::NLOHMANN;
+    }
+    if (str == "ondemand") {
+        return ChunkParser::ONDEMAND;
+    }
+    return std::nullopt;
+}
+
+CompletionResults parse_completion_chunk(std::string_view payload) {
+    ChunkReader reader(payload);
+    CompletionResults results;
+    results.model = "N/A";
+    bool has_choices = false;
+    reader.object([&](std::string_view key) {
+        if (key == "id") {
+            reader.string(results.id);
+        } else if (key == "object") {
+            reader.string(results.object);
+        } else if (key == "created") {
+            results.created = reader.integer();
+        } else if (key == "model") {
+            reader.string(results.model);
+        } else if (key == "choices") {
+            has_choices = true;
+            reader.array([&] {
+                results.choices.emplace_back(read_choice(reader));
+            });
+        } else {
+            reader.skip_value();
+        }
+    });
+    reader.finish();
+    if (!has_choices) {
+        throw std::runtime_error("Completion chunk has no choices");
+    }
+    return results;
+}
+
+CompletionResults parse_completion_results(std::string_view payload, ChunkParser parser) {
+    if (parser == ChunkParser::NLOHMANN) {
+        return CompletionResults(std::string(payload));
+    }
+    return parse_completion_chunk(payload);
+}
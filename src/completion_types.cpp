@@ -3,9 +3,71 @@
 //
 
 #include "completion_types.hpp"
+#include <algorithm>
+
+void TopLogprobs::begin_position() {
+    position_starts.emplace_back(entries.size());
+}
+
+void TopLogprobs::add(std::string_view token, float logprob) {
+    entries.emplace_back(Entry{
+        static_cast<uint32_t>(arena.size()), static_cast<uint32_t>(token.size()), logprob
+    });
+    arena.append(token);
+}
+
+void TopLogprobs::end_position() {
+    sort_position(position_starts.size() - 1);
+}
+
+TopLogprobs::Position TopLogprobs::operator[](size_t position) const {
+    auto first = position_starts[position];
+    auto last = position + 1 < position_starts.size() ? position_starts[position + 1] : entries.size();
+    return Position(entries.data() + first, entries.data() + last, &arena);
+}
+
+void TopLogprobs::sort_position(size_t position) {
+    auto first = entries.begin() + position_starts[position];
+    auto last = position + 1 < position_starts.size() ? entries.begin() + position_starts[position + 1] : entries.end();
+    std::sort(first, last, [this](const Entry& a, const Entry& b) {
+        if (a.logprob != b.logprob) {
+            return a.logprob > b.logprob;
+        }
+        return std::string_view(arena).substr(a.offset, a.len) < std::string_view(arena).substr(b.offset, b.len);
+    });
+}
+
+void TopLogprobs::sort() {
+    for (size_t position = 0; position < position_starts.size(); ++position) {
+        sort_position(position);
+    }
+}
+
+bool TopLogprobs::operator==(const TopLogprobs& other) const {
+    if (size() != other.size()) {
+        return false;
+    }
+    for (size_t position = 0; position < size(); ++position) {
+        auto ours = (*this)[position];
+        auto theirs = other[position];
+        if (ours.size() != theirs.size()) {
+            return false;
+        }
+        auto it = theirs.begin();
+        for (auto [token, logprob]: ours) {
+            auto other_top = *it;
+            if (token != other_top.token || logprob != other_top.logprob) {
+                return false;
+            }
+            ++it;
+        }
+    }
+    return true;
+}
 
 TopLogprobs sort_top_logprobs(TopLogprobs& tops) {
-    throw std::logic_error("Not implemented");
+    tops.sort();
+    return tops;
 }
 
 Logprobs::Logprobs(json logprobs_json) {
@@ -13,8 +75,11 @@ Logprobs::Logprobs(json logprobs_json) {
     logprobs_json.at("token_logprobs").get_to(token_logprobs);
     auto top_logprobs_list = logprobs_json.at("top_logprobs");
     for (auto& top_logprob: top_logprobs_list) {
-        auto tops = top_logprob.get<std::unordered_map<std::string, float>>();
-        top_logprobs.emplace_back(tops);
+        top_logprobs.begin_position();
+        for (auto& [token, logprob]: top_logprob.items()) {
+            top_logprobs.add(token, logprob.get<float>());
+        }
+        top_logprobs.end_position();
     }
 }
 
@@ -0,0 +1,77 @@
+//
+// Created by Sanger Steel on 6/15/25.
+//
+
+#include "connection_pool.hpp"
+#include <stdexcept>
+
+CURLShare::CURLShare(bool share_connections) {
+    share = curl_share_init();
+    if (!share) {
+        throw std::runtime_error("curl_share_init failed");
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_cb);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_cb);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // Multi handles already share connections between their transfers, and libcurl
+    // doesn't support multiplexing over a connection shared across threads
+    if (share_connections) {
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+}
+
+CURLShare::~CURLShare() {
+    curl_share_cleanup(share);
+}
+
+void CURLShare::lock_cb(CURL*, curl_lock_data data, curl_lock_access, void* userp) {
+    static_cast<CURLShare *>(userp)->locks[data].lock();
+}
+
+void CURLShare::unlock_cb(CURL*, curl_lock_data data, void* userp) {
+    static_cast<CURLShare *>(userp)->locks[data].unlock();
+}
+
+ConnectionPool::ConnectionPool(CURLSH* share) : share(share) {
+}
+
+ConnectionPool::~ConnectionPool() {
+    for (auto& shard: shards) {
+        for (auto* easy: shard.idle) {
+            curl_easy_cleanup(easy);
+        }
+    }
+}
+
+size_t ConnectionPool::worker_shard() {
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % ConnectionPoolShards;
+    return shard;
+}
+
+PooledHandle ConnectionPool::acquire() {
+    auto idx = worker_shard();
+    auto& shard = shards[idx];
+    CURL* easy = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(shard.mu);
+        if (!shard.idle.empty()) {
+            easy = shard.idle.back();
+            shard.idle.pop_back();
+        }
+    }
+    if (!easy) {
+        easy = curl_easy_init();
+    }
+    curl_easy_setopt(easy, CURLOPT_SHARE, share);
+    return PooledHandle{easy, idx};
+}
+
+void ConnectionPool::release(PooledHandle handle) {
+    curl_easy_reset(handle.easy);
+    auto& shard = shards[handle.shard];
+    std::lock_guard<std::mutex> lock(shard.mu);
+    shard.idle.emplace_back(handle.easy);
+}
@@ -6,34 +6,7 @@
 #include <thread>
 #include <random>
 #include "logger.hpp"
-
-constexpr size_t data_token_len = std::string("data:").size();
-const std::string done_token = "[DONE]";
-const std::string start_token = "{\"";
-
-// The end token here is not as fragile as it may look,
-// as this will not trigger on outputted model text that
-// happens to generate this character sequence. Only on
-// servers that append double newlines to their response payloads
-const std::string end_token = "}\n";
-
-const std::string chunk_start_text = "data: ";
-
-const std::string choices_start_text = "\"choices\":";
-// Having the sentinel tokens include quotes are a good idea
-// because the JSON payload will need to manually escape them, like \\".
-const std::string choices_block_end_token = "}],\"";
-
-
-enum class ChunkStates {
-    START,
-    FOUND_CHUNK_START,
-    PARSING_BEGINNING_PAYLOAD,
-    IN_CHOICES_BLOCK,
-    PARSING_END_PAYLOAD,
-    FOUND_CHUNK_END,
-    END,
-};
+#include "simd_scan.hpp"
 
 size_t write_cb_default(void* contents, size_t size, size_t nmemb, void* userp) {
     ((std::string *) userp)->append((char *) contents, size * nmemb);
@@ -41,16 +14,33 @@ size_t write_cb_default(void* contents, size_t size, size_t nmemb, void* userp)
 }
 
 size_t write_cb_to_queue(void* contents, size_t size, size_t nmemb, void* userp) {
+    // Every event parsed out of this read arrived at the same time
+    auto received = monotonic_clock::now();
     auto idx = Logger.set_start();
     auto as_streaming_resp = (StreamingResponse *) userp;
-    auto content = std::string((char *) contents, size * nmemb);
+    auto content = std::string_view((char *) contents, size * nmemb);
     Logger.send_chunks_calls.fetch_add(1, std::memory_order_acq_rel);
-    push_chunks(as_streaming_resp, std::move(content));
+    push_chunks(as_streaming_resp, content, received);
     Logger.set_stop_and_display_time(idx, "write_cb_to_queue");
     return size * nmemb;
 }
 
-CURLHandler::CURLHandler(const char* uri, const char* api_key, std::optional<long> timeout) : timeout(timeout) {
+std::optional<TransportMode> transport_mode_from_str(const std::string& str) {
+    if (str == "threaded") {
+        return TransportMode::THREAD_PER_REQUEST;
+    }
+    if (str == "event-loop") {
+        return TransportMode::EVENT_LOOP;
+    }
+    return std::nullopt;
+}
+
+CURLHandler::CURLHandler(
+    const char* uri,
+    const char* api_key,
+    std::optional<long> timeout,
+    TransportOptions transport
+) : timeout(timeout), transport(transport) {
     this->uri = std::string(uri);
     if (!api_key) {
         throw std::runtime_error("No api key provided.");
@@ -59,6 +49,40 @@ CURLHandler::CURLHandler(const char* uri, const char* api_key, std::optional<lon
     headers = curl_slist_append(headers, "Content-Type: application/json");
     std::string token_header = std::format("Authorization: Bearer {}", this->api_key);
     headers = curl_slist_append(headers, token_header.c_str());
+
+    if (transport.reuse_connections) {
+        share = std::make_unique<CURLShare>(transport.mode == TransportMode::THREAD_PER_REQUEST);
+        pool = std::make_unique<ConnectionPool>(share->get());
+    }
+
+    if (transport.mode == TransportMode::EVENT_LOOP) {
+        if (transport.event_loops < 1) {
+            throw std::runtime_error("At least one event loop is required.");
+        }
+        EventLoopOptions loop_options;
+        loop_options.multiplex = transport.http2;
+        loop_options.max_concurrent_streams = transport.max_streams_per_connection;
+        if (transport.max_connections > 0) {
+            // Split the connection budget between loops, each loop needs at least one. Rounding
+            // down keeps the loops together under the cap.
+            if (transport.max_connections < transport.event_loops) {
+                throw std::runtime_error("Fewer connections than event loops, each loop needs one.");
+            }
+            loop_options.max_connections = transport.max_connections / transport.event_loops;
+        }
+        for (int i = 0; i < transport.event_loops; ++i) {
+            event_loops.emplace_back(std::make_unique<CURLEventLoop>(loop_options));
+        }
+    } else if (transport.http2 || transport.max_connections > 0) {
+        throw std::runtime_error("HTTP/2 multiplexing and connection limits need the event loop transport.");
+    }
+}
+
+CURLHandler::~CURLHandler() {
+    // Loops own in-flight handles that reference `headers`, so stop them first
+    event_loops.clear();
+    pool.reset();
+    curl_slist_free_all(headers);
 }
 
 std::string CURLHandler::get(const char* query) {
@@ -82,12 +106,99 @@ std::string CURLHandler::get(const char* query) {
     return response;
 }
 
+PooledHandle CURLHandler::make_stream_handle(const std::shared_ptr<std::string>& post_data, StreamingResponse* resp) {
+    PooledHandle handle = pool ? pool->acquire() : PooledHandle{curl_easy_init(), 0};
+    CURL* ephemeral = handle.easy;
+    curl_easy_setopt(ephemeral, CURLOPT_URL, this->uri.c_str());
+    curl_easy_setopt(ephemeral, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(ephemeral, CURLOPT_POST, 1L);
+    curl_easy_setopt(ephemeral, CURLOPT_POSTFIELDS, post_data->c_str());
+    curl_easy_setopt(ephemeral, CURLOPT_POSTFIELDSIZE, post_data->size());
+    curl_easy_setopt(ephemeral, CURLOPT_WRITEFUNCTION, write_cb_to_queue);
+
+    if (this->timeout.has_value()) {
+        // Logger.debug("Using timeout: {}", std::to_string(this->timeout.value()));
+        curl_easy_setopt(ephemeral, CURLOPT_TIMEOUT, this->timeout.value());
+    }
+
+    if (Logger.level == DEBUG) {
+        curl_easy_setopt(ephemeral, CURLOPT_VERBOSE, 1L);
+    }
+    curl_easy_setopt(ephemeral, CURLOPT_WRITEDATA, resp);
+
+    if (transport.http2) {
+        // Plain http:// can't negotiate HTTP/2 through ALPN, so assume the server speaks h2c
+        auto version = uri.starts_with("http://") ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS;
+        curl_easy_setopt(ephemeral, CURLOPT_HTTP_VERSION, static_cast<long>(version));
+        // Wait for a stream on an existing connection rather than opening a new one
+        curl_easy_setopt(ephemeral, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    if (transport.reuse_connections) {
+        curl_easy_setopt(ephemeral, CURLOPT_TCP_KEEPALIVE, 1L);
+    } else {
+        curl_easy_setopt(ephemeral, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(ephemeral, CURLOPT_FORBID_REUSE, 1L);
+        curl_easy_setopt(ephemeral, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
+        curl_easy_setopt(ephemeral, CURLOPT_SSL_SESSIONID_CACHE, 0L);
+    }
+    return handle;
+}
+
+void CURLHandler::release_handle(PooledHandle handle) {
+    if (pool) {
+        pool->release(handle);
+    } else {
+        curl_easy_cleanup(handle.easy);
+    }
+}
+
+void record_timings(CURL* ephemeral, StreamingResponse& resp) {
+    auto finished = monotonic_clock::now();
+    double name_lookup, connect, ssl, start_transfer, total;
+    long new_connections = 0;
+    curl_easy_getinfo(ephemeral, CURLINFO_NAMELOOKUP_TIME, &name_lookup);
+    curl_easy_getinfo(ephemeral, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(ephemeral, CURLINFO_APPCONNECT_TIME, &ssl);
+    curl_easy_getinfo(ephemeral, CURLINFO_STARTTRANSFER_TIME, &start_transfer);
+    curl_easy_getinfo(ephemeral, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(ephemeral, CURLINFO_NUM_CONNECTS, &new_connections);
+
+    // The first byte is usually just headers. ttft is replaced by the first token's
+    // arrival once the stream's events have been parsed.
+    resp.latencies.time_to_first_byte = start_transfer;
+    resp.latencies.ttft = start_transfer;
+    // Measured on the same clock as the token timestamps, since curl's clock only starts
+    // once an event loop picks the transfer up
+    resp.latencies.end_to_end_latency = std::chrono::duration<double>(finished - resp.start).count();
+    resp.latencies.intended_start = resp.intended_start;
+    resp.latencies.actual_start = resp.start;
+    resp.latencies.queue_delay = std::chrono::duration<double>(resp.start - resp.intended_start).count();
+    Logger.debug(std::format(
+        "timing: DNS={}s, TCP={}s, SSL={}s, TTFT={}s, Total={}s, new connections={}",
+        name_lookup, connect - name_lookup, ssl - connect,
+        start_transfer, total, new_connections
+    ));
+}
+
 std::shared_ptr<StreamingResponse> CURLHandler::post_stream(RequestParameters& req) {
     auto post_data = std::make_shared<std::string>(req.to_json().dump());
-    auto resp = std::make_shared<StreamingResponse>();
-    resp->start = std::chrono::high_resolution_clock::now();
-    resp->got_ttft = false;
+    auto resp = responses.acquire(stream_ring_capacity(req.max_tokens));
+    resp->start = monotonic_clock::now();
+    resp->intended_start = req.intended_start.value_or(resp->start);
+
+    if (transport.mode == TransportMode::EVENT_LOOP) {
+        post_stream_event_loop(post_data, resp);
+    } else {
+        post_stream_threaded(post_data, resp);
+    }
+    return resp;
+}
 
+void CURLHandler::post_stream_threaded(
+    const std::shared_ptr<std::string>& post_data,
+    const std::shared_ptr<StreamingResponse>& resp
+) {
     // TODO: Processing can inflate the "true" benchmarking numbers. Figure out how to resolve this
     //       either by taking more measurements that can exclude the processing time, or something
     //       else
@@ -95,46 +206,19 @@ std::shared_ptr<StreamingResponse> CURLHandler::post_stream(RequestParameters& r
         [post_data, resp, this] {
             bool finished = false;
             while (!finished) {
-                CURL* ephemeral = curl_easy_init();
-                curl_easy_setopt(ephemeral, CURLOPT_URL, this->uri.c_str());
-                curl_easy_setopt(ephemeral, CURLOPT_HTTPHEADER, headers);
-                curl_easy_setopt(ephemeral, CURLOPT_POST, 1L);
-                curl_easy_setopt(ephemeral, CURLOPT_POSTFIELDS, post_data->c_str());
-                curl_easy_setopt(ephemeral, CURLOPT_POSTFIELDSIZE, post_data->size());
-                curl_easy_setopt(ephemeral, CURLOPT_WRITEFUNCTION, write_cb_to_queue);
-
-                if (this->timeout.has_value()) {
-                    // Logger.debug("Using timeout: {}", std::to_string(this->timeout.value()));
-                    curl_easy_setopt(ephemeral, CURLOPT_TIMEOUT, this->timeout);
-                }
-
-                if (Logger.level == DEBUG) {
-                    curl_easy_setopt(ephemeral, CURLOPT_VERBOSE, 1L);
-                }
-                curl_easy_setopt(ephemeral, CURLOPT_WRITEDATA, resp.get());
+                auto handle = make_stream_handle(post_data, resp.get());
+                CURL* ephemeral = handle.easy;
                 auto idx = Logger.set_start();
-                resp->start = std::chrono::high_resolution_clock::now();
+                resp->start = monotonic_clock::now();
                 auto res = curl_easy_perform(ephemeral);
 
-                double name_lookup, connect, ssl, start_transfer, total;
-                curl_easy_getinfo(ephemeral, CURLINFO_NAMELOOKUP_TIME, &name_lookup);
-                curl_easy_getinfo(ephemeral, CURLINFO_CONNECT_TIME, &connect);
-                curl_easy_getinfo(ephemeral, CURLINFO_APPCONNECT_TIME, &ssl);
-                curl_easy_getinfo(ephemeral, CURLINFO_STARTTRANSFER_TIME, &start_transfer);
-                curl_easy_getinfo(ephemeral, CURLINFO_TOTAL_TIME, &total);
-
-                resp->latencies.ttft = start_transfer;
-                resp->latencies.end_to_end_latency = total;
+                record_timings(ephemeral, *resp);
                 Logger.set_stop_and_display_time(idx, "e2e from server");
-                Logger.debug(std::format(
-                    "timing: DNS={}s, TCP={}s, SSL={}s, TTFT={}s, Total={}s",
-                    name_lookup, connect - name_lookup, ssl - connect,
-                    start_transfer, total
-                ));
                 if (res != CURLE_OK) {
                     if (res == CURLE_OPERATION_TIMEDOUT) {
                         Logger.debug("Request timed out, retrying..");
-                        curl_easy_cleanup(ephemeral);
+                        release_handle(handle);
+                        resp->retry();
                     } else {
                         // TODO: C-style error here is weird
                         fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
@@ -142,27 +226,62 @@ std::shared_ptr<StreamingResponse> CURLHandler::post_stream(RequestParameters& r
                     }
                 } else {
                     resp->finalize();
-                    curl_easy_cleanup(ephemeral);
+                    release_handle(handle);
                     finished = true;
                 }
             }
         }
     );
     resp->t = std::move(t);
-    return resp;
+}
+
+CURLEventLoop& CURLHandler::next_event_loop() {
+    auto idx = next_loop_idx.fetch_add(1, std::memory_order_relaxed);
+    return *event_loops[idx % event_loops.size()];
+}
+
+void CURLHandler::post_stream_event_loop(
+    const std::shared_ptr<std::string>& post_data,
+    const std::shared_ptr<StreamingResponse>& resp
+) {
+    auto handle = make_stream_handle(post_data, resp.get());
+    resp->start = monotonic_clock::now();
+    // The callback keeps post_data and resp alive until the transfer is done, and
+    // resubmits on timeout the same way the threaded transport retries.
+    next_event_loop().submit(handle.easy, [post_data, resp, handle, this](CURL* easy, CURLcode res) {
+        record_timings(easy, *resp);
+        release_handle(handle);
+        if (res == CURLE_OK) {
+            resp->finalize();
+        } else if (res == CURLE_OPERATION_TIMEDOUT) {
+            Logger.debug("Request timed out, retrying..");
+            resp->retry();
+            post_stream_event_loop(post_data, resp);
+        } else if (res == CURLE_ABORTED_BY_CALLBACK) {
+            // The loop shut down under the transfer, wake whoever awaits it
+            Logger.debug("Request aborted by its event loop shutting down");
+            resp->finalize();
+        } else {
+            fprintf(stderr, "curl_multi_socket_action() failed: %s\n", curl_easy_strerror(res));
+            exit(1);
+        }
+    });
 }
 
 LatencyMetrics CURLHandler::await(std::shared_ptr<StreamingResponse> resp) {
     if (!resp) {
         throw std::runtime_error("response stream is null");
     }
-    if (!resp->done) {
+    if (resp->t.joinable()) {
         resp->t.join();
+    } else {
+        // Event loop transfers have no thread to join, finalize() signals completion
+        resp->done.wait(false, std::memory_order_acquire);
     }
     return resp->latencies;
 }
 
-RingResult<std::string> CURLHandler::fetch(const std::shared_ptr<StreamingResponse>& resp) {
+RingResult<StreamEvent> CURLHandler::fetch(const std::shared_ptr<StreamingResponse>& resp) {
     if (resp) {
         return resp->fetch();
     }
@@ -177,122 +296,22 @@ bool CURLHandler::write_to_buffer_finished(const std::shared_ptr<StreamingRespon
 }
 
 bool str_contains(const std::string& str, const std::string& to_test) {
-    auto comparison_window = to_test.size();
-    std::string might_be_chunk;
-
-    for (int i = 0; i < str.size(); i++) {
-        might_be_chunk = str.substr(i, comparison_window);
-        if (might_be_chunk == to_test) {
-            return true;
-        }
-    }
-    return false;
-}
-
-bool maybe_found_chunk_start(ChunkStates& state, const std::string& char_buffer) {
-    if (str_contains(char_buffer, chunk_start_text)) {
-        state = ChunkStates::FOUND_CHUNK_START;
-        return true;
-    }
-    return false;
-}
-
-bool maybe_found_end(ChunkStates& state, const std::string& content, int idx) {
-    if (idx >= content.size() - 2) {
-        state = ChunkStates::END;
-        return true;
-    }
-    return false;
-}
-
-bool maybe_found_token_start(ChunkStates& state, const std::string& char_buffer) {
-    if (char_buffer == start_token) {
-        assert(state == ChunkStates::FOUND_CHUNK_START || state == ChunkStates::PARSING_END_PAYLOAD);
-        state = ChunkStates::PARSING_BEGINNING_PAYLOAD;
-        return true;
-    }
-    return false;
-}
-
-bool maybe_found_choice_start(ChunkStates& state, const std::string& char_buffer) {
-    if (str_contains(char_buffer, choices_start_text)) {
-        state = ChunkStates::IN_CHOICES_BLOCK;
-        return true;
-    }
-    return false;
-}
-
-bool maybe_finished_with_choice_block(ChunkStates& state, const std::string& char_buffer) {
-    if (char_buffer.size() > choices_block_end_token.size()) {
-        auto to_test = char_buffer.substr(char_buffer.size() - choices_block_end_token.size());
-        if (to_test == choices_block_end_token) {
-            state = ChunkStates::PARSING_END_PAYLOAD;
-            return true;
-        }
-    }
-    return false;
-}
-
-bool maybe_found_token_end(ChunkStates& state, const std::string& char_buffer) {
-    if (char_buffer.size() > end_token.size()) {
-        std::string to_test = char_buffer.substr(char_buffer.size() - end_token.size());
-        if (to_test == end_token) {
-            state = ChunkStates::FOUND_CHUNK_END;
-            return true;
-        }
-    }
-    return false;
+    return scan_kernel().find_substring(str.data(), str.size(), to_test) != std::string::npos;
 }
 
-void push_chunks(StreamingResponse* streamed, std::string content) {
-    int pushes = 0;
-    int i = 0;
-
-    std::string char_buffer;
-    ChunkStates state = ChunkStates::START;
-
-    std::string data_chunk = "";
-    char c;
-
-    for (i = 0; i <= content.size(); ++i) {
-        c = content[i];
-        char_buffer += c;
-        switch (state) {
-            case ChunkStates::START:
-                if (maybe_found_chunk_start(state, char_buffer)) { char_buffer.clear(); }
-                break;
-            case ChunkStates::FOUND_CHUNK_START:
-                if (maybe_found_token_start(state, char_buffer)) { break; }
-                if (maybe_found_end(state, content, i)) {
-                    break;
-                }
-                break;
-            case ChunkStates::PARSING_BEGINNING_PAYLOAD:
-                if (maybe_found_choice_start(state, char_buffer)) { break; }
-            case ChunkStates::IN_CHOICES_BLOCK:
-                if (maybe_finished_with_choice_block(state, char_buffer)) { break; }
-                break;
-            case ChunkStates::PARSING_END_PAYLOAD:
-                if (maybe_found_token_end(state, char_buffer)) {
-                    char_buffer.pop_back(); // remove the stray \n from end_token
-                    streamed->push(std::move(char_buffer));
-                    pushes++;
-                }
-                break;
-            case ChunkStates::FOUND_CHUNK_END:
-                if (maybe_found_chunk_start(state, char_buffer)) { break; };
-                maybe_found_end(state, content, i);
-                break;
-            case ChunkStates::END:
-                if (pushes == 0) {
-                    Logger.failed_to_parse_strings.emplace_back(content);
-                }
-                return;
-            default: break;
-        }
+void push_chunks(StreamingResponse* streamed, std::string_view content, time_point received) {
+    auto& parser = streamed->parser;
+    parser.feed(content);
+    // Every event this read completed goes into the ring as one batch. Transfers stay on
+    // their callback's thread, so the batch is reused across reads without locking.
+    thread_local std::vector<StreamEvent> batch;
+    // The ring outlives the parser's buffer, so this is the one copy an event gets
+    while (auto event = parser.next_event()) {
+        batch.emplace_back(StreamEvent{std::string(event.value()), received, streamed->attempt});
     }
-    if (state != ChunkStates::END) {
-        Logger.failed_to_parse_strings.emplace_back(content);
+    if (!batch.empty()) {
+        streamed->push_bulk(batch);
+        batch.clear();
     }
 }
 
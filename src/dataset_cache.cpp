@@ -0,0 +1,219 @@
+//
+// Created by Sanger Steel on 6/29/25.
+//
+
+#include "dataset_cache.hpp"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+#include "jsonl_writer.hpp"
+#include "mapped_file.hpp"
+
+static_assert(std::endian::native == std::endian::little, "the dataset cache is written in host byte order");
+
+namespace {
+constexpr size_t DatasetCacheAlignment = 8;
+constexpr std::string_view DatasetCacheExtension = ".rows";
+constexpr std::string_view DatasetCacheCompleteSuffix = ".end";
+
+template<typename T>
+void append_value(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+T read_value(std::string_view& in) {
+    if (in.size() < sizeof(T)) {
+        throw std::runtime_error("dataset cache file is truncated");
+    }
+    T value;
+    std::memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return value;
+}
+
+std::string sanitize(std::string_view name) {
+    std::string out(name);
+    for (auto& c: out) {
+        bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+        if (!keep) {
+            c = '_';
+        }
+    }
+    return out;
+}
+
+std::string key_prefix(const DatasetCacheKey& key) {
+    return std::format("{}.{}.{}.", sanitize(key.tag), sanitize(key.subset), sanitize(key.split));
+}
+
+std::string key_bytes(const DatasetCacheKey& key) {
+    std::string out = key.tag;
+    out.push_back('\0');
+    out += key.subset;
+    out.push_back('\0');
+    out += key.split;
+    return out;
+}
+
+// Parses "<first>-<last>" and whether it's the rest of the split out of a cache file name
+// that starts with prefix
+std::optional<DatasetCacheKey> range_from_filename(std::string_view name, std::string_view prefix) {
+    if (!name.starts_with(prefix) || !name.ends_with(DatasetCacheExtension)) {
+        return std::nullopt;
+    }
+    name.remove_prefix(prefix.size());
+    name.remove_suffix(DatasetCacheExtension.size());
+    DatasetCacheKey range;
+    range.complete = name.ends_with(DatasetCacheCompleteSuffix);
+    if (range.complete) {
+        name.remove_suffix(DatasetCacheCompleteSuffix.size());
+    }
+    uint64_t first = 0;
+    uint64_t last = 0;
+    auto [dash, ec] = std::from_chars(name.data(), name.data() + name.size(), first);
+    if (ec != std::errc() || dash == name.data() + name.size() || *dash != '-') {
+        return std::nullopt;
+    }
+    auto [end, ec_last] = std::from_chars(dash + 1, name.data() + name.size(), last);
+    if (ec_last != std::errc() || end != name.data() + name.size() || last < first) {
+        return std::nullopt;
+    }
+    range.first_row = first;
+    range.last_row = last;
+    return range;
+}
+
+std::vector<json> read_rows(const std::filesystem::path& path, const DatasetCacheKey& key) {
+    MappedFile mapped(path, "dataset cache file");
+    auto file = mapped.bytes();
+    auto in = file;
+    if (in.substr(0, DatasetCacheMagic.size()) != DatasetCacheMagic) {
+        throw std::runtime_error(std::format("{} is not a dataset cache file", path.string()));
+    }
+    in.remove_prefix(DatasetCacheMagic.size());
+    if (read_value<uint32_t>(in) != DatasetCacheVersion) {
+        throw std::runtime_error(std::format("{} is not a version {} dataset cache file", path.string(), DatasetCacheVersion));
+    }
+    auto flags = read_value<uint32_t>(in);
+    auto first_row = read_value<uint64_t>(in);
+    auto row_count = read_value<uint64_t>(in);
+    auto key_len = read_value<uint32_t>(in);
+    if (in.size() < key_len || in.substr(0, key_len) != key_bytes(key)) {
+        throw std::runtime_error(std::format("{} holds a different dataset than its name says", path.string()));
+    }
+    // Bounded by the file before it's used in any arithmetic, so a damaged header can't
+    // wrap around the checks below and send the index lookups past the mapping
+    auto index_offset = file.size() - in.size() + key_len;
+    index_offset += (DatasetCacheAlignment - index_offset % DatasetCacheAlignment) % DatasetCacheAlignment;
+    if (index_offset > file.size() || row_count >= (file.size() - index_offset) / sizeof(uint64_t)) {
+        throw std::runtime_error(std::format("{} has a truncated row index", path.string()));
+    }
+    if (first_row > std::numeric_limits<uint64_t>::max() - row_count) {
+        throw std::runtime_error(std::format("{} has a first row past the end of any split", path.string()));
+    }
+
+    // The rest of the split is all there is past its last row
+    auto last_row = key.last_row;
+    if (flags & DatasetCacheCompleteSplit) {
+        last_row = std::max(key.first_row, std::min(last_row, first_row + row_count));
+    }
+    if (key.first_row < first_row || last_row > first_row + row_count) {
+        throw std::runtime_error(std::format("{} holds fewer rows than its name says", path.string()));
+    }
+
+    auto rows_offset = index_offset + (row_count + 1) * sizeof(uint64_t);
+    auto rows = file.substr(rows_offset);
+    auto row_offset = [&](uint64_t row) {
+        uint64_t offset;
+        std::memcpy(&offset, file.data() + index_offset + row * sizeof(uint64_t), sizeof(offset));
+        return offset;
+    };
+
+    std::vector<json> out;
+    out.reserve(last_row - key.first_row);
+    for (auto row = key.first_row - first_row; row < last_row - first_row; ++row) {
+        auto begin = row_offset(row);
+        auto end = row_offset(row + 1);
+        if (begin > end || end > rows.size()) {
+            throw std::runtime_error(std::format("{} has a row past its end", path.string()));
+        }
+        auto bytes = reinterpret_cast<const uint8_t*>(rows.data());
+        try {
+            out.emplace_back(json{{"row", json::from_msgpack(bytes + begin, bytes + end)}});
+        } catch (const json::exception& e) {
+            throw std::runtime_error(std::format("{} has a malformed row {}: {}", path.string(), first_row + row, e.what()));
+        }
+    }
+    return out;
+}
+}
+
+std::string DatasetCacheKey::filename() const {
+    return std::format("{}{}-{}{}{}", key_prefix(*this), first_row, last_row,
+                       complete ? DatasetCacheCompleteSuffix : "", DatasetCacheExtension);
+}
+
+std::optional<std::vector<json>> DatasetCache::load(const DatasetCacheKey& key) const {
+    std::error_code ec;
+    auto exact = path_for(key);
+    if (std::filesystem::is_regular_file(exact, ec)) {
+        return read_rows(exact, key);
+    }
+    if (!std::filesystem::is_directory(dir, ec)) {
+        return std::nullopt;
+    }
+
+    // A file covering a wider range than asked for works too, as does one holding the rest
+    // of the split from before the first row asked for
+    auto prefix = key_prefix(key);
+    for (const auto& entry: std::filesystem::directory_iterator(dir, ec)) {
+        auto range = range_from_filename(entry.path().filename().string(), prefix);
+        if (range && range->first_row <= key.first_row && (key.last_row <= range->last_row || range->complete)) {
+            return read_rows(entry.path(), key);
+        }
+    }
+    return std::nullopt;
+}
+
+void DatasetCache::store(const DatasetCacheKey& key, const std::vector<json>& rows) const {
+    if (rows.size() != key.last_row - key.first_row) {
+        throw std::runtime_error(std::format("Expected {} rows to cache, got {}", key.last_row - key.first_row, rows.size()));
+    }
+    std::filesystem::create_directories(dir);
+
+    std::string header(DatasetCacheMagic);
+    append_value<uint32_t>(header, DatasetCacheVersion);
+    append_value<uint32_t>(header, key.complete ? DatasetCacheCompleteSplit : 0);
+    append_value<uint64_t>(header, key.first_row);
+    append_value<uint64_t>(header, rows.size());
+    auto key_data = key_bytes(key);
+    append_value<uint32_t>(header, key_data.size());
+    header += key_data;
+    header.append((DatasetCacheAlignment - header.size() % DatasetCacheAlignment) % DatasetCacheAlignment, '\0');
+
+    std::string index;
+    std::vector<uint8_t> packed;
+    append_value<uint64_t>(index, 0);
+    for (const auto& row: rows) {
+        json::to_msgpack(row.at("row"), packed);
+        append_value<uint64_t>(index, packed.size());
+    }
+
+    auto final_path = path_for(key);
+    auto tmp_path = final_path;
+    tmp_path += std::format(".tmp{}", getpid());
+    {
+        BlockFileWriter out(tmp_path.c_str(), std::chrono::milliseconds::zero());
+        out.append(header);
+        out.append(index);
+        out.append(std::string_view(reinterpret_cast<const char*>(packed.data()), packed.size()));
+        out.close();
+    }
+    std::filesystem::rename(tmp_path, final_path);
+}
@@ -0,0 +1,165 @@
+//
+// Created by Sanger Steel on 6/30/25.
+//
+
+#include "dataset_stream.hpp"
+#include <atomic>
+#include <format>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include "logger.hpp"
+
+void DatasetRowQueue::push(DatasetRow row) {
+    ring.push_wait(std::move(row));
+}
+
+std::optional<DatasetRow> DatasetRowQueue::pop() {
+    return ring.fetch_wait();
+}
+
+void DatasetRowQueue::close() {
+    ring.close();
+}
+
+DownloadRateLimiter::DownloadRateLimiter(
+    double pages_per_sec,
+    std::chrono::milliseconds initial_backoff,
+    std::chrono::milliseconds max_backoff
+) : initial_backoff(initial_backoff),
+    max_backoff(max_backoff),
+    next_slot(monotonic_clock::now()) {
+    if (pages_per_sec <= 0) {
+        throw std::runtime_error("Download rate must be positive");
+    }
+    interval = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(1.0 / pages_per_sec));
+}
+
+void DownloadRateLimiter::acquire() {
+    time_point slot;
+    {
+        std::lock_guard lock(mutex);
+        slot = std::max(next_slot, monotonic_clock::now());
+        next_slot = slot + interval;
+    }
+    std::this_thread::sleep_until(slot);
+}
+
+void DownloadRateLimiter::back_off() {
+    std::lock_guard lock(mutex);
+    backoff = backoff == std::chrono::milliseconds::zero() ? initial_backoff : std::min(backoff * 2, max_backoff);
+    next_slot = std::max(next_slot, monotonic_clock::now() + backoff);
+    Logger.info(std::format("Hit rate limit. Slowing down for {}ms...", backoff.count()));
+}
+
+void DownloadRateLimiter::succeeded() {
+    std::lock_guard lock(mutex);
+    backoff = std::chrono::milliseconds::zero();
+}
+
+bool fetch_pages_in_order(
+    const PageFetchOptions& options,
+    DownloadRateLimiter& limiter,
+    const std::function<FetchedPage(size_t page)>& fetch,
+    const std::function<bool(size_t page, std::vector<json>&& rows)>& deliver
+) {
+    std::mutex mutex;
+    // Pages that arrived before one ahead of them
+    std::map<size_t, std::vector<json>> arrived;
+    size_t next_to_deliver = 0;
+    size_t end_page = std::numeric_limits<size_t>::max();
+    bool stop = false;
+    int failed_requests = 0;
+    std::exception_ptr error;
+    std::atomic<size_t> next_page{0};
+
+    auto fetch_with_retries = [&](size_t page) -> std::optional<FetchedPage> {
+        while (true) {
+            limiter.acquire();
+            {
+                std::lock_guard lock(mutex);
+                if (stop) {
+                    return std::nullopt;
+                }
+            }
+            auto fetched = fetch(page);
+            if (fetched.status == PageStatus::RATE_LIMITED) {
+                limiter.back_off();
+                continue;
+            }
+            if (fetched.status == PageStatus::BAD_RESPONSE) {
+                {
+                    std::lock_guard lock(mutex);
+                    if (++failed_requests >= options.max_failed_requests) {
+                        throw std::runtime_error("Failed parsing dataset");
+                    }
+                }
+                Logger.info("Got bad response when downloading dataset. Will try again in a few moments..");
+                std::this_thread::sleep_for(options.retry_delay);
+                continue;
+            }
+            limiter.succeeded();
+            return fetched;
+        }
+    };
+
+    auto worker = [&] {
+        try {
+            while (true) {
+                auto page = next_page.fetch_add(1, std::memory_order_relaxed);
+                {
+                    std::lock_guard lock(mutex);
+                    if (stop || page >= end_page) {
+                        return;
+                    }
+                }
+                auto fetched = fetch_with_retries(page);
+                if (!fetched.has_value()) {
+                    return;
+                }
+
+                // Whoever completes the run of pages next in line delivers it. Holding the
+                // lock meanwhile keeps deliveries in order, and a deliver blocked on a full
+                // queue holds the other fetchers back too.
+                std::lock_guard lock(mutex);
+                if (fetched->status == PageStatus::END) {
+                    end_page = std::min(end_page, page);
+                } else {
+                    arrived.emplace(page, std::move(fetched->rows));
+                }
+                while (!stop && next_to_deliver < end_page) {
+                    auto next = arrived.find(next_to_deliver);
+                    if (next == arrived.end()) {
+                        break;
+                    }
+                    auto rows = std::move(next->second);
+                    arrived.erase(next);
+                    stop = !deliver(next_to_deliver, std::move(rows));
+                    ++next_to_deliver;
+                }
+                if (next_to_deliver >= end_page) {
+                    stop = true;
+                }
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            stop = true;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::max<size_t>(options.parallelism, 1); ++i) {
+        workers.emplace_back(worker);
+    }
+    for (auto& t: workers) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return next_to_deliver == end_page;
+}
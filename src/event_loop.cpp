@@ -0,0 +1,221 @@
+//
+// Created by Sanger Steel on 6/14/25.
+//
+
+#include "event_loop.hpp"
+#include <stdexcept>
+#include "logger.hpp"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+constexpr int MaxEventsPerWait = 256;
+
+CURLEventLoop::CURLEventLoop(const EventLoopOptions& options) {
+    multi = curl_multi_init();
+    if (!multi) {
+        throw std::runtime_error("curl_multi_init failed");
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, options.multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    if (options.max_connections > 0) {
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, options.max_connections);
+    }
+    if (options.multiplex) {
+        curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, options.max_concurrent_streams);
+    }
+#ifdef __linux__
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || timer_fd == -1 || wake_fd == -1) {
+        throw std::runtime_error("Failed to create event loop file descriptors");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+#endif
+    loop = std::thread(&CURLEventLoop::run, this);
+}
+
+CURLEventLoop::~CURLEventLoop() {
+    stop();
+    // Nothing will finish these now. Their callbacks still run, with an error, so whoever
+    // waits on a transfer isn't left waiting forever, and they own the handles as usual.
+    auto unfinished = std::move(transfers);
+    for (auto& [easy, on_done]: unfinished) {
+        curl_multi_remove_handle(multi, easy);
+        num_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+        on_done(easy, CURLE_ABORTED_BY_CALLBACK);
+    }
+    abort_pending_transfers();
+    curl_multi_cleanup(multi);
+#ifdef __linux__
+    close(epoll_fd);
+    close(timer_fd);
+    close(wake_fd);
+#endif
+}
+
+void CURLEventLoop::stop() {
+    if (stopping.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+    wake();
+    if (loop.joinable()) {
+        loop.join();
+    }
+}
+
+void CURLEventLoop::submit(CURL* easy, TransferDoneCallback on_done) {
+    {
+        std::lock_guard<std::mutex> lock(pending_mu);
+        if (!aborting) {
+            pending.emplace_back(PendingTransfer{easy, std::move(on_done)});
+            num_in_flight.fetch_add(1, std::memory_order_acq_rel);
+            on_done = nullptr;
+        }
+    }
+    if (on_done) {
+        // The loop is being destroyed and would never pick this up
+        on_done(easy, CURLE_ABORTED_BY_CALLBACK);
+        return;
+    }
+    wake();
+}
+
+void CURLEventLoop::abort_pending_transfers() {
+    std::vector<PendingTransfer> to_abort;
+    {
+        std::lock_guard<std::mutex> lock(pending_mu);
+        aborting = true;
+        to_abort.swap(pending);
+    }
+    for (auto& transfer: to_abort) {
+        num_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+        transfer.on_done(transfer.easy, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+void CURLEventLoop::wake() {
+#ifdef __linux__
+    uint64_t one = 1;
+    ::write(wake_fd, &one, sizeof(one));
+#else
+    curl_multi_wakeup(multi);
+#endif
+}
+
+void CURLEventLoop::add_pending_transfers() {
+    std::vector<PendingTransfer> to_add;
+    {
+        std::lock_guard<std::mutex> lock(pending_mu);
+        to_add.swap(pending);
+    }
+    for (auto& transfer: to_add) {
+        transfers.emplace(transfer.easy, std::move(transfer.on_done));
+        curl_multi_add_handle(multi, transfer.easy);
+    }
+}
+
+void CURLEventLoop::check_finished_transfers() {
+    int msgs_left = 0;
+    while (CURLMsg* msg = curl_multi_info_read(multi, &msgs_left)) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        CURL* easy = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        curl_multi_remove_handle(multi, easy);
+        auto it = transfers.find(easy);
+        if (it == transfers.end()) {
+            Logger.debug("Event loop finished a transfer it does not own");
+            continue;
+        }
+        auto on_done = std::move(it->second);
+        transfers.erase(it);
+        num_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+        on_done(easy, res);
+    }
+}
+
+int CURLEventLoop::socket_cb(CURL*, curl_socket_t s, int what, void* userp, void*) {
+#ifdef __linux__
+    auto loop = static_cast<CURLEventLoop *>(userp);
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+        return 0;
+    }
+    epoll_event ev{};
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN) { ev.events |= EPOLLIN; }
+    if (what & CURL_POLL_OUT) { ev.events |= EPOLLOUT; }
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s, &ev) != 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, s, &ev);
+    }
+#endif
+    return 0;
+}
+
+int CURLEventLoop::timer_cb(CURLM*, long timeout_ms, void* userp) {
+#ifdef __linux__
+    auto loop = static_cast<CURLEventLoop *>(userp);
+    itimerspec spec{};
+    if (timeout_ms == 0) {
+        // A zero itimerspec disarms the timer, so fire as soon as possible instead
+        spec.it_value.tv_nsec = 1;
+    } else if (timeout_ms > 0) {
+        spec.it_value.tv_sec = timeout_ms / 1000;
+        spec.it_value.tv_nsec = (timeout_ms % 1000) * 1'000'000;
+    }
+    timerfd_settime(loop->timer_fd, 0, &spec, nullptr);
+#endif
+    return 0;
+}
+
+void CURLEventLoop::run() {
+    int running = 0;
+#ifdef __linux__
+    epoll_event events[MaxEventsPerWait];
+    while (!stopping.load(std::memory_order_acquire)) {
+        int n = epoll_wait(epoll_fd, events, MaxEventsPerWait, -1);
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                uint64_t drained;
+                ::read(wake_fd, &drained, sizeof(drained));
+                add_pending_transfers();
+            } else if (fd == timer_fd) {
+                uint64_t expirations;
+                ::read(timer_fd, &expirations, sizeof(expirations));
+                curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+            } else {
+                int flags = 0;
+                if (events[i].events & EPOLLIN) { flags |= CURL_CSELECT_IN; }
+                if (events[i].events & EPOLLOUT) { flags |= CURL_CSELECT_OUT; }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) { flags |= CURL_CSELECT_ERR; }
+                curl_multi_socket_action(multi, fd, flags, &running);
+            }
+        }
+        check_finished_transfers();
+    }
+#else
+    while (!stopping.load(std::memory_order_acquire)) {
+        add_pending_transfers();
+        curl_multi_perform(multi, &running);
+        check_finished_transfers();
+        curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+#endif
+}
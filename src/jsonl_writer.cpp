@@ -0,0 +1,275 @@
+//
+// Created by Sanger Steel on 6/27/25.
+//
+
+#include "jsonl_writer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <stdexcept>
+#include <unistd.h>
+
+JsonObjectWriter::JsonObjectWriter(std::string& out) : out(out) {
+    out += '{';
+}
+
+void JsonObjectWriter::key(std::string_view name) {
+    if (!first) {
+        out += ',';
+    }
+    first = false;
+    append_json_string(out, name);
+    out += ':';
+}
+
+void JsonObjectWriter::field(std::string_view key, std::string_view value) {
+    this->key(key);
+    append_json_string(out, value);
+}
+
+void JsonObjectWriter::field(std::string_view key, double value) {
+    this->key(key);
+    append_json_number(out, value);
+}
+
+void JsonObjectWriter::field(std::string_view key, int value) {
+    this->key(key);
+    char digits[16];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, end);
+}
+
+void JsonObjectWriter::field(std::string_view key, bool value) {
+    this->key(key);
+    out += value ? "true" : "false";
+}
+
+void JsonObjectWriter::field(std::string_view key, std::optional<float> value) {
+    if (value.has_value()) {
+        // nlohmann stores every float as a double
+        field(key, static_cast<double>(value.value()));
+    } else {
+        this->key(key);
+        out += "null";
+    }
+}
+
+void JsonObjectWriter::end_line() {
+    out += "}\n";
+}
+
+void append_json_string(std::string& out, std::string_view value) {
+    static constexpr char hex[] = "0123456789abcdef";
+    out += '"';
+    size_t run_start = 0;
+    for (size_t i = 0; i < value.size(); ++i) {
+        auto c = static_cast<unsigned char>(value[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(value.data() + run_start, i - run_start);
+        run_start = i + 1;
+        switch (c) {
+            case '"': out += "\\\"";
+                break;
+            case '\\': out += "\\\\";
+                break;
+            case '\b': out += "\\b";
+                break;
+            case '\f': out += "\\f";
+                break;
+            case '\n': out += "\\n";
+                break;
+            case '\r': out += "\\r";
+                break;
+            case '\t': out += "\\t";
+                break;
+            default: {
+                char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                out.append(escaped, sizeof(escaped));
+            }
+        }
+    }
+    out.append(value.data() + run_start, value.size() - run_start);
+    out += '"';
+}
+
+void append_json_number(std::string& out, double value) {
+    if (!std::isfinite(value)) {
+        out += "null";
+        return;
+    }
+    if (std::signbit(value)) {
+        out += '-';
+        value = -value;
+    }
+    if (value == 0) {
+        out += "0.0";
+        return;
+    }
+    // Shortest round-trip digits as d.ddde[+-]x, split into digits and exponent
+    char scientific[32];
+    auto [end, ec] = std::to_chars(scientific, scientific + sizeof(scientific), value, std::chars_format::scientific);
+    auto exponent_at = std::find(scientific, end, 'e');
+    char digits[20];
+    int len = 0;
+    for (auto* c = scientific; c != exponent_at; ++c) {
+        if (*c != '.') {
+            digits[len++] = *c;
+        }
+    }
+    int exponent = 0;
+    auto* exponent_digits = exponent_at + 1;
+    if (*exponent_digits == '+') {
+        ++exponent_digits;
+    }
+    std::from_chars(exponent_digits, end, exponent);
+
+    // The value is 0.digits * 10^point
+    constexpr int MinPoint = -4;
+    constexpr int MaxPoint = 15;
+    int point = exponent + 1;
+    std::string_view all(digits, len);
+    if (len <= point && point <= MaxPoint) {
+        out += all;
+        out.append(point - len, '0');
+        out += ".0";
+    } else if (0 < point && point <= MaxPoint) {
+        out += all.substr(0, point);
+        out += '.';
+        out += all.substr(point);
+    } else if (MinPoint < point && point <= 0) {
+        out += "0.";
+        out.append(-point, '0');
+        out += all;
+    } else {
+        out += all.substr(0, 1);
+        if (len > 1) {
+            out += '.';
+            out += all.substr(1);
+        }
+        int shown = point - 1;
+        out += shown < 0 ? "e-" : "e+";
+        shown = std::abs(shown);
+        if (shown < 10) {
+            out += '0';
+        }
+        out += std::to_string(shown);
+    }
+}
+
+void append_output_line(std::string& out, const OutputRow& row, const std::vector<std::string>& label_names) {
+    std::vector<std::pair<std::string, std::optional<float>>> label_fields;
+    for (size_t i = 0; i < label_names.size() && i < row.label_logprobs.size(); ++i) {
+        if (row.label_logprobs[i].has_value()) {
+            label_fields.emplace_back(label_names[i] + "_logprob", row.label_logprobs[i]);
+        }
+    }
+    std::stable_sort(label_fields.begin(), label_fields.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    label_fields.erase(std::unique(label_fields.begin(), label_fields.end(), [](const auto& a, const auto& b) {
+        return a.first == b.first;
+    }), label_fields.end());
+
+    JsonObjectWriter line(out);
+    size_t next_label = 0;
+    auto labels_before = [&](std::string_view key) {
+        for (; next_label < label_fields.size() && label_fields[next_label].first < key; ++next_label) {
+            line.field(label_fields[next_label].first, label_fields[next_label].second);
+        }
+    };
+    visit_output_fields(row, [&](std::string_view key, const auto& value) {
+        labels_before(key);
+        line.field(key, value);
+    });
+    for (; next_label < label_fields.size(); ++next_label) {
+        line.field(label_fields[next_label].first, label_fields[next_label].second);
+    }
+    line.end_line();
+}
+
+BlockFileWriter::BlockFileWriter(const char* filename, std::chrono::milliseconds flush_interval)
+    : flush_interval(flush_interval), last_flush(monotonic_clock::now()) {
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("failed to open output file");
+    }
+    block.reset(static_cast<char*>(std::aligned_alloc(PageSize, BlockSize)));
+    if (!block) {
+        throw std::runtime_error("failed to allocate the output buffer");
+    }
+}
+
+BlockFileWriter::~BlockFileWriter() {
+    try {
+        close();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Failed to finish writing the output file: %s\n", e.what());
+    }
+}
+
+void BlockFileWriter::append(std::string_view bytes) {
+    while (!bytes.empty()) {
+        auto n = std::min(bytes.size(), BlockSize - used);
+        std::memcpy(block.get() + used, bytes.data(), n);
+        used += n;
+        bytes.remove_prefix(n);
+        if (used == BlockSize) {
+            auto from = flushed / PageSize * PageSize;
+            write_at(block.get() + from, BlockSize - from, block_offset + from);
+            block_offset += BlockSize;
+            used = 0;
+            flushed = 0;
+        }
+    }
+}
+
+void BlockFileWriter::flush() {
+    if (pending() > 0) {
+        auto from = flushed / PageSize * PageSize;
+        write_at(block.get() + from, used - from, block_offset + from);
+        flushed = used;
+    }
+    last_flush = monotonic_clock::now();
+}
+
+void BlockFileWriter::flush_if_due() {
+    if (pending() > 0 && until_flush_due() == std::chrono::nanoseconds::zero()) {
+        flush();
+    }
+}
+
+std::chrono::nanoseconds BlockFileWriter::until_flush_due() const {
+    auto due = last_flush + flush_interval;
+    auto now = monotonic_clock::now();
+    return due > now ? std::chrono::duration_cast<std::chrono::nanoseconds>(due - now) : std::chrono::nanoseconds::zero();
+}
+
+void BlockFileWriter::close() {
+    if (fd == -1) {
+        return;
+    }
+    flush();
+    ::close(fd);
+    fd = -1;
+}
+
+void BlockFileWriter::write_at(const char* data, size_t len, size_t offset) {
+    while (len > 0) {
+        auto written = pwrite(fd, data, len, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::format("failed to write output file: {}", std::strerror(errno)));
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+}
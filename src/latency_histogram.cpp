@@ -0,0 +1,203 @@
+//
+// Created by Sanger Steel on 6/18/25.
+//
+
+#include "latency_histogram.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <format>
+
+constexpr double MicrosPerSecond = 1'000'000.0;
+
+size_t LatencyHistogram::bucket_index(uint64_t micros) {
+    if (micros < SubBucketCount) {
+        return micros;
+    }
+    micros = std::min(micros, (uint64_t{1} << MaxMagnitudeBits) - 1);
+    // Values in [2^(SubBucketBits + m - 1), 2^(SubBucketBits + m)) share magnitude m and
+    // are bucketed by their top SubBucketBits bits
+    int magnitude = std::bit_width(micros) - SubBucketBits;
+    auto sub_bucket = micros >> magnitude;
+    return SubBucketCount + (magnitude - 1) * SubBucketHalfCount + (sub_bucket - SubBucketHalfCount);
+}
+
+uint64_t LatencyHistogram::bucket_midpoint(size_t idx) {
+    if (idx < SubBucketCount) {
+        return idx;
+    }
+    auto magnitude = (idx - SubBucketCount) / SubBucketHalfCount + 1;
+    auto sub_bucket = (idx - SubBucketCount) % SubBucketHalfCount + SubBucketHalfCount;
+    auto lowest = sub_bucket << magnitude;
+    return lowest + ((uint64_t{1} << magnitude) >> 1);
+}
+
+void LatencyHistogram::record(double seconds) {
+    auto micros = static_cast<uint64_t>(std::llround(std::max(seconds, 0.0) * MicrosPerSecond));
+    counts[bucket_index(micros)].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    sum_micros.fetch_add(micros, std::memory_order_relaxed);
+
+    auto seen_min = min_micros.load(std::memory_order_relaxed);
+    while (micros < seen_min && !min_micros.compare_exchange_weak(seen_min, micros, std::memory_order_relaxed)) {
+    }
+    auto seen_max = max_micros.load(std::memory_order_relaxed);
+    while (micros > seen_max && !max_micros.compare_exchange_weak(seen_max, micros, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < NumBuckets; ++i) {
+        auto other_count = other.counts[i].load(std::memory_order_relaxed);
+        if (other_count) {
+            counts[i].fetch_add(other_count, std::memory_order_relaxed);
+        }
+    }
+    total_count.fetch_add(other.total_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum_micros.fetch_add(other.sum_micros.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    min_micros.store(std::min(min_micros.load(), other.min_micros.load()), std::memory_order_relaxed);
+    max_micros.store(std::max(max_micros.load(), other.max_micros.load()), std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+    return total_count.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::value_at_percentile(double percentile) const {
+    auto total = count();
+    if (total == 0) {
+        return 0;
+    }
+    auto rank = static_cast<uint64_t>(std::ceil(std::clamp(percentile, 0.0, 100.0) / 100.0 * total));
+    rank = std::max<uint64_t>(rank, 1);
+    if (rank >= total) {
+        return max();
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NumBuckets; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            // Never report past the extremes that were actually recorded
+            auto value = std::clamp(bucket_midpoint(i), min_micros.load(), max_micros.load());
+            return value / MicrosPerSecond;
+        }
+    }
+    return max();
+}
+
+double LatencyHistogram::mean() const {
+    auto total = count();
+    return total ? sum_micros.load(std::memory_order_relaxed) / MicrosPerSecond / total : 0;
+}
+
+double LatencyHistogram::min() const {
+    return count() ? min_micros.load(std::memory_order_relaxed) / MicrosPerSecond : 0;
+}
+
+double LatencyHistogram::max() const {
+    return max_micros.load(std::memory_order_relaxed) / MicrosPerSecond;
+}
+
+void LatencyHistograms::record(const LatencyMetrics& latencies) {
+    ttft.record(latencies.ttft);
+    end_to_end_latency.record(latencies.end_to_end_latency);
+    corrected_ttft.record(latencies.corrected_ttft());
+    corrected_end_to_end_latency.record(latencies.corrected_end_to_end_latency());
+    queue_delay.record(latencies.queue_delay);
+    for (auto itl: latencies.inter_token_latencies) {
+        inter_token_latency.record(itl);
+    }
+    if (latencies.output_tokens > 1) {
+        time_per_output_token.record(latencies.time_per_output_token);
+    }
+}
+
+void LatencyHistograms::merge(const LatencyHistograms& other) {
+    ttft.merge(other.ttft);
+    end_to_end_latency.merge(other.end_to_end_latency);
+    corrected_ttft.merge(other.corrected_ttft);
+    corrected_end_to_end_latency.merge(other.corrected_end_to_end_latency);
+    inter_token_latency.merge(other.inter_token_latency);
+    time_per_output_token.merge(other.time_per_output_token);
+    queue_delay.merge(other.queue_delay);
+}
+
+LatencyPercentiles summarize_histogram(const std::string& name, const LatencyHistogram& histogram) {
+    return LatencyPercentiles{
+        name,
+        histogram.count(),
+        histogram.min(),
+        histogram.mean(),
+        histogram.value_at_percentile(50),
+        histogram.value_at_percentile(90),
+        histogram.value_at_percentile(95),
+        histogram.value_at_percentile(99),
+        histogram.value_at_percentile(99.9),
+        histogram.max(),
+    };
+}
+
+std::vector<LatencyPercentiles> summarize_histograms(const LatencyHistograms& histograms) {
+    std::vector<LatencyPercentiles> rows;
+    rows.emplace_back(summarize_histogram("TTFT", histograms.ttft));
+    rows.emplace_back(summarize_histogram("TTFT (corrected)", histograms.corrected_ttft));
+    rows.emplace_back(summarize_histogram("E2E", histograms.end_to_end_latency));
+    rows.emplace_back(summarize_histogram("E2E (corrected)", histograms.corrected_end_to_end_latency));
+    rows.emplace_back(summarize_histogram("ITL", histograms.inter_token_latency));
+    rows.emplace_back(summarize_histogram("TPOT", histograms.time_per_output_token));
+    rows.emplace_back(summarize_histogram("Queue delay", histograms.queue_delay));
+    return rows;
+}
+
+std::string format_percentile_table(const std::vector<LatencyPercentiles>& rows) {
+    std::string table = std::format(
+        "{:<18}{:>10}{:>10}{:>10}{:>10}{:>10}{:>10}{:>10}{:>10}{:>10}\n",
+        "Latency (s)", "count", "min", "mean", "p50", "p90", "p95", "p99", "p99.9", "max"
+    );
+    for (const auto& row: rows) {
+        // Metrics with nothing recorded (e.g. ITL for single token outputs) are left out
+        if (row.count == 0) {
+            continue;
+        }
+        table += std::format(
+            "{:<18}{:>10}{:>10.4f}{:>10.4f}{:>10.4f}{:>10.4f}{:>10.4f}{:>10.4f}{:>10.4f}{:>10.4f}\n",
+            row.name, row.count, row.min, row.mean, row.p50, row.p90, row.p95, row.p99, row.p999, row.max
+        );
+    }
+    return table;
+}
+
+size_t histogram_shard() {
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % HistogramShards;
+    return shard;
+}
+
+LatencyHistogramRegistry::~LatencyHistogramRegistry() {
+    for (auto& shard: shards) {
+        delete shard.load(std::memory_order_acquire);
+    }
+}
+
+LatencyHistograms& LatencyHistogramRegistry::local() {
+    auto& shard = shards[histogram_shard()];
+    auto* histograms = shard.load(std::memory_order_acquire);
+    if (histograms) {
+        return *histograms;
+    }
+    auto* created = new LatencyHistograms();
+    if (shard.compare_exchange_strong(histograms, created, std::memory_order_acq_rel)) {
+        return *created;
+    }
+    // Another thread pinned to this shard won the race
+    delete created;
+    return *histograms;
+}
+
+void LatencyHistogramRegistry::merge_into(LatencyHistograms& merged) const {
+    for (const auto& shard: shards) {
+        if (auto* histograms = shard.load(std::memory_order_acquire)) {
+            merged.merge(*histograms);
+        }
+    }
+}
@@ -0,0 +1,358 @@
+//
+// Created by Sanger Steel on 7/1/25.
+//
+
+#include "local_dataset.hpp"
+#include <algorithm>
+#include <charconv>
+#include <format>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include "mapped_file.hpp"
+
+#ifdef SCALE_WITH_ARROW
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/arrow/schema.h>
+#include <parquet/exception.h>
+#endif
+
+namespace {
+bool is_blank(std::string_view line) {
+    return line.find_first_not_of(" \t\r") == std::string_view::npos;
+}
+
+// Parses the record at the front of in into fields and drops it from in. Returns false
+// once in is empty. A quoted field may hold commas, newlines and "" for a quote.
+bool next_csv_record(std::string_view& in, std::vector<std::string>& fields, std::string_view path) {
+    if (in.empty()) {
+        return false;
+    }
+    fields.clear();
+    std::string field;
+    bool quoted = false;
+    bool field_start = true;
+    size_t i = 0;
+    while (i < in.size()) {
+        char c = in[i++];
+        if (quoted) {
+            if (c != '"') {
+                field.push_back(c);
+            } else if (i < in.size() && in[i] == '"') {
+                field.push_back('"');
+                ++i;
+            } else {
+                quoted = false;
+            }
+            continue;
+        }
+        if (c == '"' && field_start) {
+            quoted = true;
+            field_start = false;
+        } else if (c == ',') {
+            fields.emplace_back(std::move(field));
+            field.clear();
+            field_start = true;
+        } else if (c == '\n') {
+            break;
+        } else if (c == '\r' && i < in.size() && in[i] == '\n') {
+            ++i;
+            break;
+        } else {
+            field.push_back(c);
+            field_start = false;
+        }
+    }
+    if (quoted) {
+        throw std::runtime_error(std::format("{} ends inside a quoted field", path));
+    }
+    fields.emplace_back(std::move(field));
+    in.remove_prefix(i);
+    return true;
+}
+
+size_t csv_column(const std::vector<std::string>& header, const std::string& name, std::string_view path) {
+    for (size_t i = 0; i < header.size(); ++i) {
+        if (header[i] == name) {
+            return i;
+        }
+    }
+    throw std::runtime_error(std::format("{} has no column \"{}\"", path, name));
+}
+
+#ifdef SCALE_WITH_ARROW
+std::string_view string_value(const arrow::Array& array, int64_t i) {
+    switch (array.type_id()) {
+        case arrow::Type::STRING:
+            return static_cast<const arrow::StringArray&>(array).GetView(i);
+        case arrow::Type::LARGE_STRING:
+            return static_cast<const arrow::LargeStringArray&>(array).GetView(i);
+        default:
+            throw std::runtime_error(std::format("Expected a string column, got {}", array.type()->ToString()));
+    }
+}
+
+int64_t integer_value(const arrow::Array& array, int64_t i) {
+    switch (array.type_id()) {
+        case arrow::Type::INT8:
+            return static_cast<const arrow::Int8Array&>(array).Value(i);
+        case arrow::Type::INT16:
+            return static_cast<const arrow::Int16Array&>(array).Value(i);
+        case arrow::Type::INT32:
+            return static_cast<const arrow::Int32Array&>(array).Value(i);
+        case arrow::Type::INT64:
+            return static_cast<const arrow::Int64Array&>(array).Value(i);
+        case arrow::Type::UINT8:
+            return static_cast<const arrow::UInt8Array&>(array).Value(i);
+        case arrow::Type::UINT16:
+            return static_cast<const arrow::UInt16Array&>(array).Value(i);
+        case arrow::Type::UINT32:
+            return static_cast<const arrow::UInt32Array&>(array).Value(i);
+        default:
+            throw std::runtime_error(std::format("Expected an integer label column, got {}", array.type()->ToString()));
+    }
+}
+#endif
+}
+
+std::optional<LocalDatasetFormat> local_dataset_format_from_str(const std::string& str) {
+    if (str == "jsonl") {
+        return LocalDatasetFormat::JSONL;
+    }
+    if (str == "csv") {
+        return LocalDatasetFormat::CSV;
+    }
+    if (str == "parquet") {
+        return LocalDatasetFormat::PARQUET;
+    }
+    return std::nullopt;
+}
+
+LocalDatasetFormat local_dataset_format(const Config::Dataset& dataset) {
+    if (!dataset.format.empty()) {
+        auto format = local_dataset_format_from_str(dataset.format);
+        if (!format.has_value()) {
+            throw std::runtime_error(std::format("Unrecognized dataset format: {}", dataset.format));
+        }
+        return format.value();
+    }
+    auto extension = std::filesystem::path(dataset.path).extension().string();
+    if (extension == ".jsonl" || extension == ".ndjson") {
+        return LocalDatasetFormat::JSONL;
+    }
+    if (extension == ".csv") {
+        return LocalDatasetFormat::CSV;
+    }
+    if (extension == ".parquet") {
+        return LocalDatasetFormat::PARQUET;
+    }
+    throw std::runtime_error(std::format("Can't tell the format of {}, set dataset.format", dataset.path));
+}
+
+LocalDatasetParser::LocalDatasetParser(const YAML::Node& config_yaml) {
+    initialize_config(config_yaml);
+    if (cfg.dataset.path.empty()) {
+        throw std::runtime_error("Local datasets need dataset.path in the config");
+    }
+}
+
+void JsonlDatasetParser::download() {
+    const auto& path = cfg.dataset.path;
+    MappedFile file(path, "dataset file");
+    file.advise_sequential();
+    auto bytes = file.bytes();
+    size_t line_number = 0;
+    size_t rows = 0;
+    auto store = std::make_shared<RowStore>(make_row_store());
+    while (!bytes.empty()) {
+        auto end = bytes.find('\n');
+        auto line = bytes.substr(0, end);
+        bytes.remove_prefix(end == std::string_view::npos ? bytes.size() : end + 1);
+        ++line_number;
+        if (is_blank(line)) {
+            continue;
+        }
+        json row;
+        try {
+            row = json::parse(line);
+        } catch (const json::parse_error& e) {
+            throw std::runtime_error(std::format("{}:{}: {}", path, line_number, e.what()));
+        }
+        try {
+            add_row(*store, row);
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error(std::format("{}:{}: {}", path, line_number, e.what()));
+        }
+        ++rows;
+        if (store->size() == RowStoreBatchRows) {
+            if (!publish_rows(std::move(store))) {
+                break;
+            }
+            store = std::make_shared<RowStore>(make_row_store());
+        }
+    }
+    if (store && store->size() > 0) {
+        publish_rows(std::move(store));
+    }
+    Logger.info(std::format("Read {} rows from {}.", rows, path));
+}
+
+void CsvDatasetParser::download() {
+    const auto& path = cfg.dataset.path;
+    MappedFile file(path, "dataset file");
+    file.advise_sequential();
+    auto bytes = file.bytes();
+
+    std::vector<std::string> header;
+    if (!next_csv_record(bytes, header, path)) {
+        throw std::runtime_error(std::format("{} has no header", path));
+    }
+    std::vector<size_t> sentence_columns;
+    for (const auto& tag: cfg.sentence_tags) {
+        sentence_columns.emplace_back(csv_column(header, tag, path));
+    }
+    auto label_column = csv_column(header, cfg.label.tag, path);
+
+    std::vector<std::string> fields;
+    std::vector<std::string_view> sentences(sentence_columns.size());
+    size_t record = 0;
+    size_t rows = 0;
+    auto store = std::make_shared<RowStore>(make_row_store());
+    while (next_csv_record(bytes, fields, path)) {
+        ++record;
+        if (fields.size() == 1 && is_blank(fields[0])) {
+            continue;
+        }
+        if (fields.size() != header.size()) {
+            throw std::runtime_error(std::format("{} record {}: expected {} fields, got {}",
+                                                 path, record, header.size(), fields.size()));
+        }
+        for (size_t i = 0; i < sentence_columns.size(); ++i) {
+            sentences[i] = fields[sentence_columns[i]];
+        }
+        const auto& label = fields[label_column];
+        int value = 0;
+        auto [end, ec] = std::from_chars(label.data(), label.data() + label.size(), value);
+        if (ec != std::errc() || end != label.data() + label.size()) {
+            throw std::runtime_error(std::format("{} record {}: expected an integer \"{}\", got \"{}\"",
+                                                 path, record, cfg.label.tag, label));
+        }
+        store->add(sentences, value);
+        ++rows;
+        if (store->size() == RowStoreBatchRows) {
+            if (!publish_rows(std::move(store))) {
+                break;
+            }
+            store = std::make_shared<RowStore>(make_row_store());
+        }
+    }
+    if (store && store->size() > 0) {
+        publish_rows(std::move(store));
+    }
+    Logger.info(std::format("Read {} rows from {}.", rows, path));
+}
+
+void ParquetDatasetParser::download() {
+#ifdef SCALE_WITH_ARROW
+    const auto& path = cfg.dataset.path;
+    PARQUET_ASSIGN_OR_THROW(auto input, arrow::io::MemoryMappedFile::Open(path, arrow::io::FileMode::READ));
+    PARQUET_ASSIGN_OR_THROW(auto reader, parquet::arrow::OpenFile(input, arrow::default_memory_pool()));
+    std::shared_ptr<arrow::Schema> schema;
+    PARQUET_THROW_NOT_OK(reader->GetSchema(&schema));
+
+    // The leaf columns to decode, which the record batch reader wants by their index among
+    // the file's leaves rather than among its fields
+    std::vector<int> columns;
+    auto add_column = [&](const std::string& name) {
+        auto idx = schema->GetFieldIndex(name);
+        if (idx < 0) {
+            throw std::runtime_error(std::format("{} has no column \"{}\"", path, name));
+        }
+        const auto& field = reader->manifest().schema_fields[idx];
+        if (!field.is_leaf()) {
+            throw std::runtime_error(std::format("{} column \"{}\" is nested", path, name));
+        }
+        if (std::find(columns.begin(), columns.end(), field.column_index) == columns.end()) {
+            columns.emplace_back(field.column_index);
+        }
+    };
+    for (const auto& tag: cfg.sentence_tags) {
+        add_column(tag);
+    }
+    add_column(cfg.label.tag);
+
+    // Decodes a record batch of the selected columns at a time instead of whole row groups
+    std::vector<int> row_groups(reader->num_row_groups());
+    std::iota(row_groups.begin(), row_groups.end(), 0);
+    PARQUET_ASSIGN_OR_THROW(auto batches, reader->GetRecordBatchReader(row_groups, columns));
+
+    // The batches' columns are looked up by name since the reader picks their order
+    auto batch_schema = batches->schema();
+    std::vector<int> sentence_columns;
+    for (const auto& tag: cfg.sentence_tags) {
+        sentence_columns.emplace_back(batch_schema->GetFieldIndex(tag));
+    }
+    auto label_column = batch_schema->GetFieldIndex(cfg.label.tag);
+
+    size_t rows = 0;
+    std::vector<std::string_view> sentences(cfg.sentence_tags.size());
+    while (true) {
+        PARQUET_ASSIGN_OR_THROW(auto batch, batches->Next());
+        if (!batch) {
+            break;
+        }
+        auto check_not_null = [&](int c, int64_t i) {
+            if (batch->column(c)->IsNull(i)) {
+                throw std::runtime_error(std::format("{} row {}: \"{}\" is null",
+                                                     path, rows + i, batch->column_name(c)));
+            }
+        };
+        // The strings are only viewed until they're copied into the store, and a store
+        // per record batch needs no more than one pass over its columns
+        auto store = std::make_shared<RowStore>(cfg.sentence_tags.size(), batch->num_rows());
+        for (int64_t i = 0; i < batch->num_rows(); ++i) {
+            for (size_t s = 0; s < sentence_columns.size(); ++s) {
+                check_not_null(sentence_columns[s], i);
+                sentences[s] = string_value(*batch->column(sentence_columns[s]), i);
+            }
+            check_not_null(label_column, i);
+            auto label = integer_value(*batch->column(label_column), i);
+            if (!std::in_range<int>(label)) {
+                throw std::runtime_error(std::format("{} row {}: \"{}\" is out of range: {}",
+                                                     path, rows + i, cfg.label.tag, label));
+            }
+            store->add(sentences, static_cast<int>(label));
+        }
+        rows += store->size();
+        if (!publish_rows(std::move(store))) {
+            break;
+        }
+    }
+    Logger.info(std::format("Read {} rows from {}.", rows, path));
+#else
+    throw std::runtime_error("Reading Parquet datasets needs a build configured with -DSCALE_WITH_ARROW=ON");
+#endif
+}
+
+Dataset make_dataset_parser(const char* yaml_filename) {
+    auto config_yaml = YAML::LoadFile(yaml_filename);
+    if (!config_yaml["dataset"]["path"]) {
+        return std::make_unique<HFDatasetParser>(config_yaml);
+    }
+    Config::Dataset dataset;
+    dataset.path = config_yaml["dataset"]["path"].as<std::string>();
+    if (config_yaml["dataset"]["format"]) {
+        dataset.format = config_yaml["dataset"]["format"].as<std::string>();
+    }
+    switch (local_dataset_format(dataset)) {
+        case LocalDatasetFormat::JSONL:
+            return std::make_unique<JsonlDatasetParser>(config_yaml);
+        case LocalDatasetFormat::CSV:
+            return std::make_unique<CsvDatasetParser>(config_yaml);
+        case LocalDatasetFormat::PARQUET:
+            return std::make_unique<ParquetDatasetParser>(config_yaml);
+    }
+    throw std::runtime_error("Unhandled dataset format");
+}
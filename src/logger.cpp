@@ -10,7 +10,7 @@
 
 thread_local std::vector<time_point> AsyncLogger::time_starts;
 
-AsyncLogger::AsyncLogger(const std::string& filename) : done(false) {
+AsyncLogger::AsyncLogger(const std::string& filename) {
     if (filename == "stdout") {
         fd = STDOUT_FILENO;
     } else {
@@ -24,12 +24,9 @@ AsyncLogger::AsyncLogger(const std::string& filename) : done(false) {
     logger = std::thread(&AsyncLogger::display_loop, this);
 }
 
-AsyncLogger::~AsyncLogger() { {
-        std::lock_guard<std::mutex> lock(mu);
-        done = true;
-        ready_to_read = true;
-    }
-    cv.notify_one(); // Make sure the display loop isn't stuck waiting to be able to query `done`
+AsyncLogger::~AsyncLogger() {
+    // The display loop writes out whatever is still queued, then returns
+    messages.close();
     logger.join();
     if (fd != STDOUT_FILENO) {
         close(fd);
@@ -37,12 +34,7 @@ AsyncLogger::~AsyncLogger() { {
 }
 
 void AsyncLogger::write(std::string message) {
-    messages.push(std::move(message));
-
-    // Multiple producers (possible log writers), so ready_to_read can risk data races,
-    // which is why it's atomic here
-    ready_to_read.store(true, std::memory_order_release);
-    cv.notify_one();
+    messages.push_wait(std::move(message));
 }
 
 size_t LoggingContext::set_start() {
@@ -51,7 +43,7 @@ size_t LoggingContext::set_start() {
             logger.time_starts.clear();
             logger.time_starts.shrink_to_fit();
         }
-        auto time_start = std::chrono::high_resolution_clock::now();
+        auto time_start = monotonic_clock::now();
         logger.time_starts.emplace_back(time_start);
         return logger.time_starts.size() - 1;
     }
@@ -60,7 +52,7 @@ size_t LoggingContext::set_start() {
 
 void LoggingContext::set_stop_and_display_time(size_t idx, const char* name) {
     if (this->level == DEBUG) {
-        auto end_minus_start = std::chrono::high_resolution_clock::now() - logger.time_starts[idx];
+        auto end_minus_start = monotonic_clock::now() - logger.time_starts[idx];
         auto duration = std::chrono::duration_cast<std::chrono::duration<double>>(end_minus_start).count();
         auto msg = std::format("DEBUG: {} took {} s", name, duration);
         logger.write(msg);
@@ -106,18 +98,9 @@ void LoggingContext::error(std::string message) const {
 };
 
 void AsyncLogger::display_loop() {
-    while (!done) {
-        {
-            std::unique_lock<std::mutex> wait_response_lock(mu);
-            cv.wait(wait_response_lock, [this] { return ready_to_read.load(std::memory_order_acquire) || done; });
-        }
-        std::string msg;
-        auto to_display = messages.fetch();
-        if (to_display.state == RingState::SUCCESS) {
-            msg = to_display.content.value();
-            auto to_write = std::format("{}\n", msg);
-            ::write(fd, to_write.c_str(), to_write.size());
-        }
+    while (auto msg = messages.fetch_wait()) {
+        auto to_write = std::format("{}\n", msg.value());
+        ::write(fd, to_write.c_str(), to_write.size());
     }
 }
 
@@ -5,6 +5,7 @@
 #include "benchmark_types.hpp"
 #include "curl.hpp"
 #include "logger.hpp"
+#include "local_dataset.hpp"
 
 const std::string filename = "stdout";
 
@@ -23,9 +24,47 @@ Options:
 
   --base-url <url>       Base URL to fetch from (e.g. https://api.openai.com/v1/completions)
   --outfile <path>       Output jsonl file path (e.g. output.jsonl)
+  --output-format <name> Format of --outfile: jsonl or columnar (row groups of binary columns that can be
+                         mmapped, layout in include/columnar_writer.hpp) (default jsonl)
   --concurrency <int>    Number of concurrent requests to send to the server (default 100)
   --n-samples <int>      Maximum number of samples (default 10000)
+  --dataset-cache-dir <path>
+                         Save downloaded HF dataset rows here and reuse them on later runs, which then
+                         start without touching the network (default no cache)
+  --download-parallelism <int>
+                         Dataset pages downloaded at once. The benchmark starts on the first page
+                         while the rest download (default 4)
+  --download-rate <float>
+                         Most dataset page requests per second, backing off together when the
+                         server rate limits (default 2)
   --timeout <int>        Maximum seconds to wait before retrying a request (default no timeout)
+  --transport <mode>     How requests are sent: threaded (a thread per request) or event-loop
+                         (curl multi event loops, sockets instead of threads) (default threaded)
+  --event-loops <int>    Number of event loops for --transport event-loop, e.g. one per core (default 1)
+  --connection-reuse <warm|cold>
+                         warm reuses pooled connections, DNS and TLS sessions across requests,
+                         cold opens a fresh connection per request (default warm)
+  --http2                Multiplex streaming requests over HTTP/2 connections (needs --transport event-loop)
+  --max-connections <int>
+                         Maximum connections to the server, independent of --concurrency, split
+                         between event loops so at least --event-loops
+                         (needs --transport event-loop, default no limit)
+  --request-rate <float> Send requests open-loop at this many requests/sec on a precomputed schedule
+                         instead of closed-loop. --concurrency then only caps in-flight requests
+  --arrival <dist>       Arrival distribution for --request-rate: poisson, constant or gamma (default poisson)
+  --burstiness <float>   Gamma shape for --arrival gamma, below 1 is burstier than poisson (default 1)
+  --seed <int>           Seed for the arrival schedule (default 0)
+  --expected-interval-ms <float>
+                         How often each closed-loop worker means to send a request, used to correct
+                         latencies for coordinated omission (default none, corrected equals raw)
+  --parser <name>        How streamed chunks are parsed: ondemand (reads only the fields used) or
+                         nlohmann (full JSON DOM, for validating ondemand) (default ondemand)
+  --pipeline <name>      How in-flight requests wait on their streams: threads (one blocked thread each)
+                         or coroutines (suspended until events arrive, cheap at high concurrency)
+                         (default threads)
+  --flush-interval-ms <int>
+                         Longest output lines wait in the write buffer before reaching --outfile (default 1000)
+  --echo-results         Also log every output line at INFO (needs --output-format jsonl)
   --help                 Show this help message
 )";
 
@@ -53,6 +92,24 @@ int main(int argc, char* argv[]) {
     std::optional<std::string> concurrency = std::nullopt;
     std::optional<std::string> n_samples = std::nullopt;
     std::optional<std::string> timeout_sec = std::nullopt;
+    std::optional<std::string> transport_mode = std::nullopt;
+    std::optional<std::string> event_loops = std::nullopt;
+    std::optional<std::string> connection_reuse = std::nullopt;
+    std::optional<std::string> max_connections = std::nullopt;
+    bool http2 = false;
+    std::optional<std::string> request_rate = std::nullopt;
+    std::optional<std::string> arrival_distribution = std::nullopt;
+    std::optional<std::string> burstiness = std::nullopt;
+    std::optional<std::string> seed = std::nullopt;
+    std::optional<std::string> expected_interval_ms = std::nullopt;
+    std::optional<std::string> parser = std::nullopt;
+    std::optional<std::string> pipeline_name = std::nullopt;
+    std::optional<std::string> flush_interval_ms = std::nullopt;
+    bool echo_results = false;
+    std::optional<std::string> output_format_name = std::nullopt;
+    std::optional<std::string> dataset_cache_dir = std::nullopt;
+    std::optional<std::string> download_parallelism = std::nullopt;
+    std::optional<std::string> download_rate = std::nullopt;
 
     config_path_or_help = argv[1];
 
@@ -74,6 +131,42 @@ int main(int argc, char* argv[]) {
             n_samples = argv[++i];
         } else if (arg == "--concurrency" && i + 1 < argc) {
             concurrency = argv[++i];
+        } else if (arg == "--transport" && i + 1 < argc) {
+            transport_mode = argv[++i];
+        } else if (arg == "--event-loops" && i + 1 < argc) {
+            event_loops = argv[++i];
+        } else if (arg == "--connection-reuse" && i + 1 < argc) {
+            connection_reuse = argv[++i];
+        } else if (arg == "--http2") {
+            http2 = true;
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            max_connections = argv[++i];
+        } else if (arg == "--request-rate" && i + 1 < argc) {
+            request_rate = argv[++i];
+        } else if (arg == "--arrival" && i + 1 < argc) {
+            arrival_distribution = argv[++i];
+        } else if (arg == "--burstiness" && i + 1 < argc) {
+            burstiness = argv[++i];
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = argv[++i];
+        } else if (arg == "--expected-interval-ms" && i + 1 < argc) {
+            expected_interval_ms = argv[++i];
+        } else if (arg == "--parser" && i + 1 < argc) {
+            parser = argv[++i];
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            pipeline_name = argv[++i];
+        } else if (arg == "--flush-interval-ms" && i + 1 < argc) {
+            flush_interval_ms = argv[++i];
+        } else if (arg == "--echo-results") {
+            echo_results = true;
+        } else if (arg == "--output-format" && i + 1 < argc) {
+            output_format_name = argv[++i];
+        } else if (arg == "--dataset-cache-dir" && i + 1 < argc) {
+            dataset_cache_dir = argv[++i];
+        } else if (arg == "--download-parallelism" && i + 1 < argc) {
+            download_parallelism = argv[++i];
+        } else if (arg == "--download-rate" && i + 1 < argc) {
+            download_rate = argv[++i];
         } else {
             std::cerr << "Unrecognized or incomplete argument: " << arg << "\n";
             return 1;
@@ -96,35 +189,187 @@ int main(int argc, char* argv[]) {
         concurrent_requests = std::stoi(concurrency_as_str);
     }
 
+    TransportOptions transport;
+    if (transport_mode.has_value()) {
+        auto mode = transport_mode_from_str(transport_mode.value());
+        if (!mode.has_value()) {
+            std::cerr << "Unrecognized transport: " << transport_mode.value() << "\n";
+            return 1;
+        }
+        transport.mode = mode.value();
+    }
+    if (event_loops.has_value()) {
+        transport.event_loops = std::stoi(event_loops.value());
+    }
+    if (connection_reuse.has_value()) {
+        if (connection_reuse.value() != "warm" && connection_reuse.value() != "cold") {
+            std::cerr << "Unrecognized connection reuse: " << connection_reuse.value() << "\n";
+            return 1;
+        }
+        transport.reuse_connections = connection_reuse.value() == "warm";
+    }
+    transport.http2 = http2;
+    if (max_connections.has_value()) {
+        transport.max_connections = std::stol(max_connections.value());
+    }
+    if ((transport.http2 || transport.max_connections > 0) && transport.mode != TransportMode::EVENT_LOOP) {
+        std::cerr << "--http2 and --max-connections need --transport event-loop" << "\n";
+        return 1;
+    }
+    if (transport.max_connections > 0 && transport.max_connections < transport.event_loops) {
+        std::cerr << "--max-connections can't be less than --event-loops, each loop needs a connection" << "\n";
+        return 1;
+    }
+    if (transport.http2 && !transport.reuse_connections) {
+        std::cerr << "--http2 can't multiplex with --connection-reuse cold" << "\n";
+        return 1;
+    }
+    if (transport.http2 && transport.max_connections > 0) {
+        // Enough streams per connection that the connection cap, not curl, bounds concurrency
+        transport.max_streams_per_connection = std::max(
+            transport.max_streams_per_connection,
+            (concurrent_requests + transport.max_connections - 1) / transport.max_connections
+        );
+    }
+
+    std::optional<ArrivalOptions> arrival = std::nullopt;
+    if (request_rate.has_value()) {
+        ArrivalOptions options{std::stod(request_rate.value())};
+        if (!(options.request_rate > 0)) {
+            std::cerr << "--request-rate must be positive" << "\n";
+            return 1;
+        }
+        if (arrival_distribution.has_value()) {
+            auto distribution = arrival_distribution_from_str(arrival_distribution.value());
+            if (!distribution.has_value()) {
+                std::cerr << "Unrecognized arrival distribution: " << arrival_distribution.value() << "\n";
+                return 1;
+            }
+            options.distribution = distribution.value();
+        }
+        if (burstiness.has_value()) {
+            options.burstiness = std::stod(burstiness.value());
+            if (!(options.burstiness > 0)) {
+                std::cerr << "--burstiness must be positive" << "\n";
+                return 1;
+            }
+        }
+        if (seed.has_value()) {
+            options.seed = std::stoull(seed.value());
+        }
+        arrival = options;
+    } else if (arrival_distribution.has_value() || burstiness.has_value() || seed.has_value()) {
+        std::cerr << "--arrival, --burstiness and --seed need --request-rate" << "\n";
+        return 1;
+    }
+
+    std::optional<std::chrono::nanoseconds> expected_interval = std::nullopt;
+    if (expected_interval_ms.has_value()) {
+        if (arrival.has_value()) {
+            std::cerr << "--expected-interval-ms is for closed-loop runs, --request-rate already sets the schedule"
+                    << "\n";
+            return 1;
+        }
+        expected_interval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>(std::stod(expected_interval_ms.value())));
+        // A zero interval would pin every intended start to the first request's
+        if (expected_interval->count() <= 0) {
+            std::cerr << "--expected-interval-ms must be positive" << "\n";
+            return 1;
+        }
+    }
+
+    ChunkParser chunk_parser = ChunkParser::ONDEMAND;
+    if (parser.has_value()) {
+        auto maybe_parser = chunk_parser_from_str(parser.value());
+        if (!maybe_parser.has_value()) {
+            std::cerr << "Unrecognized parser: " << parser.value() << "\n";
+            return 1;
+        }
+        chunk_parser = maybe_parser.value();
+    }
+
+    OutputFormat output_format = OutputFormat::JSONL;
+    if (output_format_name.has_value()) {
+        auto maybe_format = output_format_from_str(output_format_name.value());
+        if (!maybe_format.has_value()) {
+            std::cerr << "Unrecognized output format: " << output_format_name.value() << "\n";
+            return 1;
+        }
+        output_format = maybe_format.value();
+    }
+    if (echo_results && output_format != OutputFormat::JSONL) {
+        std::cerr << "--echo-results needs --output-format jsonl" << "\n";
+        return 1;
+    }
+
+    RequestPipeline pipeline = RequestPipeline::THREADS;
+    if (pipeline_name.has_value()) {
+        auto maybe_pipeline = request_pipeline_from_str(pipeline_name.value());
+        if (!maybe_pipeline.has_value()) {
+            std::cerr << "Unrecognized pipeline: " << pipeline_name.value() << "\n";
+            return 1;
+        }
+        pipeline = maybe_pipeline.value();
+    }
 
     Logger.info("Fetching data..");
 
-    Dataset params = std::make_unique<HFDatasetParser>(config_path_or_help.c_str());
+    Dataset params = make_dataset_parser(config_path_or_help.c_str());
     if (n_samples.has_value()) {
         auto samples = n_samples.value();
         Logger.debug("Max samples: {}", samples);
         params->max_rows = std::stoi(samples);
     }
-    params->download();
+    if (dataset_cache_dir.has_value()) {
+        params->cache_dir = dataset_cache_dir.value();
+    }
+    if (download_parallelism.has_value()) {
+        params->download_parallelism = std::stoi(download_parallelism.value());
+        if (params->download_parallelism < 1) {
+            std::cerr << "--download-parallelism must be at least 1" << "\n";
+            return 1;
+        }
+    }
+    if (download_rate.has_value()) {
+        params->download_rate = std::stod(download_rate.value());
+        if (params->download_rate <= 0) {
+            std::cerr << "--download-rate must be positive" << "\n";
+            return 1;
+        }
+    }
+    // Requests start as soon as the first page arrives, the rest download meanwhile
+    params->start_download();
 
 
-    auto shared_client = std::make_shared<CURLHandler>("https://api.openai.com/v1/completions",
+    auto shared_client = std::make_shared<CURLHandler>(base_url.c_str(),
                                                        std::getenv("OPENAI_API_KEY"),
-                                                       timeout_long);
+                                                       timeout_long,
+                                                       transport);
 
     DatasetToRequestStrategy dataset_processor(std::move(params));
 
     FileWritingStrategy writer;
+    if (flush_interval_ms.has_value()) {
+        writer.flush_interval = std::chrono::milliseconds(std::stol(flush_interval_ms.value()));
+    }
+    writer.echo_results = echo_results;
+    writer.output_format = output_format;
     RequestTransportStrategy sender_and_parser;
+    sender_and_parser.chunk_parser = chunk_parser;
+    sender_and_parser.output_format = output_format;
 
     ProcessingStrategy processor{
         dataset_processor,
         sender_and_parser,
         writer,
         shared_client,
-        concurrent_requests
+        concurrent_requests,
+        arrival,
+        expected_interval,
+        pipeline
     };
 
-    auto result = processor.process_benchmark("output_new.jsonl");
+    auto result = processor.process_benchmark(outfile.c_str());
     return 0;
 }
@@ -0,0 +1,39 @@
+//
+// Created by Sanger Steel on 7/1/25.
+//
+
+#include "mapped_file.hpp"
+#include <fcntl.h>
+#include <format>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::filesystem::path& path, std::string_view what) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error(std::format("failed to open {} {}", what, path.string()));
+    }
+    struct stat st{};
+    fstat(fd, &st);
+    size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        throw std::runtime_error(std::format("{} {} is empty", what, path.string()));
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error(std::format("failed to map {} {}", what, path.string()));
+    }
+    data = static_cast<const char*>(mapped);
+}
+
+MappedFile::~MappedFile() {
+    munmap(const_cast<char*>(data), size);
+}
+
+void MappedFile::advise_sequential() const {
+    madvise(const_cast<char*>(data), size, MADV_SEQUENTIAL);
+}
@@ -0,0 +1,104 @@
+//
+// Created by Sanger Steel on 6/26/25.
+//
+
+#include "metrics_aggregator.hpp"
+#include <format>
+#include <set>
+
+void ConfusionMatrix::add(int golden_label, std::optional<int> guessed_label) {
+    counts[{golden_label, guessed_label}]++;
+}
+
+uint64_t ConfusionMatrix::count(int golden_label, std::optional<int> guessed_label) const {
+    auto it = counts.find({golden_label, guessed_label});
+    return it != counts.end() ? it->second : 0;
+}
+
+std::string ConfusionMatrix::format() const {
+    std::set<int> golden_labels;
+    std::set<std::optional<int>> guessed_labels;
+    for (const auto& [labels, count]: counts) {
+        golden_labels.insert(labels.first);
+        guessed_labels.insert(labels.second);
+    }
+    auto column_name = [](std::optional<int> label) {
+        return label.has_value() ? std::format("guess {}", label.value()) : std::string("no match");
+    };
+
+    std::string table = std::format("{:<18}", "Golden \\ guessed");
+    for (const auto& guessed: guessed_labels) {
+        table += std::format("{:>10}", column_name(guessed));
+    }
+    table += '\n';
+    for (auto golden: golden_labels) {
+        table += std::format("{:<18}", std::format("label {}", golden));
+        for (const auto& guessed: guessed_labels) {
+            table += std::format("{:>10}", count(golden, guessed));
+        }
+        table += '\n';
+    }
+    return table;
+}
+
+void MetricsAggregator::add(const LatencyMetrics& latencies, int golden_label, std::optional<int> guessed_label) {
+    requests++;
+    ttft_sum += latencies.ttft;
+    e2e_latency_sum += latencies.end_to_end_latency;
+    corrected_ttft_sum += latencies.corrected_ttft();
+    corrected_e2e_latency_sum += latencies.corrected_end_to_end_latency();
+    queue_delay_sum += latencies.queue_delay;
+    ttfb_sum += latencies.time_to_first_byte;
+    total_output_tokens += latencies.output_tokens;
+    if (latencies.output_tokens > 1) {
+        tpot_sum += latencies.time_per_output_token;
+        decode_tokens_per_sec_sum += latencies.decode_tokens_per_sec;
+        multi_token_requests++;
+    }
+    if (guessed_label == golden_label) {
+        guessed_correct++;
+    }
+    confusion_matrix.add(golden_label, guessed_label);
+}
+
+namespace {
+double average(double sum, uint64_t count) {
+    return count > 0 ? sum / static_cast<double>(count) : 0;
+}
+}
+
+double MetricsAggregator::avg_ttft() const {
+    return average(ttft_sum, requests);
+}
+
+double MetricsAggregator::avg_e2e_latency() const {
+    return average(e2e_latency_sum, requests);
+}
+
+double MetricsAggregator::avg_corrected_ttft() const {
+    return average(corrected_ttft_sum, requests);
+}
+
+double MetricsAggregator::avg_corrected_e2e_latency() const {
+    return average(corrected_e2e_latency_sum, requests);
+}
+
+double MetricsAggregator::avg_queue_delay() const {
+    return average(queue_delay_sum, requests);
+}
+
+double MetricsAggregator::avg_ttfb() const {
+    return average(ttfb_sum, requests);
+}
+
+double MetricsAggregator::avg_tpot() const {
+    return average(tpot_sum, multi_token_requests);
+}
+
+double MetricsAggregator::avg_decode_tokens_per_sec() const {
+    return average(decode_tokens_per_sec_sum, multi_token_requests);
+}
+
+double MetricsAggregator::accuracy() const {
+    return average(static_cast<double>(guessed_correct), requests) * 100;
+}
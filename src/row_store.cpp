@@ -0,0 +1,59 @@
+//
+// Created by Sanger Steel on 7/2/25.
+//
+
+#include "row_store.hpp"
+#include <format>
+#include <stdexcept>
+#include <utility>
+
+RowStore::RowStore(size_t sentences_per_row, size_t expected_rows) : per_row(sentences_per_row) {
+    offsets.reserve(expected_rows * per_row + 1);
+    offsets.emplace_back(0);
+    labels.reserve(expected_rows);
+}
+
+void RowStore::add(const json& row, std::span<const std::string> sentence_tags, const std::string& label_tag) {
+    if (!row.is_object()) {
+        throw std::runtime_error("expected an object");
+    }
+    if (sentence_tags.size() != per_row) {
+        throw std::logic_error(std::format("Row store holds {} sentences per row, got {} tags", per_row, sentence_tags.size()));
+    }
+    // Checked before anything is appended, so a bad row leaves the store as it was
+    auto label = row.find(label_tag);
+    if (label == row.end() || !label->is_number_integer()) {
+        throw std::runtime_error(std::format("expected an integer \"{}\"", label_tag));
+    }
+    auto fits = label->is_number_unsigned() ? std::in_range<int>(label->get<uint64_t>())
+                                            : std::in_range<int>(label->get<int64_t>());
+    if (!fits) {
+        throw std::runtime_error(std::format("\"{}\" is out of range: {}", label_tag, label->dump()));
+    }
+    for (const auto& tag: sentence_tags) {
+        auto field = row.find(tag);
+        if (field == row.end() || !field->is_string()) {
+            throw std::runtime_error(std::format("expected a string \"{}\"", tag));
+        }
+    }
+    for (const auto& tag: sentence_tags) {
+        arena += row.find(tag)->get_ref<const std::string&>();
+        offsets.emplace_back(arena.size());
+    }
+    labels.emplace_back(label->get<int>());
+}
+
+void RowStore::add(std::span<const std::string_view> sentences, int label) {
+    if (sentences.size() != per_row) {
+        throw std::logic_error(std::format("Row store holds {} sentences per row, got {}", per_row, sentences.size()));
+    }
+    for (auto sentence: sentences) {
+        arena += sentence;
+        offsets.emplace_back(arena.size());
+    }
+    labels.emplace_back(label);
+}
+
+size_t RowStore::memory_usage() const {
+    return arena.capacity() + offsets.capacity() * sizeof(uint64_t) + labels.capacity() * sizeof(int);
+}
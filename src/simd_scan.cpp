@@ -0,0 +1,192 @@
+//
+// Created by Sanger Steel on 6/20/25.
+//
+
+#include "simd_scan.hpp"
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SCALE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr size_t npos = std::string::npos;
+
+size_t scalar_find_event_end(const char* data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        auto* newline = static_cast<const char *>(std::memchr(data + pos, '\n', len - pos));
+        if (!newline) {
+            return npos;
+        }
+        size_t idx = newline - data;
+        if (idx + 1 < len && data[idx + 1] == '\n') {
+            return idx + 2;
+        }
+        if (idx + 2 < len && data[idx + 1] == '\r' && data[idx + 2] == '\n') {
+            return idx + 3;
+        }
+        pos = idx + 1;
+    }
+    return npos;
+}
+
+size_t scalar_find_substring(const char* data, size_t len, std::string_view needle) {
+    return std::string_view(data, len).find(needle);
+}
+
+// The vector kernels below check every position they pass with full lookahead, then hand
+// the tail to the scalar kernel, so both always agree on the first match.
+
+#ifdef SCALE_X86_SIMD
+size_t end_of_delimiter_at(const char* data, size_t idx) {
+    return idx + (data[idx + 1] == '\n' ? 2 : 3);
+}
+
+__attribute__((target("avx2")))
+size_t avx2_find_event_end(const char* data, size_t len) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriage_return = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 32 + 2 <= len; i += 32) {
+        // Skip 64 bytes at a time while there's no newline at all, the common case
+        while (i + 64 + 2 <= len) {
+            auto lo = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), newline);
+            auto hi = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32)), newline);
+            auto any = _mm256_or_si256(lo, hi);
+            if (!_mm256_testz_si256(any, any)) {
+                break;
+            }
+            i += 64;
+        }
+        if (i + 32 + 2 > len) {
+            break;
+        }
+        auto b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        auto is_newline = _mm256_cmpeq_epi8(b0, newline);
+        if (_mm256_testz_si256(is_newline, is_newline)) {
+            continue;
+        }
+        auto b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1));
+        auto b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 2));
+        auto lf_lf = _mm256_and_si256(is_newline, _mm256_cmpeq_epi8(b1, newline));
+        auto lf_crlf = _mm256_and_si256(
+            is_newline, _mm256_and_si256(_mm256_cmpeq_epi8(b1, carriage_return), _mm256_cmpeq_epi8(b2, newline)));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(lf_lf, lf_crlf)));
+        if (mask) {
+            return end_of_delimiter_at(data, i + __builtin_ctz(mask));
+        }
+    }
+    auto rest = scalar_find_event_end(data + i, len - i);
+    return rest == npos ? npos : i + rest;
+}
+
+__attribute__((target("avx2")))
+size_t avx2_find_substring(const char* data, size_t len, std::string_view needle) {
+    const size_t k = needle.size();
+    if (k < 2 || k > len) {
+        return scalar_find_substring(data, len, needle);
+    }
+    // Candidates match the needle's first and last bytes, which rules out nearly everything
+    const __m256i first = _mm256_set1_epi8(needle.front());
+    const __m256i last = _mm256_set1_epi8(needle.back());
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= len; i += 32) {
+        auto block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        auto block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + k - 1));
+        auto candidates = _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(candidates));
+        while (mask) {
+            size_t idx = i + __builtin_ctz(mask);
+            if (std::memcmp(data + idx + 1, needle.data() + 1, k - 2) == 0) {
+                return idx;
+            }
+            mask &= mask - 1;
+        }
+    }
+    auto rest = scalar_find_substring(data + i, len - i, needle);
+    return rest == npos ? npos : i + rest;
+}
+
+__attribute__((target("sse4.2")))
+size_t sse_find_event_end(const char* data, size_t len) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 16 + 2 <= len; i += 16) {
+        auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto is_newline = _mm_cmpeq_epi8(b0, newline);
+        if (_mm_movemask_epi8(is_newline) == 0) {
+            continue;
+        }
+        auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+        auto b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 2));
+        auto lf_lf = _mm_and_si128(is_newline, _mm_cmpeq_epi8(b1, newline));
+        auto lf_crlf = _mm_and_si128(
+            is_newline, _mm_and_si128(_mm_cmpeq_epi8(b1, carriage_return), _mm_cmpeq_epi8(b2, newline)));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(lf_lf, lf_crlf)));
+        if (mask) {
+            return end_of_delimiter_at(data, i + __builtin_ctz(mask));
+        }
+    }
+    auto rest = scalar_find_event_end(data + i, len - i);
+    return rest == npos ? npos : i + rest;
+}
+
+__attribute__((target("sse4.2")))
+size_t sse_find_substring(const char* data, size_t len, std::string_view needle) {
+    const size_t k = needle.size();
+    if (k < 2 || k > len) {
+        return scalar_find_substring(data, len, needle);
+    }
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i last = _mm_set1_epi8(needle.back());
+    size_t i = 0;
+    for (; i + k - 1 + 16 <= len; i += 16) {
+        auto block_first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto block_last = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + k - 1));
+        auto candidates = _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(candidates));
+        while (mask) {
+            size_t idx = i + __builtin_ctz(mask);
+            if (std::memcmp(data + idx + 1, needle.data() + 1, k - 2) == 0) {
+                return idx;
+            }
+            mask &= mask - 1;
+        }
+    }
+    auto rest = scalar_find_substring(data + i, len - i, needle);
+    return rest == npos ? npos : i + rest;
+}
+
+constexpr ScanKernel sse_kernel{"sse4.2", sse_find_event_end, sse_find_substring};
+constexpr ScanKernel avx2_kernel{"avx2", avx2_find_event_end, avx2_find_substring};
+#endif
+
+constexpr ScanKernel scalar_kernel{"scalar", scalar_find_event_end, scalar_find_substring};
+}
+
+const ScanKernel& scalar_scan_kernel() {
+    return scalar_kernel;
+}
+
+std::vector<const ScanKernel *> supported_scan_kernels() {
+    std::vector<const ScanKernel *> kernels{&scalar_kernel};
+#ifdef SCALE_X86_SIMD
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernels.emplace_back(&sse_kernel);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.emplace_back(&avx2_kernel);
+    }
+#endif
+    return kernels;
+}
+
+const ScanKernel& scan_kernel() {
+    static const ScanKernel& kernel = *supported_scan_kernels().back();
+    return kernel;
+}
@@ -0,0 +1,103 @@
+//
+// Created by Sanger Steel on 6/19/25.
+//
+
+#include "sse_parser.hpp"
+#include <algorithm>
+
+namespace {
+constexpr std::string_view data_field = "data:";
+constexpr std::string_view done_payload = "[DONE]";
+
+std::string_view strip_cr(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    return line;
+}
+}
+
+void SSEParser::feed(std::string_view bytes) {
+    // Only the unfinished tail is moved, the buffer's capacity is reused across reads
+    if (consumed > 0) {
+        buffer.erase(0, consumed);
+        scanned -= consumed;
+        consumed = 0;
+    }
+    buffer.append(bytes);
+}
+
+size_t SSEParser::find_event_end() {
+    size_t from = std::max(scanned, consumed);
+    auto end = kernel->find_event_end(buffer.data() + from, buffer.size() - from);
+    if (end != std::string::npos) {
+        return from + end;
+    }
+    // A delimiter can start in the last two bytes and finish in the next read
+    scanned = std::max(consumed, buffer.size() - std::min<size_t>(buffer.size(), 2));
+    return std::string::npos;
+}
+
+std::optional<std::string_view> SSEParser::extract_data(std::string_view event) {
+    std::optional<std::string_view> data;
+    bool is_joined = false;
+    size_t pos = 0;
+    while (pos < event.size()) {
+        auto field = kernel->find_substring(event.data() + pos, event.size() - pos, data_field);
+        if (field == std::string_view::npos) {
+            break;
+        }
+        field += pos;
+        pos = field + data_field.size();
+        // Only a field at the start of a line counts, not "data:" inside some other value
+        if (field != 0 && event[field - 1] != '\n') {
+            continue;
+        }
+        auto line_end = event.find('\n', pos);
+        auto line = strip_cr(event.substr(pos, line_end == std::string_view::npos ? line_end : line_end - pos));
+        pos = line_end == std::string_view::npos ? event.size() : line_end + 1;
+        if (line.starts_with(' ')) {
+            line.remove_prefix(1);
+        }
+        if (!data.has_value()) {
+            data = line;
+            continue;
+        }
+        // Per the SSE spec, data spread over several lines is joined with newlines
+        if (!is_joined) {
+            joined.assign(data.value());
+            is_joined = true;
+        }
+        joined += '\n';
+        joined.append(line);
+        data = joined;
+    }
+    if (data.has_value() && data.value() == done_payload) {
+        saw_done = true;
+        return std::nullopt;
+    }
+    return data;
+}
+
+std::optional<std::string_view> SSEParser::next_event() {
+    while (true) {
+        auto end = find_event_end();
+        if (end == std::string::npos) {
+            return std::nullopt;
+        }
+        auto event = std::string_view(buffer).substr(consumed, end - consumed);
+        consumed = end;
+        scanned = end;
+        if (auto data = extract_data(event)) {
+            return data;
+        }
+    }
+}
+
+void SSEParser::reset() {
+    buffer.clear();
+    joined.clear();
+    consumed = 0;
+    scanned = 0;
+    saw_done = false;
+}
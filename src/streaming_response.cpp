@@ -4,33 +4,180 @@
 
 #include "streaming_response.hpp"
 
+#include <algorithm>
+#include <bit>
 #include <logger.hpp>
 
-bool StreamingResponse::check_producer_finished() {
-    return ring.producer_finished;
+namespace {
+constexpr size_t MinStreamRingCapacity = 8;
+constexpr size_t MaxStreamRingCapacity = 1024;
+}
+
+size_t stream_ring_capacity(int max_tokens) {
+    auto wanted = std::bit_ceil(static_cast<size_t>(std::max(max_tokens, 0)) + 2);
+    return std::clamp(wanted, MinStreamRingCapacity, MaxStreamRingCapacity);
 }
 
-bool StreamingResponse::ready_to_fetch() const {
-    return !this->ring.is_empty() || done; // done used here so threads can stop waiting and end
+StreamingResponse::StreamingResponse(size_t ring_capacity) : ring(ring_capacity) {
+}
+
+bool StreamingResponse::check_producer_finished() {
+    return ring.is_closed();
 }
 
 void StreamingResponse::finalize() {
-    std::lock_guard lock(mu);
-    ring.producer_finished = true;
-    done = true;
-    cv.notify_all();
+    // Whatever is left never got its terminating blank line, e.g. an error body
+    if (!parser.pending().empty() && !parser.done()) {
+        Logger.failed_to_parse_strings.emplace_back(parser.pending());
+    }
+    ring.close();
+    done.store(true, std::memory_order_release);
+    done.notify_all();
+    resume_waiter();
+}
+
+void StreamingResponse::retry() {
+    parser.reset();
+    ++attempt;
+}
+
+void StreamingResponse::push(StreamEvent event) {
+    push_bulk(std::span<StreamEvent>(&event, 1));
 }
 
-void StreamingResponse::push(std::string str) {
-    RingState state = ring.push(std::move(str));
-    if (state == RingState::SUCCESS) {
-        Logger.pushed_chunks.fetch_add(1, std::memory_order_acq_rel);
-        std::lock_guard<std::mutex> lock(mu);
-        cv.notify_all();
+void StreamingResponse::push_bulk(std::span<StreamEvent> events) {
+    // Per-stream rings are small, so a full one means the consumer is behind and the
+    // transfer waits for it rather than dropping events. A parked coroutine consumer is
+    // resumed before any waiting, otherwise nothing would ever drain the ring.
+    size_t pushed = ring.push_bulk(events);
+    resume_waiter();
+    while (pushed < events.size()) {
+        ring.push_wait(std::move(events[pushed++]));
+        pushed += ring.push_bulk(events.subspan(pushed));
+        resume_waiter();
     }
+    Logger.pushed_chunks.fetch_add(static_cast<int>(events.size()), std::memory_order_acq_rel);
 }
 
-RingResult<std::string> StreamingResponse::fetch() {
+bool StreamingResponse::park(std::coroutine_handle<> consumer) {
+    waiter.store(consumer.address(), std::memory_order_seq_cst);
+    // Pairs with the fence in resume_waiter(), so either the producer sees the waiter or
+    // this sees what the producer pushed
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring.is_empty() && !ring.is_closed()) {
+        return true;
+    }
+    // Whoever clears the waiter resumes the coroutine
+    void* expected = consumer.address();
+    return !waiter.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+}
+
+void StreamingResponse::resume_waiter() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiter.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+    if (auto consumer = waiter.exchange(nullptr, std::memory_order_acq_rel)) {
+        std::coroutine_handle<>::from_address(consumer).resume();
+    }
+}
+
+RingResult<StreamEvent> StreamingResponse::fetch() {
     return ring.fetch();
 }
 
+std::optional<StreamEvent> StreamingResponse::fetch_wait() {
+    return ring.fetch_wait();
+}
+
+size_t StreamingResponse::fetch_bulk_wait(std::vector<StreamEvent>& out, size_t max_events) {
+    return ring.fetch_bulk_wait(out, max_events);
+}
+
+void StreamingResponse::reset() {
+    if (t.joinable()) {
+        t.join();
+    }
+    while (ring.fetch().state == RingState::SUCCESS) {
+    }
+    ring.reopen();
+    waiter.store(nullptr, std::memory_order_relaxed);
+    parser.reset();
+    attempt = 0;
+    got_ttft = false;
+    done.store(false, std::memory_order_relaxed);
+    latencies = LatencyMetrics{};
+}
+
+bool StreamEventAwaiter::try_take() {
+    auto result = resp->fetch();
+    if (result.state != RingState::SUCCESS && resp->check_producer_finished()) {
+        // The producer pushes everything before it closes the ring
+        result = resp->fetch();
+    }
+    if (result.state == RingState::SUCCESS) {
+        event = std::move(result.content);
+        return true;
+    }
+    return resp->check_producer_finished();
+}
+
+bool StreamEventAwaiter::await_ready() {
+    taken = try_take();
+    return taken;
+}
+
+bool StreamEventAwaiter::await_suspend(std::coroutine_handle<> consumer) {
+    // Once parked, the producer can resume the coroutine and free this awaiter before
+    // park() returns
+    auto keep_alive = resp;
+    return keep_alive->park(consumer);
+}
+
+std::optional<StreamEvent> StreamEventAwaiter::await_resume() {
+    if (!taken) {
+        try_take();
+    }
+    return std::move(event);
+}
+
+StreamingResponsePool::StreamingResponsePool(size_t max_idle) : state(std::make_shared<State>()) {
+    state->max_idle = max_idle;
+}
+
+std::shared_ptr<StreamingResponse> StreamingResponsePool::acquire(size_t ring_capacity) {
+    std::unique_ptr<StreamingResponse> resp;
+    {
+        std::lock_guard lock(state->mu);
+        auto it = std::find_if(state->free.begin(), state->free.end(), [ring_capacity](const auto& candidate) {
+            return candidate->ring_capacity() >= ring_capacity;
+        });
+        if (it != state->free.end()) {
+            resp = std::move(*it);
+            *it = std::move(state->free.back());
+            state->free.pop_back();
+        }
+    }
+    if (!resp) {
+        resp = std::make_unique<StreamingResponse>(ring_capacity);
+    }
+    return std::shared_ptr<StreamingResponse>(resp.release(), [pool = state](StreamingResponse* released) {
+        std::unique_ptr<StreamingResponse> owned(released);
+        if (owned->t.joinable() && owned->t.get_id() == std::this_thread::get_id()) {
+            // The transfer thread held the last reference. Nothing references the response
+            // once it's gone, but the thread is still running, so it isn't handed out again.
+            owned->t.detach();
+            return;
+        }
+        owned->reset();
+        std::lock_guard lock(pool->mu);
+        if (pool->free.size() < pool->max_idle) {
+            pool->free.emplace_back(std::move(owned));
+        }
+    });
+}
+
+size_t StreamingResponsePool::idle() const {
+    std::lock_guard lock(state->mu);
+    return state->free.size();
+}
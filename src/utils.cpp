@@ -3,7 +3,11 @@
 //
 
 #include "utils.hpp"
+#include <algorithm>
+#include <cctype>
 #include <iostream>
+#include <string_view>
+#include "jsonl_writer.hpp"
 
 
 std::string logprob_entry::dump() {
@@ -44,9 +48,22 @@ inline std::string trim_and_lower(std::string& guess) {
 }
 
 
-inline std::optional<float> get_logprob(std::string& key, float value, std::string& to_compare) {
-    auto parsed_token = trim_and_lower(key);
-    if (key == trim_and_lower(to_compare)) {
+inline std::string_view trim_view(std::string_view s, const char* t = ws) {
+    auto first = s.find_first_not_of(t);
+    if (first == std::string_view::npos) {
+        return {};
+    }
+    return s.substr(first, s.find_last_not_of(t) - first + 1);
+}
+
+// Compares like trim_and_lower on both sides, without copying either
+inline std::optional<float> get_logprob(std::string_view key, float value, std::string_view to_compare) {
+    key = trim_view(key);
+    to_compare = trim_view(to_compare);
+    auto same = std::ranges::equal(key, to_compare, [](unsigned char a, unsigned char b) {
+        return std::tolower(a) == std::tolower(b);
+    });
+    if (same) {
         return value;
     }
     return std::nullopt;
@@ -58,7 +75,7 @@ inline std::optional<float> get_logprob(std::string& key, float value, std::stri
 //       For instance, if answer to a question was given "Yes", but "No"
 //       was in the top logprobs, it would be useful to get the probs
 //       for both down the line
-bool guessed_correctly(const Dataset& dataset, const RequestResult& res) {
+std::optional<int> guess_label(const Dataset& dataset, const RequestResult& res) {
     auto crucial_result = res.completion_results[0];
     // Only allow the first choice
     auto crucial_choice = crucial_result.choices[0];
@@ -72,35 +89,55 @@ bool guessed_correctly(const Dataset& dataset, const RequestResult& res) {
             guessed_label = value.id;
         }
     }
+    return guessed_label;
+}
+
+bool guessed_correctly(const Dataset& dataset, const RequestResult& res) {
+    auto guessed_label = guess_label(dataset, res);
     return guessed_label.has_value() && guessed_label == res.params.golden_label;
 }
 
 FinalMetrics get_results(Metrics& metrics) {
     auto benchmark_duration = metrics.benchmark_end - metrics.benchmark_start;
     auto seconds = duration_cast<std::chrono::duration<double>>(benchmark_duration).count();
-    double ttft_sum = 0;
-    double e2e_latency_sum = 0;
-    double guessed_correct = 0;
-    for (const auto& result: metrics.req_results) {
-        ttft_sum += result.latencies.ttft;
-        e2e_latency_sum += result.latencies.end_to_end_latency;
-        if (result.guessed_correctly == true) {
-            guessed_correct++;
-        }
-    }
+    const auto& aggregate = metrics.aggregate;
     FinalMetrics fm{};
-    auto avg_ttft = ttft_sum / metrics.requests_processed;
-    auto avg_e2e_latency = e2e_latency_sum / metrics.requests_processed;
-    auto accuracy = guessed_correct / metrics.requests_processed * 100;
-    fm.avg_ttft = avg_ttft;
-    fm.avg_e2e_latency = avg_e2e_latency;
+    fm.avg_ttft = aggregate.avg_ttft();
+    fm.avg_e2e_latency = aggregate.avg_e2e_latency();
+    fm.avg_corrected_ttft = aggregate.avg_corrected_ttft();
+    fm.avg_corrected_e2e_latency = aggregate.avg_corrected_e2e_latency();
+    fm.avg_queue_delay = aggregate.avg_queue_delay();
+    fm.avg_ttfb = aggregate.avg_ttfb();
+    fm.avg_tpot = aggregate.avg_tpot();
+    fm.avg_decode_tokens_per_sec = aggregate.avg_decode_tokens_per_sec();
     fm.duration = seconds;
-    fm.requests_processed = metrics.requests_processed;
-    fm.req_rate = metrics.requests_processed / seconds;
-    fm.accuracy = accuracy;
+    fm.requests_processed = static_cast<double>(aggregate.count());
+    fm.req_rate = fm.requests_processed / seconds;
+    fm.accuracy = aggregate.accuracy();
+
+    if (metrics.latency_histograms) {
+        LatencyHistograms merged;
+        metrics.latency_histograms->merge_into(merged);
+        fm.latency_percentiles = summarize_histograms(merged);
+    }
 
 
     Logger.info(fm.display());
+    Logger.info(std::format(
+        "Corrected for coordinated omission | Average TTFT: {:.3f}s | Average End-to-End Latency: {:.3f}s | "
+        "Average Queue Delay: {:.3f}s",
+        fm.avg_corrected_ttft, fm.avg_corrected_e2e_latency, fm.avg_queue_delay
+    ));
+    Logger.info(std::format(
+        "Average Time to First Byte: {:.3f}s | Average TPOT: {:.4f}s | Average Decode Throughput: {:.1f} tokens/s",
+        fm.avg_ttfb, fm.avg_tpot, fm.avg_decode_tokens_per_sec
+    ));
+    if (!fm.latency_percentiles.empty()) {
+        Logger.info(std::format("Latency percentiles:\n{}", format_percentile_table(fm.latency_percentiles)));
+    }
+    if (!aggregate.confusion().empty()) {
+        Logger.info(std::format("Confusion matrix:\n{}", aggregate.confusion().format()));
+    }
     Logger.dump_debugging_state();
     return fm;
 }
@@ -127,23 +164,21 @@ std::optional<std::vector<logprob_entry>> get_label_logprobs(
     const Dataset& dataset, bool correct, const RequestResult& res
 ) {
     std::vector<logprob_entry> label_logprobs;
-    auto logprobs = res.completion_results[0].choices[0].logprobs;
+    const auto& logprobs = res.completion_results[0].choices[0].logprobs;
     if (correct) {
         auto correct_guess_logprob = res.completion_results[0].choices[0].logprobs.token_logprobs[0];
         auto correct_guess_logprob_text = res.completion_results[0].choices[0].logprobs.tokens[0];
         label_logprobs.emplace_back(logprob_entry{correct_guess_logprob_text, correct_guess_logprob});
     }
-    // TODO: Need to order the TopLogprobs in descending order, otherwise I risk saying the logprob for
-    //       "No" is based off a TopLogprob " NO" with logprob -15.242 when there was a "no" logprob with -2,
-    //       which would deflate the performance eval here.
+    // Positions are sorted by descending logprob, so the first match for a label is its best one
     auto& cfg = dataset->get_config();
-    for (auto& top_logprob: logprobs.top_logprobs) {
-        for (auto& [k,v]: top_logprob) {
-            std::string key = k;
-            for (auto& response_label: cfg.label.values) {
-                auto maybe_got_logprob = get_logprob(key, v, response_label.response);
+    for (size_t position = 0; position < logprobs.top_logprobs.size(); ++position) {
+        for (const auto& response_label: cfg.label.values) {
+            for (auto [token, logprob]: logprobs.top_logprobs[position]) {
+                auto maybe_got_logprob = get_logprob(token, logprob, response_label.response);
                 if (maybe_got_logprob.has_value()) {
                     label_logprobs.emplace_back(logprob_entry{response_label.response, maybe_got_logprob.value()});
+                    break;
                 }
             }
         }
@@ -154,41 +189,74 @@ std::optional<std::vector<logprob_entry>> get_label_logprobs(
     return std::nullopt;
 }
 
-std::vector<json> get_output_json(RequestResult& res, const Dataset& dataset) {
-    std::vector<json> json_vec;
-    auto logprobs_for_labels = get_label_logprobs(dataset, res.guessed_correctly, res);
-    for (const auto& compl_result: res.completion_results) {
-        json j = json::object();
-        j["e2e_latency"] = res.latencies.end_to_end_latency;
-        j["ttft"] = res.latencies.ttft;
-        j["id"] = compl_result.id;
-        j["model"] = compl_result.model;
-        j["object"] = compl_result.object;
-        j["prompt"] = res.params.prompt;
-        j["guessed_correctly"] = res.guessed_correctly;
-        if (logprobs_for_labels.has_value()) {
-            auto logprob_labels = logprobs_for_labels.value();
-            for (const auto& label_logprobs: logprob_labels) {
-                j[label_logprobs.text + "_logprob"] = label_logprobs.logprob;
+// The output lines of a result, one per completion chunk, whatever the output format
+std::vector<OutputRow> get_output_rows(RequestResult& res, const Dataset& dataset) {
+    const auto& labels = dataset->get_config().label.values;
+    std::vector<std::optional<float>> label_logprobs(labels.size());
+    if (auto logprobs_for_labels = get_label_logprobs(dataset, res.guessed_correctly, res)) {
+        for (auto label_logprob: logprobs_for_labels.value()) {
+            // The guessed token is taken as it was sampled, e.g. " Yes" for "yes"
+            auto text = trim_and_lower(label_logprob.text);
+            for (size_t i = 0; i < labels.size(); ++i) {
+                auto response = labels[i].response;
+                if (trim_and_lower(response) == text) {
+                    label_logprobs[i] = label_logprob.logprob;
+                }
             }
         }
+    }
+
+    const auto& latencies = res.latencies;
+    std::vector<OutputRow> rows;
+    rows.reserve(res.completion_results.size());
+    for (const auto& compl_result: res.completion_results) {
+        const auto& choice = compl_result.choices[0];
+        rows.emplace_back(OutputRow{
+            .corrected_e2e_latency = latencies.corrected_end_to_end_latency(),
+            .corrected_ttft = latencies.corrected_ttft(),
+            .decode_tokens_per_sec = latencies.decode_tokens_per_sec,
+            .e2e_latency = latencies.end_to_end_latency,
+            .finish_reason = choice.finish_reason,
+            .guessed_correctly = res.guessed_correctly,
+            .id = compl_result.id,
+            .model = compl_result.model,
+            .object = compl_result.object,
+            .output_tokens = latencies.output_tokens,
+            .prompt = res.params.prompt,
+            .queue_delay = latencies.queue_delay,
+            .text = choice.text,
+            .tpot = latencies.time_per_output_token,
+            .ttfb = latencies.time_to_first_byte,
+            .ttft = latencies.ttft,
+            .label_logprobs = label_logprobs,
+        });
+    }
+    return rows;
+}
 
-        auto choice = compl_result.choices[0];
-        j["finish_reason"] = choice.finish_reason;
-        j["text"] = choice.text;
-        json_vec.emplace_back(j);
+// The lines of get_output_rows, as JSONL
+void append_output_jsonl(std::string& out, RequestResult& res, const Dataset& dataset) {
+    std::vector<std::string> label_names;
+    for (const auto& value: dataset->get_config().label.values) {
+        label_names.emplace_back(value.response);
+    }
+    for (const auto& row: get_output_rows(res, dataset)) {
+        append_output_line(out, row, label_names);
     }
-    return std::move(json_vec);
 }
 
-std::string join(std::vector<const std::string>& strings, const std::string& sep) {
+std::string join(const std::vector<std::string_view>& strings, std::string_view sep) {
     std::string output;
-    size_t num_strings = strings.size();
-    for (size_t i = 0; i < num_strings; ++i) {
-        output += strings[i];
-        if (i != num_strings - 1) {
+    size_t size = strings.empty() ? 0 : sep.size() * (strings.size() - 1);
+    for (auto string: strings) {
+        size += string.size();
+    }
+    output.reserve(size);
+    for (size_t i = 0; i < strings.size(); ++i) {
+        if (i != 0) {
             output += sep;
         }
+        output += strings[i];
     }
-    return std::move(output);
+    return output;
 }
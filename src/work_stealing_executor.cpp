@@ -0,0 +1,123 @@
+//
+// Created by Sanger Steel on 6/24/25.
+//
+
+#include "work_stealing_executor.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace {
+// Lets submit() tell whether it's running on one of this executor's workers
+thread_local const WorkStealingExecutor* current_executor = nullptr;
+thread_local size_t current_worker = 0;
+
+void run_task_guarded(const WorkStealingExecutor::Task& task) {
+    try {
+        task();
+    } catch (const std::exception& e) {
+        std::cerr << "Executor task crashed: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Executor task crashed with unknown exception" << std::endl;
+    }
+}
+}
+
+WorkStealingExecutor::WorkStealingExecutor(size_t num_workers) {
+    if (num_workers == 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers.reserve(num_workers);
+    for (size_t i = 0; i < num_workers; ++i) {
+        workers.emplace_back(std::make_unique<Worker>());
+    }
+    // Every deque exists before any worker can try to steal from it
+    for (size_t i = 0; i < num_workers; ++i) {
+        workers[i]->thread = std::thread(&WorkStealingExecutor::run, this, i);
+    }
+}
+
+WorkStealingExecutor::~WorkStealingExecutor() {
+    stopping.store(true, std::memory_order_release);
+    work_available.notify_all();
+    for (auto& worker: workers) {
+        worker->thread.join();
+    }
+}
+
+void WorkStealingExecutor::submit(Task task) {
+    unfinished.fetch_add(1, std::memory_order_relaxed);
+    queued.fetch_add(1, std::memory_order_release);
+    size_t idx = current_executor == this
+                     ? current_worker
+                     : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+        std::lock_guard lock(workers[idx]->mu);
+        workers[idx]->tasks.emplace_back(std::move(task));
+    }
+    work_available.notify_one();
+}
+
+void WorkStealingExecutor::wait_idle() {
+    while (true) {
+        auto remaining = unfinished.load(std::memory_order_acquire);
+        if (remaining == 0) {
+            return;
+        }
+        unfinished.wait(remaining, std::memory_order_acquire);
+    }
+}
+
+std::optional<WorkStealingExecutor::Task> WorkStealingExecutor::pop_local(size_t idx) {
+    auto& worker = *workers[idx];
+    std::lock_guard lock(worker.mu);
+    if (worker.tasks.empty()) {
+        return std::nullopt;
+    }
+    auto task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return task;
+}
+
+std::optional<WorkStealingExecutor::Task> WorkStealingExecutor::steal(size_t thief) {
+    for (size_t i = 1; i < workers.size(); ++i) {
+        auto& victim = *workers[(thief + i) % workers.size()];
+        std::lock_guard lock(victim.mu);
+        if (!victim.tasks.empty()) {
+            auto task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            stolen.fetch_add(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return std::nullopt;
+}
+
+void WorkStealingExecutor::run(size_t idx) {
+    current_executor = this;
+    current_worker = idx;
+    while (true) {
+        auto task = pop_local(idx);
+        if (!task.has_value()) {
+            task = steal(idx);
+        }
+        if (task.has_value()) {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            run_task_guarded(task.value());
+            if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                unfinished.notify_all();
+            }
+            continue;
+        }
+        auto epoch = work_available.prepare_wait();
+        if (queued.load(std::memory_order_acquire) > 0) {
+            // A submit landed after this worker looked, or is still pushing its task
+            work_available.cancel_wait();
+            continue;
+        }
+        if (stopping.load(std::memory_order_acquire)) {
+            work_available.cancel_wait();
+            return;
+        }
+        work_available.wait(epoch);
+    }
+}
@@ -3,11 +3,38 @@
 //
 
 #include <catch2/catch_test_macros.hpp>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "benchmark_types.hpp"
+#include "completion_parser.hpp"
+#include "connection_pool.hpp"
+#include "columnar_writer.hpp"
 #include "curl.hpp"
+#include "dataset_cache.hpp"
+#include "dataset_stream.hpp"
+#include "jsonl_writer.hpp"
 #include "logger.hpp"
 #include "constants.hpp"
+#include "latency_histogram.hpp"
+#include "local_dataset.hpp"
+#include "row_store.hpp"
+#include "simd_scan.hpp"
+#include "sse_parser.hpp"
+#include "work_stealing_executor.hpp"
+
+#ifdef SCALE_WITH_ARROW
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/exception.h>
+#endif
 
 const std::string filename = "stdout";
 LoggingContext Logger(filename, DEBUG);
@@ -129,3 +156,1873 @@ LoggingContext Logger(filename, DEBUG);
 TEST_CASE("Test parse JSON") {
     //std::string test_str = "data: {\"id":\"cmpl-BhTOHw4rgxTfgXoZn4NFNgyZGfUPr\",\"object\":\"text_completion\",\"created\":1749700781,"choices":[{\"text\":\"no\",\"index\":0,\"logprobs\":{\"tokens\":[\"no\"],\"token_logprobs\":[-0.67217714],\"top_logprobs\":[{\"no\":-0.67217714,\"No\":-1.3748653,"\n":-1.828057," no":-3.2456062," No":-3.6321113,"\n\n":-4.7127924," \n":-7.6328516,"Yes":-8.465514,"yes":-8.813094," \n\n":-9.108312,"NO":-9.468816," ":-9.611159,"<|endoftext|>":-10.157262,"\tno":-10.272944," yes":-10.533286," Yes":-10.560655,"N":-11.056375,"n":-11.181727,"\n \n":-11.410088,"Not":-11.467097}],"text_offset":[215]},"finish_reason":"length"}],"model":"gpt-3.5-turbo-instruct:20230824-v2"}
 }
+
+CompletionResults chunk_received_at(time_point received, std::string text, std::vector<std::string> tokens = {}) {
+    CompletionResults results;
+    Choice choice;
+    choice.text = std::move(text);
+    choice.logprobs.tokens = std::move(tokens);
+    results.choices.emplace_back(std::move(choice));
+    results.received = received;
+    return results;
+}
+
+TEST_CASE("Token timings come from when the reads carrying tokens arrived") {
+    using std::chrono::milliseconds;
+    auto start = monotonic_clock::now();
+    std::vector<CompletionResults> chunks;
+    // Handed over out of order
+    chunks.emplace_back(chunk_received_at(start + milliseconds(300), "d"));
+    chunks.emplace_back(chunk_received_at(start + milliseconds(100), "a"));
+    // Parsed out of the same read as "a"
+    chunks.emplace_back(chunk_received_at(start + milliseconds(100), "bc", {"b", "c"}));
+    // The final chunk, no token
+    chunks.emplace_back(chunk_received_at(start + milliseconds(350), ""));
+
+    REQUIRE(count_tokens(chunks[0]) == 1);
+    REQUIRE(count_tokens(chunks[2]) == 2);
+    REQUIRE(count_tokens(chunks[3]) == 0);
+
+    LatencyMetrics latencies{};
+    latencies.actual_start = start;
+    record_token_timings(chunks, latencies);
+    auto near = [](double value, double expected) {
+        return std::abs(value - expected) < 1e-9;
+    };
+    REQUIRE(latencies.output_tokens == 4);
+    REQUIRE(near(latencies.ttft, 0.1));
+    // One gap between the two reads, none inside the first one
+    REQUIRE(latencies.inter_token_latencies.size() == 1);
+    REQUIRE(near(latencies.inter_token_latencies[0], 0.2));
+    REQUIRE(near(latencies.time_per_output_token, 0.2 / 3));
+    REQUIRE(near(latencies.decode_tokens_per_sec, 15));
+    // The chunks keep the order they were handed over in
+    REQUIRE(chunks[0].choices[0].text == "d");
+    REQUIRE(chunks[3].choices[0].text.empty());
+
+    SECTION("a single token leaves TPOT and ITL empty") {
+        std::vector<CompletionResults> one{chunk_received_at(start + milliseconds(50), "x")};
+        LatencyMetrics single{};
+        single.actual_start = start;
+        record_token_timings(one, single);
+        REQUIRE(single.output_tokens == 1);
+        REQUIRE(near(single.ttft, 0.05));
+        REQUIRE(single.inter_token_latencies.empty());
+        REQUIRE(single.time_per_output_token == 0);
+    }
+}
+
+TEST_CASE("Latency histogram percentiles stay within bucket precision") {
+    LatencyHistogram histogram;
+    for (int ms = 1; ms <= 10'000; ++ms) {
+        histogram.record(ms / 1000.0);
+    }
+    REQUIRE(histogram.count() == 10'000);
+    auto within_precision = [](double value, double expected) {
+        return std::abs(value - expected) <= expected / LatencyHistogram::SubBucketCount;
+    };
+    REQUIRE(within_precision(histogram.value_at_percentile(50), 5.0));
+    REQUIRE(within_precision(histogram.value_at_percentile(99), 9.9));
+    REQUIRE(within_precision(histogram.value_at_percentile(99.9), 9.99));
+    REQUIRE(histogram.max() == 10.0);
+    REQUIRE(histogram.min() == 0.001);
+
+    LatencyHistogram other;
+    other.record(20.0);
+    histogram.merge(other);
+    REQUIRE(histogram.count() == 10'001);
+    REQUIRE(histogram.value_at_percentile(100) == 20.0);
+}
+
+std::vector<std::string> parse_all_events(SSEParser& parser, const std::string& stream, size_t read_size) {
+    std::vector<std::string> events;
+    for (size_t offset = 0; offset < stream.size(); offset += read_size) {
+        parser.feed(std::string_view(stream).substr(offset, read_size));
+        while (auto event = parser.next_event()) {
+            events.emplace_back(event.value());
+        }
+    }
+    return events;
+}
+
+TEST_CASE("SSE parser keeps events split across reads") {
+    const std::string stream =
+        ": keep-alive\n\n"
+        "data: {\"text\":\"a\\n\\n\"}\n\n"
+        "event: completion\r\ndata: {\"text\":\"b\"}\r\n\r\n"
+        "data: first\ndata: second\n\n"
+        "data: [DONE]\n\n";
+    const std::vector<std::string> expected = {
+        "{\"text\":\"a\\n\\n\"}",
+        "{\"text\":\"b\"}",
+        "first\nsecond",
+    };
+    for (size_t read_size = 1; read_size <= stream.size(); ++read_size) {
+        SSEParser parser;
+        REQUIRE(parse_all_events(parser, stream, read_size) == expected);
+        REQUIRE(parser.done());
+        REQUIRE(parser.pending().empty());
+    }
+
+    SSEParser parser;
+    parser.feed("data: {\"partial\":");
+    REQUIRE_FALSE(parser.next_event().has_value());
+    REQUIRE(parser.pending() == "data: {\"partial\":");
+}
+
+TEST_CASE("SSE parser throughput", "[.][benchmark]") {
+    const std::string event =
+        "data: {\"id\":\"cmpl-abc\",\"object\":\"text_completion\",\"created\":1749700781,\"choices\":"
+        "[{\"text\":\" yes\",\"index\":0,\"logprobs\":{\"tokens\":[\" yes\"],\"token_logprobs\":[-0.3],"
+        "\"top_logprobs\":[{\" yes\":-0.3,\" no\":-1.5,\"\\n\":-2.1}],\"text_offset\":[10]},"
+        "\"finish_reason\":null}],\"model\":\"gpt-3.5-turbo-instruct\"}\n\n";
+    std::string stream;
+    while (stream.size() < (size_t{64} << 20)) {
+        stream += event;
+    }
+    // Roughly the size of the reads libcurl hands to the write callback
+    constexpr size_t read_size = 16 * 1024;
+
+    for (const auto* kernel: supported_scan_kernels()) {
+        SSEParser parser(*kernel);
+        size_t events = 0;
+        auto start = monotonic_clock::now();
+        for (size_t offset = 0; offset < stream.size(); offset += read_size) {
+            parser.feed(std::string_view(stream).substr(offset, read_size));
+            while (parser.next_event()) {
+                events++;
+            }
+        }
+        auto seconds = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+        REQUIRE(events == stream.size() / event.size());
+        std::cout << std::format("SSE parser ({}): {:.2f} GB/s, {} events in {:.3f}s\n",
+                                 kernel->name, stream.size() / seconds / 1e9, events, seconds);
+    }
+}
+
+TEST_CASE("SIMD scan kernels match the scalar kernel") {
+    // Small alphabet so delimiters, partial delimiters and near-miss needles are common
+    const std::string alphabet = "\n\n\r data:[DONE]x";
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> pick(0, alphabet.size() - 1);
+    std::uniform_int_distribution<size_t> length(0, 300);
+    const auto& scalar = scalar_scan_kernel();
+    const std::vector<std::string_view> needles = {"data:", "data: ", "[DONE]", "\n\n", "x"};
+
+    std::vector<std::string> streams;
+    for (int trial = 0; trial < 2000; ++trial) {
+        std::string data(length(rng), ' ');
+        for (auto& c: data) {
+            c = alphabet[pick(rng)];
+        }
+        streams.emplace_back(std::move(data));
+    }
+    for (const auto* kernel: supported_scan_kernels()) {
+        INFO(kernel->name);
+        for (const auto& data: streams) {
+            REQUIRE(kernel->find_event_end(data.data(), data.size()) ==
+                scalar.find_event_end(data.data(), data.size()));
+            for (auto needle: needles) {
+                REQUIRE(kernel->find_substring(data.data(), data.size(), needle) ==
+                    scalar.find_substring(data.data(), data.size(), needle));
+            }
+        }
+
+        std::uniform_int_distribution<size_t> read_size(1, 64);
+        for (const auto& data: streams) {
+            SSEParser scalar_parser(scalar);
+            SSEParser parser(*kernel);
+            auto size = read_size(rng);
+            REQUIRE(parse_all_events(parser, data, size) == parse_all_events(scalar_parser, data, size));
+            REQUIRE(parser.done() == scalar_parser.done());
+            REQUIRE(parser.pending() == scalar_parser.pending());
+        }
+    }
+}
+
+void require_same_completion(const CompletionResults& expected, const CompletionResults& actual) {
+    REQUIRE(actual.id == expected.id);
+    REQUIRE(actual.object == expected.object);
+    REQUIRE(actual.created == expected.created);
+    REQUIRE(actual.model == expected.model);
+    REQUIRE(actual.choices.size() == expected.choices.size());
+    for (size_t i = 0; i < expected.choices.size(); ++i) {
+        const auto& want = expected.choices[i];
+        const auto& got = actual.choices[i];
+        REQUIRE(got.text == want.text);
+        REQUIRE(got.index == want.index);
+        REQUIRE(got.finish_reason == want.finish_reason);
+        REQUIRE(got.logprobs.tokens == want.logprobs.tokens);
+        REQUIRE(got.logprobs.token_logprobs == want.logprobs.token_logprobs);
+        REQUIRE(got.logprobs.top_logprobs == want.logprobs.top_logprobs);
+    }
+}
+
+const std::string sample_chunk =
+    R"({"id":"cmpl-BhTOHw4rgxTfgXoZn4NFNgyZGfUPr","object":"text_completion","created":1749700781,)"
+    R"("choices":[{"text":"no","index":0,"logprobs":{"tokens":["no"],"token_logprobs":[-0.67217714],)"
+    R"("top_logprobs":[{"no":-0.67217714,"No":-1.3748653,"\n":-1.828057," no":-3.2456062,"\n\n":-4.7127924,)"
+    R"("été":-8.465514,"😀":-1.2e-05,"\"q\"\\":-11.467097}],"text_offset":[215]},)"
+    R"("finish_reason":"length"}],"model":"gpt-3.5-turbo-instruct:20230824-v2","usage":null})";
+
+TEST_CASE("On-demand chunk parser matches nlohmann") {
+    require_same_completion(CompletionResults(sample_chunk), parse_completion_chunk(sample_chunk));
+
+    // Random chunks with awkward strings and numbers, serialized by nlohmann itself
+    std::mt19937 rng(7);
+    const std::vector<std::string> pieces = {"a", " ", "\n", "\"", "\\", "/", "\t", "\x01", "é", "😀", "data: ", "}],"};
+    std::uniform_int_distribution<size_t> pick_piece(0, pieces.size() - 1);
+    std::uniform_int_distribution<int> small(0, 5);
+    std::uniform_real_distribution<double> mantissa(-1.0, 0.0);
+    std::uniform_int_distribution<int> magnitude(-12, 3);
+    auto random_string = [&] {
+        std::string str;
+        for (int i = small(rng); i > 0; --i) {
+            str += pieces[pick_piece(rng)];
+        }
+        return str;
+    };
+    auto random_logprob = [&]() -> double {
+        double value = mantissa(rng) * std::pow(10.0, magnitude(rng));
+        // Servers usually send float precision, nlohmann's own dump gives full double precision
+        return small(rng) % 2 ? static_cast<float>(value) : value;
+    };
+    for (int trial = 0; trial < 500; ++trial) {
+        json logprobs = {{"tokens", json::array()}, {"token_logprobs", json::array()},
+                         {"top_logprobs", json::array()}, {"text_offset", json::array()}};
+        for (int token = small(rng); token > 0; --token) {
+            logprobs["tokens"].push_back(random_string());
+            logprobs["token_logprobs"].push_back(random_logprob());
+            json tops = json::object();
+            for (int top = small(rng); top > 0; --top) {
+                tops[random_string()] = random_logprob();
+            }
+            logprobs["top_logprobs"].push_back(tops);
+            logprobs["text_offset"].push_back(trial);
+        }
+        json choice = {{"text", random_string()}, {"index", small(rng)}, {"logprobs", logprobs},
+                       {"finish_reason", small(rng) % 2 ? json(nullptr) : json("length")}};
+        json chunk = {{"id", random_string()}, {"object", "text_completion"}, {"created", 1749700781 + trial},
+                      {"choices", json::array({choice})}, {"model", random_string()}};
+        auto payload = chunk.dump(-1, ' ', trial % 2 == 0);
+        INFO(payload);
+        require_same_completion(CompletionResults(payload), parse_completion_chunk(payload));
+    }
+
+    REQUIRE_THROWS_AS(parse_completion_chunk(R"({"id":"x","choices":[)"), std::runtime_error);
+    REQUIRE_THROWS_AS(parse_completion_chunk(R"({"id":"x"})"), std::runtime_error);
+    REQUIRE_THROWS_AS(parse_completion_chunk(R"({"id":"\ud83d","choices":[]})"), std::runtime_error);
+}
+
+TEST_CASE("Chunk parser throughput", "[.][benchmark]") {
+    constexpr int iterations = 100'000;
+    for (auto parser: {ChunkParser::NLOHMANN, ChunkParser::ONDEMAND}) {
+        size_t choices = 0;
+        auto start = monotonic_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            choices += parse_completion_results(sample_chunk, parser).choices.size();
+        }
+        auto seconds = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+        REQUIRE(choices == iterations);
+        std::cout << std::format("{} parser: {:.0f} chunks/s, {:.2f} us/chunk\n",
+                                 parser == ChunkParser::NLOHMANN ? "nlohmann" : "ondemand",
+                                 iterations / seconds, seconds / iterations * 1e6);
+    }
+}
+
+TEST_CASE("Top logprobs are stored flat and sorted by logprob") {
+    auto results = parse_completion_chunk(sample_chunk);
+    const auto& tops = results.choices[0].logprobs.top_logprobs;
+    REQUIRE(tops.size() == 1);
+    auto position = tops[0];
+    REQUIRE(position.size() == 8);
+    REQUIRE(position.front().token == "😀");
+    float previous = 0;
+    for (auto [token, logprob]: position) {
+        REQUIRE(logprob <= previous);
+        previous = logprob;
+    }
+
+    TopLogprobs unsorted;
+    unsorted.begin_position();
+    unsorted.add("b", -2.0f);
+    unsorted.add("a", -2.0f);
+    unsorted.add("c", -0.5f);
+    unsorted.begin_position();
+    auto sorted = sort_top_logprobs(unsorted);
+    REQUIRE(sorted.size() == 2);
+    REQUIRE(sorted[1].empty());
+    std::vector<std::string> order;
+    for (auto [token, logprob]: sorted[0]) {
+        order.emplace_back(token);
+    }
+    REQUIRE(order == std::vector<std::string>{"c", "a", "b"});
+}
+
+TEST_CASE("MPMC ring buffer hands every item to exactly one consumer") {
+    MPMCRingBuffer<int> small(3);
+    REQUIRE(small.capacity() == 4);
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(small.push(i) == RingState::SUCCESS);
+    }
+    REQUIRE(small.push(4) == RingState::FULL);
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(small.fetch().content == i);
+    }
+    REQUIRE(small.fetch().state == RingState::EMPTY);
+    REQUIRE(small.is_empty());
+
+    constexpr int producers = 4;
+    constexpr int consumers = 4;
+    constexpr int per_producer = 100'000;
+    // Several chunks, so producers race to allocate them
+    auto ring = std::make_unique<MPMCRingBuffer<int>>(1024);
+    std::atomic<long long> sum = 0;
+    std::atomic<int> consumed = 0;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p] {
+            for (int i = 0; i < per_producer; ++i) {
+                while (ring->push(p * per_producer + i) == RingState::FULL) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&] {
+            while (consumed.load() < producers * per_producer) {
+                auto fetched = ring->fetch();
+                if (fetched.state == RingState::SUCCESS) {
+                    sum += fetched.content.value();
+                    consumed++;
+                }
+            }
+        });
+    }
+    for (auto& t: threads) {
+        t.join();
+    }
+    long long n = producers * per_producer;
+    REQUIRE(consumed == n);
+    REQUIRE(sum == n * (n - 1) / 2);
+}
+
+template<typename Wait>
+void require_blocking_handoff() {
+    // Small enough that producers fill it and have to wait on the consumers
+    MPMCRingBuffer<int, Wait> ring(8);
+    constexpr int producers = 3;
+    constexpr int per_producer = 20'000;
+    std::atomic<long long> sum = 0;
+    std::atomic<int> consumed = 0;
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < 3; ++c) {
+        consumers.emplace_back([&] {
+            while (auto value = ring.fetch_wait()) {
+                sum += value.value();
+                consumed++;
+            }
+        });
+    }
+    std::vector<std::thread> pushers;
+    for (int p = 0; p < producers; ++p) {
+        pushers.emplace_back([&, p] {
+            for (int i = 0; i < per_producer; ++i) {
+                ring.push_wait(p * per_producer + i);
+            }
+        });
+    }
+    for (auto& t: pushers) {
+        t.join();
+    }
+    ring.close();
+    for (auto& t: consumers) {
+        t.join();
+    }
+    long long n = producers * per_producer;
+    REQUIRE(consumed == n);
+    REQUIRE(sum == n * (n - 1) / 2);
+    REQUIRE(!ring.fetch_wait().has_value());
+}
+
+TEST_CASE("Blocking ring handoff drains everything before close releases consumers") {
+    SECTION("spin") {
+        require_blocking_handoff<SpinWait>();
+    }
+    SECTION("spin then wait") {
+        require_blocking_handoff<SpinThenWait>();
+    }
+    SECTION("block") {
+        require_blocking_handoff<BlockingWait>();
+    }
+    SECTION("a consumer asleep on an empty ring wakes up on close") {
+        MPMCRingBuffer<int, BlockingWait> ring(4);
+        std::optional<int> fetched = 0;
+        std::thread consumer([&] {
+            fetched = ring.fetch_wait();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ring.close();
+        consumer.join();
+        REQUIRE(!fetched.has_value());
+    }
+    SECTION("a timed fetch wakes for a push, a close or its deadline, whichever is first") {
+        MPMCRingBuffer<int, BlockingWait> ring(4);
+        std::vector<int> out;
+        auto start = monotonic_clock::now();
+        REQUIRE(ring.fetch_bulk_wait_until(out, 4, start + std::chrono::milliseconds(20)) == 0);
+        REQUIRE(monotonic_clock::now() - start >= std::chrono::milliseconds(20));
+
+        std::thread producer([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            ring.push(7);
+        });
+        start = monotonic_clock::now();
+        REQUIRE(ring.fetch_bulk_wait_until(out, 4, start + std::chrono::seconds(10)) == 1);
+        REQUIRE(monotonic_clock::now() - start < std::chrono::seconds(5));
+        REQUIRE(out == std::vector<int>{7});
+        producer.join();
+
+        std::thread closer([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            ring.close();
+        });
+        start = monotonic_clock::now();
+        REQUIRE(ring.fetch_bulk_wait_until(out, 4, start + std::chrono::seconds(10)) == 0);
+        REQUIRE(monotonic_clock::now() - start < std::chrono::seconds(5));
+        closer.join();
+    }
+}
+
+TEST_CASE("Streaming responses are sized from max_tokens and recycled") {
+    REQUIRE(stream_ring_capacity(1) == 8);
+    REQUIRE(stream_ring_capacity(100) == 128);
+    REQUIRE(stream_ring_capacity(1'000'000) == 1024);
+
+    StreamingResponsePool pool;
+    StreamingResponse* first;
+    {
+        auto resp = pool.acquire(8);
+        first = resp.get();
+        REQUIRE(resp->ring_capacity() == 8);
+        // More events than the ring holds, drained as they go like the workers do
+        for (int i = 0; i < 20; ++i) {
+            resp->push(StreamEvent{std::to_string(i), monotonic_clock::now()});
+            REQUIRE(resp->fetch().content->payload == std::to_string(i));
+        }
+        resp->push(StreamEvent{"left over", monotonic_clock::now()});
+        resp->parser.feed("data: partial");
+        resp->finalize();
+    }
+    REQUIRE(pool.idle() == 1);
+
+    auto reused = pool.acquire(4);
+    REQUIRE(reused.get() == first);
+    REQUIRE(pool.idle() == 0);
+    REQUIRE(!reused->done);
+    REQUIRE(!reused->check_producer_finished());
+    REQUIRE(reused->parser.pending().empty());
+    REQUIRE(reused->fetch().state == RingState::EMPTY);
+
+    // Too small for this request, so a new one is built
+    auto bigger = pool.acquire(64);
+    REQUIRE(bigger.get() != first);
+    REQUIRE(bigger->ring_capacity() == 64);
+
+    SECTION("idle responses are capped") {
+        StreamingResponsePool capped(2);
+        {
+            std::vector<std::shared_ptr<StreamingResponse>> in_flight;
+            for (int i = 0; i < 5; ++i) {
+                in_flight.emplace_back(capped.acquire(8));
+            }
+        }
+        REQUIRE(capped.idle() == 2);
+    }
+
+    SECTION("a response its own transfer thread releases isn't recycled") {
+        std::atomic<bool> dropped = false;
+        std::atomic<bool> released = false;
+        {
+            auto resp = pool.acquire(8);
+            resp->t = std::thread([held = resp, &dropped, &released]() mutable {
+                while (!dropped) {
+                    std::this_thread::yield();
+                }
+                held.reset();
+                released = true;
+            });
+        }
+        dropped = true;
+        while (!released) {
+            std::this_thread::yield();
+        }
+        REQUIRE(pool.idle() == 0);
+    }
+}
+
+TEST_CASE("A retried transfer starts its stream over") {
+    StreamingResponse resp(16);
+    auto now = monotonic_clock::now();
+    push_chunks(&resp, "data: first\n\ndata: cut o", now);
+    // The transfer timed out mid-event and is sent again
+    resp.retry();
+    REQUIRE(resp.parser.pending().empty());
+    push_chunks(&resp, "data: again\n\ndata: [DONE]\n\n", now);
+    resp.finalize();
+
+    std::vector<std::pair<std::string, uint32_t>> events;
+    while (auto event = resp.fetch_wait()) {
+        events.emplace_back(event->payload, event->attempt);
+    }
+    // The consumer may already hold "first", the attempt tells it that it's stale
+    REQUIRE(events == std::vector<std::pair<std::string, uint32_t>>{{"first", 0}, {"again", 1}});
+}
+
+TEST_CASE("Destroying an event loop fails the transfers it still holds") {
+    // Accepts connections but never answers, so transfers stay in flight
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    REQUIRE(listen(server, 8) == 0);
+    socklen_t addr_len = sizeof(addr);
+    getsockname(server, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+    auto url = std::format("http://127.0.0.1:{}/", ntohs(addr.sin_port));
+
+    std::mutex mu;
+    std::vector<CURLcode> results;
+    auto on_done = [&](CURL* easy, CURLcode res) {
+        std::lock_guard lock(mu);
+        results.emplace_back(res);
+        curl_easy_cleanup(easy);
+    };
+    {
+        CURLEventLoop loop;
+        for (int i = 0; i < 3; ++i) {
+            CURL* easy = curl_easy_init();
+            curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+            loop.submit(easy, on_done);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        REQUIRE(loop.in_flight() == 3);
+    }
+    close(server);
+    REQUIRE(results == std::vector<CURLcode>(3, CURLE_ABORTED_BY_CALLBACK));
+}
+
+// Answers every request with an empty event stream over keep-alive connections, and counts
+// the connections it accepted
+class KeepAliveServer {
+public:
+    KeepAliveServer() {
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        REQUIRE(bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        REQUIRE(listen(server, 16) == 0);
+        socklen_t addr_len = sizeof(addr);
+        getsockname(server, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+        url = std::format("http://127.0.0.1:{}/v1/completions", ntohs(addr.sin_port));
+        acceptor = std::thread([this] { accept_loop(); });
+    }
+
+    ~KeepAliveServer() {
+        shutdown(server, SHUT_RDWR);
+        acceptor.join();
+        close(server);
+        {
+            std::lock_guard lock(mu);
+            for (auto fd: clients) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        for (auto& t: handlers) {
+            t.join();
+        }
+        for (auto fd: clients) {
+            close(fd);
+        }
+    }
+
+    int connections() {
+        std::lock_guard lock(mu);
+        return static_cast<int>(clients.size());
+    }
+
+    std::string url;
+
+private:
+    void accept_loop() {
+        while (true) {
+            int client = accept(server, nullptr, nullptr);
+            if (client < 0) {
+                return;
+            }
+            std::lock_guard lock(mu);
+            clients.emplace_back(client);
+            handlers.emplace_back([client] { serve(client); });
+        }
+    }
+
+    static void serve(int client) {
+        constexpr std::string_view response =
+            "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nContent-Length: 14\r\n\r\ndata: [DONE]\n\n";
+        std::string received;
+        char buf[4096];
+        while (true) {
+            auto n = recv(client, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                return;
+            }
+            received.append(buf, n);
+            // Every request is a POST with a Content-Length body
+            while (true) {
+                auto headers_end = received.find("\r\n\r\n");
+                if (headers_end == std::string::npos) {
+                    break;
+                }
+                auto length_at = received.find("Content-Length: ");
+                size_t body = length_at < headers_end ? std::stoul(received.substr(length_at + 16)) : 0;
+                if (received.size() < headers_end + 4 + body) {
+                    break;
+                }
+                received.erase(0, headers_end + 4 + body);
+                send(client, response.data(), response.size(), MSG_NOSIGNAL);
+            }
+        }
+    }
+
+    int server;
+    std::thread acceptor;
+    std::mutex mu;
+    std::vector<int> clients;
+    std::vector<std::thread> handlers;
+};
+
+TEST_CASE("Warm handles keep their connections between requests, cold ones don't") {
+    KeepAliveServer server;
+
+    SECTION("a released handle comes back from its shard with its connection") {
+        CURLShare share(true);
+        ConnectionPool pool(share.get());
+        auto perform = [&](CURL* easy) {
+            curl_easy_setopt(easy, CURLOPT_URL, server.url.c_str());
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDS, "{}");
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, +[](char*, size_t size, size_t nmemb, void*) {
+                return size * nmemb;
+            });
+            REQUIRE(curl_easy_perform(easy) == CURLE_OK);
+            long new_connections = -1;
+            curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &new_connections);
+            return new_connections;
+        };
+
+        auto first = pool.acquire();
+        REQUIRE(perform(first.easy) == 1);
+        pool.release(first);
+        auto again = pool.acquire();
+        REQUIRE(again.easy == first.easy);
+        REQUIRE(again.shard == first.shard);
+        REQUIRE(perform(again.easy) == 0);
+
+        // A handle released on another thread still goes back to the shard it came from
+        auto other = pool.acquire();
+        REQUIRE(other.easy != again.easy);
+        std::thread([&] { pool.release(other); }).join();
+        REQUIRE(pool.acquire().easy == other.easy);
+        pool.release(other);
+        pool.release(again);
+        REQUIRE(server.connections() == 1);
+    }
+
+    auto send_requests = [&](TransportOptions transport) {
+        CURLHandler client(server.url.c_str(), "", std::nullopt, transport);
+        RequestParameters req;
+        for (int i = 0; i < 3; ++i) {
+            client.await(client.post_stream(req));
+        }
+    };
+
+    SECTION("threaded requests reuse one connection when warm, whatever shard they get") {
+        send_requests({.mode = TransportMode::THREAD_PER_REQUEST, .reuse_connections = true});
+        REQUIRE(server.connections() == 1);
+    }
+
+    SECTION("cold requests skip the pool and connect every time") {
+        send_requests({.mode = TransportMode::THREAD_PER_REQUEST, .reuse_connections = false});
+        REQUIRE(server.connections() == 3);
+        send_requests({.mode = TransportMode::EVENT_LOOP, .reuse_connections = false});
+        REQUIRE(server.connections() == 6);
+    }
+}
+
+template<typename Ring>
+double ring_ops_per_sec(std::unique_ptr<Ring> ring, int num_threads, int ops_per_thread) {
+    std::atomic<bool> go = false;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&] {
+            while (!go.load()) {
+            }
+            // Every thread pushes then pops, so the queue stays shallow and head and tail are
+            // both contended
+            for (int i = 0; i < ops_per_thread; ++i) {
+                while (ring->push(size_t(i)) != RingState::SUCCESS) {
+                    std::this_thread::yield();
+                }
+                while (ring->fetch().state != RingState::SUCCESS) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    auto start = monotonic_clock::now();
+    go = true;
+    for (auto& t: threads) {
+        t.join();
+    }
+    auto seconds = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+    return 2.0 * num_threads * ops_per_thread / seconds;
+}
+
+TEST_CASE("Ring buffer contention", "[.][benchmark]") {
+    constexpr int total_ops = 2'000'000;
+    for (int threads: {1, 2, 4, 8, 16, 32, 64}) {
+        auto legacy = ring_ops_per_sec(std::make_unique<LegacyRingBuffer<size_t, 65536>>(), threads,
+                                       total_ops / threads);
+        auto mpmc = ring_ops_per_sec(std::make_unique<MPMCRingBuffer<size_t>>(65536), threads, total_ops / threads);
+        // Without waiters to notify, pushes and fetches skip the fence
+        auto mpmc_spin = ring_ops_per_sec(std::make_unique<MPMCRingBuffer<size_t, SpinWait>>(65536), threads,
+                                          total_ops / threads);
+        std::cout << std::format(
+            "{:>2} threads: legacy {:>6.2f} Mops/s, mpmc {:>6.2f} Mops/s, mpmc spin-only {:>6.2f} Mops/s\n",
+            threads, legacy / 1e6, mpmc / 1e6, mpmc_spin / 1e6);
+    }
+}
+
+TEST_CASE("Bulk push and fetch move runs of values in order") {
+    MPMCRingBuffer<std::string> ring(4);
+    std::vector<std::string> items{"a", "b", "c", "d", "e", "f"};
+    // Only as many as fit are taken, the rest are left for the caller
+    REQUIRE(ring.push_bulk(items) == 4);
+    REQUIRE(items[4] == "e");
+    REQUIRE(ring.push_bulk(std::span(items).subspan(4)) == 0);
+
+    std::vector<std::string> fetched;
+    REQUIRE(ring.fetch_bulk(fetched, 3) == 3);
+    REQUIRE(fetched == std::vector<std::string>{"a", "b", "c"});
+    REQUIRE(ring.push_bulk(std::span(items).subspan(4)) == 2);
+    REQUIRE(ring.fetch_bulk(fetched, 10) == 3);
+    REQUIRE(fetched == std::vector<std::string>{"a", "b", "c", "d", "e", "f"});
+    REQUIRE(ring.fetch_bulk(fetched, 10) == 0);
+
+    // Bulk and single operations interleave across threads without losing anything
+    MPMCRingBuffer<int> shared(64);
+    constexpr int producers = 3;
+    constexpr int per_producer = 30'000;
+    std::atomic<long long> sum = 0;
+    std::atomic<int> consumed = 0;
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < 2; ++c) {
+        consumers.emplace_back([&, c] {
+            std::vector<int> batch;
+            while (true) {
+                if (c == 0) {
+                    if (shared.fetch_bulk_wait(batch, 16) == 0) {
+                        break;
+                    }
+                } else if (auto value = shared.fetch_wait()) {
+                    batch.emplace_back(value.value());
+                } else {
+                    break;
+                }
+                for (int value: batch) {
+                    sum += value;
+                }
+                consumed += static_cast<int>(batch.size());
+                batch.clear();
+            }
+        });
+    }
+    std::vector<std::thread> pushers;
+    for (int p = 0; p < producers; ++p) {
+        pushers.emplace_back([&, p] {
+            std::vector<int> batch;
+            for (int i = 0; i < per_producer; ++i) {
+                batch.emplace_back(p * per_producer + i);
+                if (batch.size() == static_cast<size_t>(p + 1) * 5) {
+                    shared.push_bulk_wait(batch);
+                    batch.clear();
+                }
+            }
+            shared.push_bulk_wait(batch);
+        });
+    }
+    for (auto& t: pushers) {
+        t.join();
+    }
+    shared.close();
+    for (auto& t: consumers) {
+        t.join();
+    }
+    long long n = producers * per_producer;
+    REQUIRE(consumed == n);
+    REQUIRE(sum == n * (n - 1) / 2);
+}
+
+// Nanoseconds per item moved from one producer thread to one consumer thread
+template<typename Ring>
+double one_to_one_ns_per_item(size_t batch_size, size_t total_items) {
+    Ring ring(4096);
+    auto start = monotonic_clock::now();
+    std::thread producer([&] {
+        std::vector<size_t> batch;
+        for (size_t i = 0; i < total_items; i += batch_size) {
+            batch.clear();
+            for (size_t j = i; j < std::min(i + batch_size, total_items); ++j) {
+                batch.emplace_back(j);
+            }
+            if (batch_size == 1) {
+                ring.push_wait(batch[0]);
+            } else {
+                ring.push_bulk_wait(batch);
+            }
+        }
+        ring.close();
+    });
+    size_t received = 0;
+    std::vector<size_t> out;
+    while (true) {
+        if (batch_size == 1) {
+            if (!ring.fetch_wait().has_value()) {
+                break;
+            }
+            received++;
+        } else {
+            out.clear();
+            auto fetched = ring.fetch_bulk_wait(out, batch_size);
+            if (fetched == 0) {
+                break;
+            }
+            received += fetched;
+        }
+    }
+    producer.join();
+    REQUIRE(received == total_items);
+    auto seconds = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+    return seconds * 1e9 / total_items;
+}
+
+TEST_CASE("Ring buffer bulk transfer", "[.][benchmark]") {
+    constexpr size_t total_items = 4'000'000;
+    for (size_t batch_size: {1, 4, 16, 64}) {
+        auto mpmc = one_to_one_ns_per_item<MPMCRingBuffer<size_t>>(batch_size, total_items);
+        auto spsc = one_to_one_ns_per_item<SPSCRingBuffer<size_t>>(batch_size, total_items);
+        std::cout << std::format("batch {:>3}: mpmc {:>6.2f} ns per item, spsc {:>6.2f} ns per item\n",
+                                 batch_size, mpmc, spsc);
+    }
+}
+
+TEST_CASE("SPSC ring keeps order between one producer and one consumer") {
+    SPSCRingBuffer<int> small(3);
+    REQUIRE(small.capacity() == 4);
+    std::vector<int> items{0, 1, 2, 3, 4};
+    REQUIRE(small.push_bulk(items) == 4);
+    REQUIRE(small.push(4) == RingState::FULL);
+    REQUIRE(small.fetch().content == 0);
+    REQUIRE(small.push(4) == RingState::SUCCESS);
+    std::vector<int> fetched;
+    REQUIRE(small.fetch_bulk(fetched, 10) == 4);
+    REQUIRE(fetched == std::vector<int>{1, 2, 3, 4});
+    REQUIRE(small.fetch().state == RingState::EMPTY);
+
+    // Mixed batch sizes on both sides, through a ring small enough to wrap constantly
+    SPSCRingBuffer<int> ring(16);
+    constexpr int total = 200'000;
+    std::thread producer([&] {
+        std::vector<int> batch;
+        for (int i = 0; i < total; ++i) {
+            if (i % 3 == 0) {
+                ring.push_bulk_wait(batch);
+                batch.clear();
+                ring.push_wait(i);
+                continue;
+            }
+            batch.emplace_back(i);
+            if (batch.size() == static_cast<size_t>(i % 7 + 1)) {
+                ring.push_bulk_wait(batch);
+                batch.clear();
+            }
+        }
+        ring.push_bulk_wait(batch);
+        ring.close();
+    });
+    bool in_order = true;
+    int expected = 0;
+    std::vector<int> batch;
+    while (true) {
+        batch.clear();
+        if (expected % 2 == 0) {
+            if (auto value = ring.fetch_wait()) {
+                batch.emplace_back(value.value());
+            } else {
+                break;
+            }
+        } else if (ring.fetch_bulk_wait(batch, 5) == 0) {
+            break;
+        }
+        for (int value: batch) {
+            in_order &= value == expected++;
+        }
+    }
+    producer.join();
+    REQUIRE(in_order);
+    REQUIRE(expected == total);
+}
+
+TEST_CASE("Work-stealing executor runs every task and idle workers steal") {
+    WorkStealingExecutor executor(4);
+    REQUIRE(executor.size() == 4);
+    std::atomic<int> ran = 0;
+    for (int i = 0; i < 1000; ++i) {
+        executor.submit([&] { ran++; });
+    }
+    executor.wait_idle();
+    REQUIRE(ran == 1000);
+
+    // Subtasks land on the parent's own deque, and the parent blocks its worker until they
+    // finish, so every one of them has to be stolen
+    constexpr int subtasks = 200;
+    std::atomic<int> finished = 0;
+    auto steals_before = executor.steals();
+    executor.submit([&] {
+        for (int i = 0; i < subtasks; ++i) {
+            executor.submit([&] {
+                if (finished.fetch_add(1) + 1 == subtasks) {
+                    finished.notify_all();
+                }
+            });
+        }
+        for (int done = finished.load(); done < subtasks; done = finished.load()) {
+            finished.wait(done);
+        }
+    });
+    executor.wait_idle();
+    REQUIRE(finished == subtasks);
+    REQUIRE(executor.steals() - steals_before >= subtasks);
+
+    // A crashing task doesn't take its worker down
+    executor.submit([] { throw std::runtime_error("expected by the test"); });
+    executor.submit([&] { ran++; });
+    executor.wait_idle();
+    REQUIRE(ran == 1001);
+}
+
+TEST_CASE("Executor against a thread per task", "[.][benchmark]") {
+    constexpr int tasks = 20'000;
+    std::atomic<size_t> choices = 0;
+    auto parse = [&] {
+        choices += parse_completion_chunk(sample_chunk).choices.size();
+    };
+
+    auto start = monotonic_clock::now();
+    for (int i = 0; i < tasks; ++i) {
+        std::thread(parse).join();
+    }
+    auto per_thread = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+
+    WorkStealingExecutor executor;
+    start = monotonic_clock::now();
+    for (int i = 0; i < tasks; ++i) {
+        executor.submit(parse);
+    }
+    executor.wait_idle();
+    auto pooled = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+
+    REQUIRE(choices == 2 * tasks);
+    std::cout << std::format("thread per task: {:.2f} us per task, executor ({} workers): {:.2f} us per task\n",
+                             per_thread * 1e6 / tasks, executor.size(), pooled * 1e6 / tasks);
+}
+
+task<int> add_on_executor(WorkStealingExecutor& executor, int a, int b) {
+    co_await executor.schedule();
+    co_return a + b;
+}
+
+task<int> sum_on_executor(WorkStealingExecutor& executor, int count) {
+    int sum = 0;
+    for (int i = 0; i < count; ++i) {
+        sum = co_await add_on_executor(executor, sum, i);
+    }
+    co_return sum;
+}
+
+task<void> throw_after_scheduling(WorkStealingExecutor& executor) {
+    co_await executor.schedule();
+    throw std::runtime_error("expected by the test");
+}
+
+TEST_CASE("Tasks chain across executor workers and rethrow into their awaiter") {
+    WorkStealingExecutor executor(2);
+    REQUIRE(sync_wait(sum_on_executor(executor, 1000)) == 999 * 1000 / 2);
+    REQUIRE_THROWS_AS(sync_wait(throw_after_scheduling(executor)), std::runtime_error);
+}
+
+task<std::vector<std::string>> consume_stream(std::shared_ptr<StreamingResponse> resp) {
+    std::vector<std::string> payloads;
+    while (auto event = co_await next_event(resp)) {
+        payloads.emplace_back(std::move(event->payload));
+    }
+    co_return payloads;
+}
+
+TEST_CASE("A coroutine consumes a stream in order and sees its end") {
+    constexpr int events = 10'000;
+    // Small enough that the producer regularly fills it while the coroutine is parked
+    auto resp = std::make_shared<StreamingResponse>(8);
+    std::thread producer([&] {
+        std::vector<StreamEvent> batch;
+        for (int i = 0; i < events; ++i) {
+            batch.emplace_back(StreamEvent{std::to_string(i), monotonic_clock::now()});
+            if (batch.size() == 5 || i % 7 == 0) {
+                resp->push_bulk(batch);
+                batch.clear();
+            }
+        }
+        resp->push_bulk(batch);
+        resp->finalize();
+    });
+    auto payloads = sync_wait(consume_stream(resp));
+    producer.join();
+
+    REQUIRE(payloads.size() == events);
+    for (int i = 0; i < events; ++i) {
+        REQUIRE(payloads[i] == std::to_string(i));
+    }
+    // A finalized, drained stream ends the loop straight away
+    REQUIRE(sync_wait(consume_stream(resp)).empty());
+}
+
+TEST_CASE("Metrics aggregator keeps running averages and a confusion matrix") {
+    MetricsAggregator aggregate;
+    REQUIRE(aggregate.avg_ttft() == 0);
+    REQUIRE(aggregate.accuracy() == 0);
+
+    LatencyMetrics latencies{};
+    latencies.ttft = 0.1;
+    latencies.end_to_end_latency = 1.0;
+    latencies.queue_delay = 0.5;
+    latencies.output_tokens = 1;
+    aggregate.add(latencies, 1, 1);
+
+    latencies.ttft = 0.3;
+    latencies.end_to_end_latency = 2.0;
+    latencies.queue_delay = 0;
+    latencies.output_tokens = 5;
+    latencies.time_per_output_token = 0.02;
+    aggregate.add(latencies, 1, 0);
+    aggregate.add(latencies, 0, std::nullopt);
+    aggregate.add(latencies, 0, 0);
+
+    REQUIRE(aggregate.count() == 4);
+    REQUIRE(aggregate.output_tokens() == 16);
+    auto close_to = [](double value, double expected) {
+        return std::abs(value - expected) < 1e-9;
+    };
+    REQUIRE(close_to(aggregate.avg_ttft(), 0.25));
+    REQUIRE(close_to(aggregate.avg_corrected_e2e_latency(), (1.5 + 3 * 2.0) / 4));
+    // The single token request has no TPOT
+    REQUIRE(close_to(aggregate.avg_tpot(), 0.02));
+    REQUIRE(close_to(aggregate.accuracy(), 50));
+
+    const auto& confusion = aggregate.confusion();
+    REQUIRE(confusion.count(1, 1) == 1);
+    REQUIRE(confusion.count(1, 0) == 1);
+    REQUIRE(confusion.count(0, 0) == 1);
+    REQUIRE(confusion.count(0, std::nullopt) == 1);
+    REQUIRE(confusion.count(0, 1) == 0);
+    REQUIRE(confusion.format().find("no match") != std::string::npos);
+}
+
+TEST_CASE("Arrival schedules keep the mean rate and repeat for a seed") {
+    constexpr size_t requests = 4000;
+    ArrivalOptions options{50.0};
+    options.seed = 7;
+
+    SECTION("the same seed gives the same schedule, another seed a different one") {
+        for (auto distribution: {ArrivalDistribution::POISSON, ArrivalDistribution::GAMMA}) {
+            options.distribution = distribution;
+            options.burstiness = 0.5;
+            auto schedule = build_arrival_schedule(options, requests);
+            REQUIRE(schedule == build_arrival_schedule(options, requests));
+            options.seed = 8;
+            REQUIRE(schedule != build_arrival_schedule(options, requests));
+            options.seed = 7;
+        }
+    }
+
+    SECTION("constant gaps are exact") {
+        options.request_rate = 4.0;
+        options.distribution = ArrivalDistribution::CONSTANT;
+        auto schedule = build_arrival_schedule(options, 100);
+        REQUIRE(schedule.size() == 100);
+        for (size_t i = 0; i < schedule.size(); ++i) {
+            REQUIRE(schedule[i] == std::chrono::milliseconds(250) * i);
+        }
+    }
+
+    SECTION("random gaps average out to the rate") {
+        for (auto [distribution, burstiness]: std::vector<std::pair<ArrivalDistribution, double>>{
+                 {ArrivalDistribution::POISSON, 1.0},
+                 {ArrivalDistribution::GAMMA, 0.5},
+                 {ArrivalDistribution::GAMMA, 4.0},
+             }) {
+            options.distribution = distribution;
+            options.burstiness = burstiness;
+            auto schedule = build_arrival_schedule(options, requests);
+            REQUIRE(schedule.front() == std::chrono::nanoseconds::zero());
+            REQUIRE(std::is_sorted(schedule.begin(), schedule.end()));
+            auto mean_gap = std::chrono::duration<double>(schedule.back()).count() / (requests - 1);
+            REQUIRE(std::abs(mean_gap - 1.0 / options.request_rate) < 0.1 / options.request_rate);
+        }
+    }
+
+    SECTION("a rate or burstiness that isn't positive throws") {
+        options.request_rate = 0;
+        REQUIRE_THROWS(build_arrival_schedule(options, 10));
+        options.request_rate = 50.0;
+        options.distribution = ArrivalDistribution::GAMMA;
+        options.burstiness = 0;
+        REQUIRE_THROWS(build_arrival_schedule(options, 10));
+        options.burstiness = -1;
+        REQUIRE_THROWS(build_arrival_schedule(options, 10));
+    }
+}
+
+TEST_CASE("Closed-loop pacer holds intended starts through a stall, then catches up") {
+    SECTION("without an interval requests are intended to start when they do") {
+        ClosedLoopPacer pacer(std::nullopt);
+        for (int i = 0; i < 5; ++i) {
+            auto before = monotonic_clock::now();
+            auto intended = pacer.next_intended_start();
+            REQUIRE(before <= intended);
+            REQUIRE(intended <= monotonic_clock::now());
+        }
+    }
+
+    SECTION("requests after a stall keep their slots until the schedule reaches now") {
+        constexpr auto interval = std::chrono::milliseconds(10);
+        ClosedLoopPacer pacer(interval);
+        auto first = pacer.next_intended_start();
+        std::this_thread::sleep_for(interval * 6);
+        for (int i = 1; i <= 5; ++i) {
+            REQUIRE(pacer.next_intended_start() == first + interval * i);
+        }
+        // Once the slots reach now, requests are intended to start when they're sent and
+        // never ahead of it
+        bool caught_up = false;
+        for (int i = 0; i < 1000 && !caught_up; ++i) {
+            auto before = monotonic_clock::now();
+            auto intended = pacer.next_intended_start();
+            REQUIRE(intended <= monotonic_clock::now());
+            caught_up = intended >= before;
+        }
+        REQUIRE(caught_up);
+    }
+}
+
+TEST_CASE("Direct JSON serialization prints values like nlohmann") {
+    std::vector<double> layouts = {
+        0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 1e-4, 1.5e-4, 9.99e-5, 2.4685e-05, 123456789012345.0,
+        1e15, 1e16, 1.25e16, 1454.664472547754, 0.014227551, 1e300, -3.5e-300, 42.0,
+        static_cast<double>(-0.1f), std::numeric_limits<double>::max(), std::numeric_limits<double>::denorm_min()
+    };
+    for (auto number: layouts) {
+        std::string ours;
+        append_json_number(ours, number);
+        REQUIRE(ours == json(number).dump());
+    }
+    // nlohmann's grisu2 digits are occasionally a digit longer than the shortest ones,
+    // so arbitrary values are only checked to read back as the same double
+    std::mt19937_64 rng(7);
+    std::uniform_real_distribution<double> mantissa(-10, 10);
+    std::uniform_int_distribution<int> exponent(-30, 30);
+    for (int i = 0; i < 20'000; ++i) {
+        auto number = mantissa(rng) * std::pow(10.0, exponent(rng));
+        std::string ours;
+        append_json_number(ours, number);
+        REQUIRE(json::parse(ours).get<double>() == number);
+        REQUIRE(ours.size() <= json(number).dump().size());
+    }
+
+    for (const auto& text: std::vector<std::string>{"", "plain", "quote \" and \\ backslash", "tabs\tand\nnewlines\r",
+                            std::string("\x01\x1f\x7f", 3), "caf\xc3\xa9"}) {
+        std::string ours;
+        append_json_string(ours, text);
+        REQUIRE(ours == json(text).dump());
+    }
+
+    std::string line;
+    JsonObjectWriter object(line);
+    object.field("a", 1.5);
+    object.field("b", true);
+    object.field("c", 3);
+    object.field("d", std::optional<float>());
+    object.field("e", "x");
+    object.end_line();
+    REQUIRE(line == R"({"a":1.5,"b":true,"c":3,"d":null,"e":"x"})" "\n");
+}
+
+TEST_CASE("Buffered JSONL writer writes every line in order across blocks and flushes") {
+    auto path = std::filesystem::temp_directory_path() / "scale_jsonl_writer_test.jsonl";
+    auto read_back = [&] {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), {});
+    };
+    std::string expected;
+    {
+        BlockFileWriter writer(path.c_str(), std::chrono::milliseconds(0));
+        for (int i = 0; i < 60'000; ++i) {
+            auto line = std::format("{{\"row\":{},\"padding\":\"{}\"}}\n", i, std::string(i % 97, 'x'));
+            writer.append(line);
+            expected += line;
+            // Partial blocks get flushed and then rewritten from their page boundary
+            if (i % 5000 == 0) {
+                writer.flush_if_due();
+                REQUIRE(writer.pending() == 0);
+                REQUIRE(read_back() == expected);
+            }
+        }
+        REQUIRE(expected.size() > 2 * BlockFileWriter::BlockSize);
+    }
+    REQUIRE(read_back() == expected);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Direct JSON serialization against nlohmann dump", "[.][benchmark]") {
+    constexpr int lines = 200'000;
+    auto start = monotonic_clock::now();
+    size_t dumped = 0;
+    for (int i = 0; i < lines; ++i) {
+        json j = json::object();
+        j["e2e_latency"] = 0.014202866 + i;
+        j["finish_reason"] = "length";
+        j["output_tokens"] = i;
+        j["prompt"] = "Is the following sentence pair semantically equivalent?\nPlease choose: yes, no";
+        j["ttft"] = 0.011330937;
+        dumped += j.dump().size();
+    }
+    auto nlohmann_seconds = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+
+    start = monotonic_clock::now();
+    std::string out;
+    size_t written = 0;
+    for (int i = 0; i < lines; ++i) {
+        out.clear();
+        JsonObjectWriter line(out);
+        line.field("e2e_latency", 0.014202866 + i);
+        line.field("finish_reason", "length");
+        line.field("output_tokens", i);
+        line.field("prompt", "Is the following sentence pair semantically equivalent?\nPlease choose: yes, no");
+        line.field("ttft", 0.011330937);
+        line.end_line();
+        written += out.size() - 1;
+    }
+    auto direct_seconds = std::chrono::duration<double>(monotonic_clock::now() - start).count();
+
+    REQUIRE(written == dumped);
+    std::cout << std::format("json tree + dump: {:.0f} ns per line, direct: {:.0f} ns per line\n",
+                             nlohmann_seconds * 1e9 / lines, direct_seconds * 1e9 / lines);
+}
+
+TEST_CASE("JSONL lines and columnar columns have the same fields") {
+    OutputRow row{};
+    row.e2e_latency = 1.25;
+    row.ttft = 0.125;
+    row.output_tokens = 3;
+    row.guessed_correctly = true;
+    row.finish_reason = "length";
+    row.id = "cmpl-1";
+    row.prompt = "Is \"this\" a paraphrase?";
+    row.text = "yes";
+    // "maybe" sorts between the fixed keys, "no" had no logprob
+    row.label_logprobs = {-0.5f, std::nullopt, -2.0f};
+    std::vector<std::string> labels = {"yes", "no", "maybe"};
+
+    std::string out;
+    append_output_line(out, row, labels);
+    REQUIRE(out.ends_with('\n'));
+    auto line = json::parse(out);
+    // Keys in the order nlohmann prints them, values printed like it does
+    REQUIRE(out == line.dump() + "\n");
+
+    std::vector<std::string> keys;
+    for (const auto& [key, _]: line.items()) {
+        keys.emplace_back(key);
+    }
+    std::vector<std::string> columns;
+    for (const auto& column: output_columns(labels)) {
+        if (column.name != "no_logprob") {
+            columns.emplace_back(column.name);
+        }
+    }
+    std::sort(columns.begin(), columns.end());
+    REQUIRE(keys == columns);
+    REQUIRE(line["e2e_latency"] == 1.25);
+    REQUIRE(line["output_tokens"] == 3);
+    REQUIRE(line["guessed_correctly"] == true);
+    REQUIRE(line["prompt"] == row.prompt);
+    REQUIRE(line["yes_logprob"] == -0.5);
+    REQUIRE(line["maybe_logprob"] == -2.0);
+}
+
+TEST_CASE("Columnar results read back through a mapping in row groups") {
+    auto path = std::filesystem::temp_directory_path() / "scale_columnar_test.bin";
+    constexpr int rows = 10;
+    auto make_row = [](int i) {
+        OutputRow row{};
+        row.e2e_latency = 0.5 + i;
+        row.ttft = 0.01 * i;
+        row.output_tokens = i;
+        row.guessed_correctly = i % 2 == 0;
+        row.finish_reason = i % 3 == 0 ? "length" : "";
+        row.prompt = std::string(i * 7, 'p');
+        row.text = std::format("answer {}", i);
+        // "no" is only in the logprobs of every other row
+        row.label_logprobs = {-0.25f * i, i % 2 == 0 ? std::optional<float>(-1.0f) : std::nullopt};
+        return row;
+    };
+    {
+        ColumnarFileWriter writer(path.c_str(), {"yes", "no"}, 4);
+        for (int i = 0; i < rows; ++i) {
+            writer.append(make_row(i));
+        }
+    }
+
+    ColumnarFile file(path.c_str());
+    REQUIRE(file.row_groups() == 3);
+    REQUIRE(file.rows(2) == 2);
+    REQUIRE(file.total_rows() == rows);
+    REQUIRE(file.columns().size() == output_columns({"yes", "no"}).size());
+    auto e2e = file.column_index("e2e_latency");
+    auto tokens = file.column_index("output_tokens");
+    auto correct = file.column_index("guessed_correctly");
+    auto finish_reason = file.column_index("finish_reason");
+    auto prompt = file.column_index("prompt");
+    auto text = file.column_index("text");
+    auto yes = file.column_index("yes_logprob");
+    auto no = file.column_index("no_logprob");
+    REQUIRE_THROWS(file.column_index("missing"));
+
+    int i = 0;
+    for (size_t group = 0; group < file.row_groups(); ++group) {
+        // Fixed-width columns are used in place, so they have to be aligned
+        REQUIRE(reinterpret_cast<uintptr_t>(file.values<double>(group, e2e).data()) % alignof(double) == 0);
+        for (size_t row = 0; row < file.rows(group); ++row, ++i) {
+            auto expected = make_row(i);
+            REQUIRE(file.values<double>(group, e2e)[row] == expected.e2e_latency);
+            REQUIRE(file.values<int32_t>(group, tokens)[row] == expected.output_tokens);
+            REQUIRE(static_cast<bool>(file.values<uint8_t>(group, correct)[row]) == expected.guessed_correctly);
+            REQUIRE(file.string(group, finish_reason, row) == expected.finish_reason);
+            REQUIRE(file.string(group, prompt, row) == expected.prompt);
+            REQUIRE(file.string(group, text, row) == expected.text);
+            REQUIRE(file.has_value(group, yes, row));
+            REQUIRE(file.values<float>(group, yes)[row] == expected.label_logprobs[0].value());
+            REQUIRE(file.has_value(group, no, row) == expected.label_logprobs[1].has_value());
+        }
+    }
+    REQUIRE(i == rows);
+
+    {
+        ColumnarFileWriter empty(path.c_str(), {});
+    }
+    ColumnarFile empty_file(path.c_str());
+    REQUIRE(empty_file.row_groups() == 0);
+    REQUIRE(empty_file.total_rows() == 0);
+
+    SECTION("a damaged file throws once it's mapped") {
+        std::string bytes;
+        {
+            std::ifstream in(path, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(in), {});
+        }
+        auto write = [&](const std::string& contents) {
+            std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+        };
+        auto wrong_version = bytes;
+        wrong_version[ColumnarMagic.size()] = 2;
+        write(wrong_version);
+        REQUIRE_THROWS(ColumnarFile(path.c_str()));
+
+        // The footer offset points at the trailer, which is too short to be a footer
+        auto header_size = ColumnarMagic.size() + 2 * sizeof(uint32_t);
+        auto truncated_footer = bytes.substr(0, header_size) + bytes.substr(bytes.size() - 16);
+        uint64_t footer_offset = header_size;
+        std::memcpy(truncated_footer.data() + header_size, &footer_offset, sizeof(footer_offset));
+        write(truncated_footer);
+        REQUIRE_THROWS(ColumnarFile(path.c_str()));
+    }
+
+    SECTION("a label listed twice would name two columns the same") {
+        REQUIRE_THROWS(output_columns({"yes", "no", "yes"}));
+        REQUIRE_THROWS(ColumnarFileWriter(path.c_str(), {"yes", "yes"}));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Dataset cache serves any row range a cached file covers") {
+    auto dir = std::filesystem::temp_directory_path() / "scale_dataset_cache_test";
+    std::filesystem::remove_all(dir);
+    DatasetCache cache(dir);
+    auto make_entry = [](int i) {
+        return json{
+            {"row_idx", i},
+            {"row", {{"sentence", std::format("sentence {}", i)}, {"label", i % 2}, {"idx", i}}},
+            {"truncated_cells", json::array()},
+        };
+    };
+    std::vector<json> entries;
+    for (int i = 0; i < 300; ++i) {
+        entries.emplace_back(make_entry(i));
+    }
+
+    DatasetCacheKey key{"nyu-mll/glue", "cola", "validation", 0, 300};
+    REQUIRE(key.filename() == "nyu-mll_glue.cola.validation.0-300.rows");
+    REQUIRE_FALSE(cache.load(key).has_value());
+    cache.store(key, entries);
+    REQUIRE(std::filesystem::exists(cache.path_for(key)));
+
+    auto all = cache.load(key);
+    REQUIRE(all.has_value());
+    REQUIRE(all->size() == 300);
+    for (int i = 0; i < 300; ++i) {
+        REQUIRE((*all)[i]["row"] == entries[i]["row"]);
+    }
+
+    // A narrower range comes out of the wider file
+    auto some = cache.load({"nyu-mll/glue", "cola", "validation", 100, 200});
+    REQUIRE(some.has_value());
+    REQUIRE(some->size() == 100);
+    REQUIRE((*some)[0]["row"]["idx"] == 100);
+    REQUIRE(some->back()["row"]["idx"] == 199);
+
+    // Rows the file doesn't have, or another split, miss
+    REQUIRE_FALSE(cache.load({"nyu-mll/glue", "cola", "validation", 0, 400}).has_value());
+    REQUIRE_FALSE(cache.load({"nyu-mll/glue", "cola", "train", 0, 100}).has_value());
+
+    // A split shorter than asked for is all there is, so it serves any longer range
+    std::vector<json> short_split(entries.begin(), entries.begin() + 43);
+    DatasetCacheKey short_key{"nyu-mll/glue", "cola", "train", 0, 43, true};
+    REQUIRE(short_key.filename() == "nyu-mll_glue.cola.train.0-43.end.rows");
+    cache.store(short_key, short_split);
+    auto whole = cache.load({"nyu-mll/glue", "cola", "train", 0, 100});
+    REQUIRE(whole.has_value());
+    REQUIRE(whole->size() == 43);
+    REQUIRE(whole->back()["row"] == entries[42]["row"]);
+    auto tail = cache.load({"nyu-mll/glue", "cola", "train", 40, 1000});
+    REQUIRE(tail.has_value());
+    REQUIRE(tail->size() == 3);
+    REQUIRE((*tail)[0]["row"]["idx"] == 40);
+    // Renaming a file that isn't flagged as complete doesn't make it so
+    auto renamed = dir / DatasetCacheKey{"nyu-mll/glue", "cola", "validation", 0, 300, true}.filename();
+    std::filesystem::copy_file(cache.path_for(key), renamed);
+    REQUIRE_THROWS(cache.load({"nyu-mll/glue", "cola", "validation", 0, 400}));
+    std::filesystem::remove(renamed);
+
+    // A file whose contents don't match its name is refused
+    std::filesystem::copy_file(cache.path_for(key), dir / DatasetCacheKey{"nyu-mll/glue", "cola", "test", 0, 300}.filename());
+    REQUIRE_THROWS(cache.load({"nyu-mll/glue", "cola", "test", 0, 300}));
+
+    // So is one with a row that isn't MessagePack anymore, with the same error as the rest
+    std::string bytes;
+    {
+        std::ifstream in(cache.path_for(key), std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    auto packed = json::to_msgpack(entries[150]["row"]);
+    auto row_at = bytes.find(std::string(packed.begin(), packed.end()));
+    REQUIRE(row_at != std::string::npos);
+    // 0xc1 is never used in MessagePack
+    bytes[row_at] = static_cast<char>(0xc1);
+    std::ofstream(cache.path_for(key), std::ios::binary | std::ios::trunc) << bytes;
+    REQUIRE_THROWS_AS(cache.load(key), std::runtime_error);
+    // Rows before it still load
+    REQUIRE(cache.load({"nyu-mll/glue", "cola", "validation", 0, 150}).has_value());
+
+    // A row count or first row that would wrap the index arithmetic is refused too. They
+    // sit after the magic and version, and flagging the file as the rest of the split lets a
+    // load ask for rows far past its end.
+    constexpr size_t flags_at = DatasetCacheMagic.size() + sizeof(uint32_t);
+    constexpr size_t first_row_at = flags_at + sizeof(uint32_t);
+    constexpr size_t row_count_at = first_row_at + sizeof(uint64_t);
+    auto damaged_path = dir / DatasetCacheKey{"nyu-mll/glue", "cola", "validation", 0, 300, true}.filename();
+    auto write_damaged = [&](size_t offset, uint64_t value) {
+        auto damaged = bytes;
+        uint32_t flags = DatasetCacheCompleteSplit;
+        std::memcpy(damaged.data() + flags_at, &flags, sizeof(flags));
+        std::memcpy(damaged.data() + offset, &value, sizeof(value));
+        std::ofstream(damaged_path, std::ios::binary | std::ios::trunc) << damaged;
+    };
+    DatasetCacheKey far{"nyu-mll/glue", "cola", "validation", uint64_t{1} << 40, (uint64_t{1} << 40) + 10};
+    write_damaged(row_count_at, uint64_t{1} << 61);
+    REQUIRE_THROWS_AS(cache.load(far), std::runtime_error);
+    write_damaged(row_count_at, std::numeric_limits<uint64_t>::max());
+    REQUIRE_THROWS_AS(cache.load(far), std::runtime_error);
+    write_damaged(first_row_at, std::numeric_limits<uint64_t>::max() - 100);
+    REQUIRE_THROWS_AS(cache.load(far), std::runtime_error);
+    std::filesystem::remove(damaged_path);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Pages fetched in parallel are delivered in order through rate limits") {
+    constexpr size_t last_page = 40;
+    constexpr size_t rows_per_page = 3;
+    std::atomic<int> rate_limited{0};
+    std::mutex mutex;
+    std::vector<bool> limited_once(last_page, false);
+    auto fetch = [&](size_t page) {
+        // Later pages answer sooner, so they arrive ahead of the ones before them
+        std::this_thread::sleep_for(std::chrono::microseconds((last_page - std::min(page, last_page)) * 50));
+        if (page >= last_page) {
+            return FetchedPage(PageStatus::END);
+        }
+        {
+            std::lock_guard lock(mutex);
+            if (page % 7 == 3 && !limited_once[page]) {
+                limited_once[page] = true;
+                rate_limited.fetch_add(1);
+                return FetchedPage(PageStatus::RATE_LIMITED);
+            }
+        }
+        FetchedPage fetched(PageStatus::OK);
+        for (size_t i = 0; i < rows_per_page; ++i) {
+            fetched.rows.emplace_back(json{{"row", {{"idx", page * rows_per_page + i}}}});
+        }
+        return fetched;
+    };
+
+    DownloadRateLimiter limiter(100'000, std::chrono::milliseconds(1), std::chrono::milliseconds(4));
+    PageFetchOptions options;
+    options.parallelism = 8;
+
+    SECTION("every page arrives once, in order") {
+        std::vector<size_t> delivered;
+        size_t next_idx = 0;
+        auto complete = fetch_pages_in_order(options, limiter, fetch, [&](size_t page, std::vector<json>&& rows) {
+            delivered.emplace_back(page);
+            for (auto& row: rows) {
+                REQUIRE(row["row"]["idx"] == next_idx++);
+            }
+            return true;
+        });
+        REQUIRE(complete);
+        REQUIRE(delivered.size() == last_page);
+        for (size_t i = 0; i < delivered.size(); ++i) {
+            REQUIRE(delivered[i] == i);
+        }
+        REQUIRE(rate_limited.load() > 0);
+    }
+
+    SECTION("deliver stops the download") {
+        size_t delivered = 0;
+        auto complete = fetch_pages_in_order(options, limiter, fetch, [&](size_t, std::vector<json>&&) {
+            return ++delivered < 5;
+        });
+        REQUIRE(delivered == 5);
+        REQUIRE_FALSE(complete);
+    }
+
+    SECTION("too many bad responses fail the download") {
+        options.retry_delay = std::chrono::milliseconds(1);
+        options.max_failed_requests = 3;
+        REQUIRE_THROWS(fetch_pages_in_order(options, limiter, [](size_t) {
+            return FetchedPage(PageStatus::BAD_RESPONSE);
+        }, [](size_t, std::vector<json>&&) { return true; }));
+    }
+}
+
+TEST_CASE("Local JSONL and CSV datasets stream their rows in order") {
+    auto dir = std::filesystem::temp_directory_path() / "scale_local_dataset_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    auto config_for = [&](const std::filesystem::path& path) {
+        return YAML::Load(std::format(R"(
+dataset:
+  path: {}
+pre_formatted_prompt: "Are these equivalent?\n{{}}"
+sentence_tags: [sentence1, sentence2]
+class_label:
+  tag: label
+  values:
+    - response: "yes"
+      id: 1
+    - response: "no"
+      id: 0
+request_params:
+  model: "m"
+  echo: false
+  temperature: 1
+  num_logprobs: 5
+  top_k: -1
+  stream: true
+)", path.string()));
+    };
+    auto read_all = [](DatasetParsingStrategy& dataset) {
+        dataset.start_download();
+        std::vector<DatasetRow> rows;
+        while (auto row = dataset.next_row()) {
+            rows.emplace_back(std::move(row.value()));
+        }
+        dataset.finish_download();
+        return rows;
+    };
+
+    SECTION("JSONL") {
+        auto path = dir / "rows.jsonl";
+        {
+            std::ofstream out(path);
+            for (int i = 0; i < 50; ++i) {
+                out << json{{"sentence1", std::format("a{}", i)}, {"sentence2", "b"}, {"label", i % 2}, {"extra", 1.5}}.dump() << "\n";
+                if (i == 10) {
+                    out << "\n";
+                }
+            }
+        }
+        JsonlDatasetParser dataset(config_for(path));
+        auto rows = read_all(dataset);
+        REQUIRE(rows.size() == 50);
+        for (int i = 0; i < 50; ++i) {
+            REQUIRE(rows[i].idx == i);
+            REQUIRE(rows[i].row.sentence(0) == std::format("a{}", i));
+            REQUIRE(rows[i].row.sentence(1) == "b");
+            REQUIRE(rows[i].row.label() == i % 2);
+        }
+
+        JsonlDatasetParser capped(config_for(path));
+        capped.max_rows = 7;
+        REQUIRE(read_all(capped).size() == 7);
+    }
+
+    SECTION("CSV with quoted fields") {
+        auto path = dir / "rows.csv";
+        {
+            std::ofstream out(path);
+            out << "idx,sentence1,label,sentence2\r\n";
+            out << "0,plain,1,second\r\n";
+            out << "1,\"has, a comma\",0,\"says \"\"hi\"\"\"\n";
+            out << "2,\"spans\ntwo lines\",1,\"\"\n";
+        }
+        CsvDatasetParser dataset(config_for(path));
+        auto rows = read_all(dataset);
+        REQUIRE(rows.size() == 3);
+        REQUIRE(rows[0].row.sentence(0) == "plain");
+        REQUIRE(rows[0].row.sentence(1) == "second");
+        REQUIRE(rows[0].row.label() == 1);
+        REQUIRE(rows[1].row.sentence(0) == "has, a comma");
+        REQUIRE(rows[1].row.sentence(1) == "says \"hi\"");
+        REQUIRE(rows[1].row.label() == 0);
+        REQUIRE(rows[2].row.sentence(0) == "spans\ntwo lines");
+        REQUIRE(rows[2].row.sentence(1).empty());
+    }
+
+    SECTION("a bad row fails the download") {
+        auto path = dir / "bad.csv";
+        {
+            std::ofstream out(path);
+            out << "sentence1,sentence2,label\n";
+            out << "a,b,1\n";
+            out << "a,b,maybe\n";
+        }
+        CsvDatasetParser dataset(config_for(path));
+        dataset.start_download();
+        // Rows are published a batch at a time, so the good row never went out either
+        REQUIRE_FALSE(dataset.next_row().has_value());
+        REQUIRE_THROWS(dataset.finish_download());
+    }
+
+#ifdef SCALE_WITH_ARROW
+    SECTION("Parquet across row groups") {
+        // A nested column ahead of the others, so their leaf and field indices differ, and
+        // the configured columns out of order
+        arrow::Int32Builder meta_a;
+        arrow::Int32Builder meta_b;
+        arrow::Int8Builder label;
+        arrow::LargeStringBuilder sentence2;
+        arrow::StringBuilder sentence1;
+        for (int i = 0; i < 10; ++i) {
+            PARQUET_THROW_NOT_OK(meta_a.Append(i));
+            PARQUET_THROW_NOT_OK(meta_b.Append(-i));
+            PARQUET_THROW_NOT_OK(label.Append(static_cast<int8_t>(i % 2)));
+            PARQUET_THROW_NOT_OK(sentence2.Append("b"));
+            PARQUET_THROW_NOT_OK(sentence1.Append(std::format("a{}", i)));
+        }
+        PARQUET_ASSIGN_OR_THROW(auto a, meta_a.Finish());
+        PARQUET_ASSIGN_OR_THROW(auto b, meta_b.Finish());
+        PARQUET_ASSIGN_OR_THROW(auto meta, arrow::StructArray::Make({a, b}, std::vector<std::string>{"a", "b"}));
+        PARQUET_ASSIGN_OR_THROW(auto labels, label.Finish());
+        PARQUET_ASSIGN_OR_THROW(auto second, sentence2.Finish());
+        PARQUET_ASSIGN_OR_THROW(auto first, sentence1.Finish());
+        auto table = arrow::Table::Make(
+            arrow::schema({
+                arrow::field("meta", meta->type()),
+                arrow::field("label", arrow::int8()),
+                arrow::field("sentence2", arrow::large_utf8()),
+                arrow::field("sentence1", arrow::utf8()),
+            }),
+            {meta, labels, second, first}
+        );
+        auto path = dir / "rows.parquet";
+        {
+            PARQUET_ASSIGN_OR_THROW(auto out, arrow::io::FileOutputStream::Open(path.string()));
+            // Row groups of 4 rows
+            PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(*table, arrow::default_memory_pool(), out, 4));
+        }
+
+        ParquetDatasetParser dataset(config_for(path));
+        auto rows = read_all(dataset);
+        REQUIRE(rows.size() == 10);
+        for (int i = 0; i < 10; ++i) {
+            REQUIRE(rows[i].idx == i);
+            REQUIRE(rows[i].row.sentence(0) == std::format("a{}", i));
+            REQUIRE(rows[i].row.sentence(1) == "b");
+            REQUIRE(rows[i].row.label() == i % 2);
+        }
+
+        ParquetDatasetParser capped(config_for(path));
+        capped.max_rows = 5;
+        REQUIRE(read_all(capped).size() == 5);
+
+        // A label that doesn't fit an int fails the download
+        arrow::UInt32Builder big_label;
+        arrow::StringBuilder one;
+        PARQUET_THROW_NOT_OK(big_label.Append(3'000'000'000u));
+        PARQUET_THROW_NOT_OK(one.Append("x"));
+        PARQUET_ASSIGN_OR_THROW(auto big_labels, big_label.Finish());
+        PARQUET_ASSIGN_OR_THROW(auto ones, one.Finish());
+        auto big_path = dir / "big_label.parquet";
+        {
+            auto big = arrow::Table::Make(
+                arrow::schema({
+                    arrow::field("sentence1", arrow::utf8()),
+                    arrow::field("sentence2", arrow::utf8()),
+                    arrow::field("label", arrow::uint32()),
+                }),
+                {ones, ones, big_labels}
+            );
+            PARQUET_ASSIGN_OR_THROW(auto out, arrow::io::FileOutputStream::Open(big_path.string()));
+            PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(*big, arrow::default_memory_pool(), out));
+        }
+        ParquetDatasetParser out_of_range(config_for(big_path));
+        out_of_range.start_download();
+        REQUIRE_FALSE(out_of_range.next_row().has_value());
+        REQUIRE_THROWS(out_of_range.finish_download());
+
+        // A struct column can't be a sentence
+        auto nested_config = config_for(path);
+        nested_config["sentence_tags"] = std::vector<std::string>{"sentence1", "meta"};
+        ParquetDatasetParser nested(nested_config);
+        nested.start_download();
+        REQUIRE_FALSE(nested.next_row().has_value());
+        REQUIRE_THROWS(nested.finish_download());
+    }
+#endif
+
+    SECTION("the format comes from the extension") {
+        Config::Dataset dataset;
+        dataset.path = "/data/x.parquet";
+        REQUIRE(local_dataset_format(dataset) == LocalDatasetFormat::PARQUET);
+        dataset.format = "csv";
+        REQUIRE(local_dataset_format(dataset) == LocalDatasetFormat::CSV);
+        dataset.path = "/data/x.txt";
+        dataset.format.clear();
+        REQUIRE_THROWS(local_dataset_format(dataset));
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Row store keeps only the configured columns and looks them up in place") {
+    std::vector<std::string> tags = {"sentence1", "sentence2"};
+    auto store = std::make_shared<RowStore>(tags.size(), 4);
+    store->add(json{{"sentence1", "first"}, {"sentence2", ""}, {"label", 1}, {"idx", 0}}, tags, "label");
+    std::vector<std::string_view> sentences = {"third", "fourth"};
+    store->add(sentences, 0);
+
+    REQUIRE(store->size() == 2);
+    REQUIRE(store->sentence(0, 0) == "first");
+    REQUIRE(store->sentence(0, 1).empty());
+    REQUIRE(store->sentence(1, 0) == "third");
+    REQUIRE(store->sentence(1, 1) == "fourth");
+    REQUIRE(store->label(0) == 1);
+    REQUIRE(store->label(1) == 0);
+
+    // A bad row is refused whole
+    REQUIRE_THROWS(store->add(json{{"sentence1", "x"}, {"label", 1}}, tags, "label"));
+    REQUIRE_THROWS(store->add(json{{"sentence1", "x"}, {"sentence2", 2}, {"label", 1}}, tags, "label"));
+    REQUIRE_THROWS(store->add(json{{"sentence1", "x"}, {"sentence2", "y"}, {"label", "1"}}, tags, "label"));
+    // Labels are kept as ints, so ones that don't fit aren't narrowed
+    REQUIRE_THROWS(store->add(json{{"sentence1", "x"}, {"sentence2", "y"}, {"label", int64_t{1} << 40}}, tags, "label"));
+    REQUIRE_THROWS(store->add(json{{"sentence1", "x"}, {"sentence2", "y"}, {"label", uint64_t{3'000'000'000}}}, tags, "label"));
+    REQUIRE_THROWS(store->add(json{{"sentence1", "x"}, {"sentence2", "y"}, {"label", std::numeric_limits<int64_t>::min()}}, tags, "label"));
+    REQUIRE(store->size() == 2);
+    REQUIRE(store->sentence(1, 1) == "fourth");
+
+    // Handles keep their batch alive after the store itself is gone
+    RowHandle handle(store, 1);
+    store.reset();
+    REQUIRE(handle.sentence_count() == 2);
+    REQUIRE(handle.sentence(0) == "third");
+    REQUIRE(handle.label() == 0);
+}
+
+TEST_CASE("Row store against JSON rows", "[.][benchmark]") {
+    constexpr int rows = 100'000;
+    std::vector<std::string> tags = {"sentence1", "sentence2"};
+    std::vector<json> dom;
+    RowStore store(tags.size(), rows);
+    for (int i = 0; i < rows; ++i) {
+        json row = {
+            {"sentence1", std::format("The quick brown fox number {} jumps over the lazy dog.", i)},
+            {"sentence2", std::format("A fast auburn fox, {}, leapt over a sleepy hound.", i)},
+            {"label", i % 2},
+            {"idx", i},
+        };
+        store.add(row, tags, "label");
+        dom.emplace_back(std::move(row));
+    }
+
+    auto time = [](auto&& f) {
+        auto start = monotonic_clock::now();
+        size_t total = f();
+        auto elapsed = std::chrono::duration<double, std::nano>(monotonic_clock::now() - start).count();
+        return std::make_pair(elapsed / rows, total);
+    };
+    // What fill_req_from_row used to do: copy the row, then look up every field
+    auto [dom_ns, dom_total] = time([&] {
+        size_t total = 0;
+        for (auto& entry: dom) {
+            auto row = entry;
+            for (const auto& tag: tags) {
+                total += row[tag].get_ref<const std::string&>().size();
+            }
+            total += row["label"].get<int>();
+        }
+        return total;
+    });
+    auto [store_ns, store_total] = time([&] {
+        size_t total = 0;
+        for (size_t i = 0; i < store.size(); ++i) {
+            for (size_t c = 0; c < tags.size(); ++c) {
+                total += store.sentence(i, c).size();
+            }
+            total += store.label(i);
+        }
+        return total;
+    });
+    REQUIRE(dom_total == store_total);
+    std::cout << std::format("Row lookup: json copy {:.1f} ns, row store {:.1f} ns, row store {} bytes/row\n",
+                             dom_ns, store_ns, store.memory_usage() / rows);
+}